@@ -5,10 +5,15 @@
 #include "crypto.h"
 #include "compression.h"
 #include "util/pathtools.h"
+#include "filelistpage.h"
+#include "folderjournal.h"
+#include "util/mappedfile.h"
+#include "packstore.h"
 #include <dirent.h>
 #include <iostream>
 #include <cstring>
 #include <cstdlib>
+#include <cstdio>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdexcept>
@@ -19,6 +24,8 @@
 
 using namespace std;
 
+std::atomic<bool> Archive::packing{false};
+
 Archive::Archive(const Archive& other)
 {
     *this = other;
@@ -27,14 +34,16 @@ Archive::Archive(const Archive& other)
 Archive::Archive(PathHash pathHash)
     : pathHash{pathHash}
 {
-    actualSize = 0;
     createDirectory(getFolderDataPath());
+    loadFiles();
+    pack = make_shared<PackStore>(getFolderDataPath()+"/pack/");
 }
 
 Archive::Archive(const std::vector<char>& data)
 {
     deserialize(data);
     createDirectory(getFolderDataPath());
+    pack = make_shared<PackStore>(getFolderDataPath()+"/pack/");
 }
 
 Archive::~Archive()
@@ -47,7 +56,13 @@ Archive& Archive::operator=(const Archive& other)
     lock_guard<std::recursive_mutex> lockother(other.mutex);
     pathHash = other.pathHash;
     actualSize = other.actualSize;
-    files = other.files;
+    fileCount = other.fileCount;
+    table = other.table;
+    changes = other.changes;
+    tree = other.tree;
+    treeBuilt = other.treeBuilt;
+    listPages.clear();
+    pack = other.pack;
     return *this;
 }
 
@@ -121,31 +136,170 @@ void Archive::deleteFolderRecursively(const char* name) const
 
 vector<char> Archive::serialize() const
 {
-    lock_guard<std::recursive_mutex> lock(mutex);
-    vector<char> data;
-    data.reserve(PathHash::hashlen+sizeof(actualSize)+files.size()*ArchiveFile::serializedSize());
-
-    serializeAppend(data, pathHash);
-    serializeAppend(data, actualSize);
-    for (const ArchiveFile& file : files)
-        file.serializeInto(data);
-
-    return data;
+    return pathHash.serialize();
 }
 
 void Archive::deserialize(const std::vector<char>& data)
 {
     lock_guard<std::recursive_mutex> lock(mutex);
     auto it = data.begin();
-    if (distance(it, data.end()) < (long)(PathHash::hashlen + sizeof(actualSize)))
+    if (distance(it, data.end()) < (long)PathHash::hashlen)
         throw runtime_error("Archive::deserialize: Invalid serialized metadata\n");
     pathHash = deserializeConsume<decltype(pathHash)>(it);
-    actualSize = deserializeConsume<decltype(actualSize)>(it);
+    loadFiles();
+    if (it == data.end())
+        return;
+
+    // Older databases kept the size and the files list here, they move to the files database on the next save
     size_t elemSize = ArchiveFile::serializedSize();
-    if (distance(it, data.end()) % elemSize != 0)
+    if (distance(it, data.end()) < (long)sizeof(actualSize) || (distance(it, data.end())-sizeof(actualSize)) % elemSize != 0)
         throw runtime_error("Archive::deserialize: Invalid serialized data\n");
-    for (int i=distance(it, data.end()) / elemSize; i; --i)
-        files.emplace_back(this, it);
+    it += sizeof(actualSize);
+    while (it != data.end())
+    {
+        ArchiveFile file(this, it);
+        addOrUpdateFile(file.getPathHash(), file.getMtime(), file.getActualSize());
+    }
+}
+
+void Archive::loadFiles()
+{
+    lock_guard<std::recursive_mutex> lock(mutex);
+    table = make_shared<MappedFile>(getFilesDbPath());
+    if (table->size() && (table->size() < sizeof(actualSize)
+                          || (table->size()-sizeof(actualSize)) % ArchiveFile::serializedSize() != 0))
+        throw runtime_error("Archive::loadFiles: Invalid files database "+getFilesDbPath());
+
+    actualSize = 0;
+    if (table->size())
+        memcpy(&actualSize, table->data(), sizeof(actualSize));
+    fileCount = tableCount();
+    changes.clear();
+    tree.clear();
+    treeBuilt = false;
+    listPages.clear();
+}
+
+bool Archive::hasUnsavedFiles() const
+{
+    lock_guard<std::recursive_mutex> lock(mutex);
+    return !changes.empty();
+}
+
+bool Archive::saveFiles()
+{
+    lock_guard<std::recursive_mutex> lock(mutex);
+    if (changes.empty())
+        return true;
+
+    vector<char> data;
+    data.reserve(sizeof(actualSize)+fileCount*ArchiveFile::serializedSize());
+    uint64ToData(data, actualSize);
+    forEachFile(0, MerkleTree::bucketCount, [&](const ArchiveFile& file)
+    {
+        file.serializeInto(data);
+    });
+
+    // Readers keep the old table mapped until we replace it, and a crash leaves either one complete table
+    string path = getFilesDbPath(), tmpPath = path+".tmp";
+    try {
+        FileLocker tmp(tmpPath);
+        if (!tmp.overwrite(data) || !tmp.sync())
+            return false;
+    } catch (...) {
+        return false;
+    }
+    if (rename(tmpPath.c_str(), path.c_str()) < 0)
+        return false;
+
+    // The tree and pages describe the same files, they stay valid
+    table = make_shared<MappedFile>(path);
+    changes.clear();
+    return true;
+}
+
+size_t Archive::tableCount() const
+{
+    if (table->size() < sizeof(actualSize))
+        return 0;
+    return (table->size()-sizeof(actualSize)) / ArchiveFile::serializedSize();
+}
+
+const char* Archive::tableRecord(size_t pos) const
+{
+    return table->data() + sizeof(actualSize) + pos*ArchiveFile::serializedSize();
+}
+
+size_t Archive::tableLowerBound(const PathHash& filePath) const
+{
+    size_t first = 0, count = tableCount();
+    while (count)
+    {
+        size_t step = count/2;
+        if (PathHash((uint8_t*)tableRecord(first+step)) < filePath)
+        {
+            first += step+1;
+            count -= step+1;
+        }
+        else
+        {
+            count = step;
+        }
+    }
+    return first;
+}
+
+void Archive::forEachFile(unsigned firstBucket, unsigned endBucket, const std::function<void(const ArchiveFile&)>& f) const
+{
+    // Buckets take the first bits of the hash, so each one is a range of the table and of the changes
+    auto bucketStart = [](unsigned bucket)
+    {
+        uint8_t hash[PathHash::hashlen] = {0};
+        unsigned prefix = bucket << (16 - 4*MerkleTree::depth);
+        hash[0] = prefix >> 8;
+        hash[1] = prefix & 0xFF;
+        return PathHash(hash);
+    };
+    PathHash first = bucketStart(firstBucket);
+    size_t pos = tableLowerBound(first);
+    size_t tableEnd = endBucket < MerkleTree::bucketCount ? tableLowerBound(bucketStart(endBucket)) : tableCount();
+    auto it = changes.lower_bound(first);
+    auto changesEnd = endBucket < MerkleTree::bucketCount ? changes.lower_bound(bucketStart(endBucket)) : changes.end();
+
+    while (pos < tableEnd)
+    {
+        ArchiveFile file(this, tableRecord(pos));
+        if (it == changesEnd || file.getPathHash() < it->first)
+        {
+            f(file);
+            ++pos;
+            continue;
+        }
+
+        // The change replaces the table's version of the file, if any
+        if (file.getPathHash() == it->first)
+            ++pos;
+        if (!it->second.removed)
+            f(ArchiveFile(this, it->first, it->second.mtime, it->second.size));
+        ++it;
+    }
+    for (; it != changesEnd; ++it)
+        if (!it->second.removed)
+            f(ArchiveFile(this, it->first, it->second.mtime, it->second.size));
+}
+
+const MerkleTree& Archive::getTree() const
+{
+    if (!treeBuilt)
+    {
+        tree.clear();
+        forEachFile(0, MerkleTree::bucketCount, [&](const ArchiveFile& file)
+        {
+            tree.add(file.getPathHash(), file.getMtime());
+        });
+        treeBuilt = true;
+    }
+    return tree;
 }
 
 PathHash Archive::getPathHash() const
@@ -162,21 +316,122 @@ uint64_t Archive::getActualSize() const
 size_t Archive::getFileCount() const
 {
     lock_guard<std::recursive_mutex> lock(mutex);
-    return files.size();
+    return fileCount;
 }
 
-ArchiveFile *Archive::getFile(PathHash pathHash)
+unique_ptr<ArchiveFile> Archive::getFile(PathHash pathHash) const
 {
-    auto it = find_if(begin(files), end(files), [&pathHash](const ArchiveFile& f){return f.getPathHash()==pathHash;});
-    if (it == end(files))
+    lock_guard<std::recursive_mutex> lock(mutex);
+    auto it = changes.find(pathHash);
+    if (it != changes.end())
+    {
+        if (it->second.removed)
+            return nullptr;
+        return unique_ptr<ArchiveFile>(new ArchiveFile(this, pathHash, it->second.mtime, it->second.size));
+    }
+
+    size_t pos = tableLowerBound(pathHash);
+    if (pos == tableCount())
         return nullptr;
-    return &*it;
+    unique_ptr<ArchiveFile> file(new ArchiveFile(this, tableRecord(pos)));
+    if (!(file->getPathHash() == pathHash))
+        return nullptr;
+    return file;
 }
 
-const std::vector<ArchiveFile> &Archive::getFiles() const
+std::vector<ArchiveFile> Archive::getFiles() const
 {
     lock_guard<std::recursive_mutex> lock(mutex);
-    return files;
+    vector<ArchiveFile> result;
+    result.reserve(fileCount);
+    forEachFile(0, MerkleTree::bucketCount, [&](const ArchiveFile& file)
+    {
+        result.push_back(file);
+    });
+    return result;
+}
+
+std::vector<ArchiveFile> Archive::getFilesInBuckets(const std::vector<uint16_t>& buckets) const
+{
+    vector<uint16_t> wanted = buckets;
+    sort(wanted.begin(), wanted.end());
+    wanted.erase(unique(wanted.begin(), wanted.end()), wanted.end());
+    wanted.erase(lower_bound(wanted.begin(), wanted.end(), MerkleTree::bucketCount), wanted.end());
+
+    lock_guard<std::recursive_mutex> lock(mutex);
+    vector<ArchiveFile> result;
+    for (uint16_t bucket : wanted)
+    {
+        forEachFile(bucket, bucket+1, [&](const ArchiveFile& file)
+        {
+            result.push_back(file);
+        });
+    }
+    return result;
+}
+
+std::vector<std::vector<char>> Archive::getListPages(const std::vector<uint16_t>& buckets, size_t pageFiles) const
+{
+    vector<uint16_t> wanted = buckets;
+    if (wanted.empty())
+        for (unsigned i=0; i<MerkleTree::bucketCount; ++i)
+            wanted.push_back(i);
+    sort(wanted.begin(), wanted.end());
+    wanted.erase(unique(wanted.begin(), wanted.end()), wanted.end());
+    wanted.erase(lower_bound(wanted.begin(), wanted.end(), MerkleTree::bucketCount), wanted.end());
+
+    lock_guard<std::recursive_mutex> lock(mutex);
+    if (listPages.empty())
+        listPages.resize(MerkleTree::bucketCount);
+
+    // Encode the buckets that changed since we last did, each one is a range of our sorted files
+    for (uint16_t bucket : wanted)
+    {
+        if (!listPages[bucket].empty())
+            continue;
+        vector<FileTime> bucketFiles;
+        forEachFile(bucket, bucket+1, [&](const ArchiveFile& file)
+        {
+            FileTime f;
+            f.hash = file.getPathHash();
+            f.mtime = file.getMtime();
+            bucketFiles.push_back(f);
+        });
+        listPages[bucket] = FileListPage::encode(bucketFiles.cbegin(), bucketFiles.cend());
+    }
+
+    // Buckets are in hash order, so their pages are too. Each packet gets whole pages.
+    vector<vector<char>> result;
+    size_t resultFiles = 0;
+    for (uint16_t bucket : wanted)
+    {
+        const vector<char>& page = listPages[bucket];
+        size_t count;
+        parseVUint(page.data(), page.size(), count);
+        if (!count)
+            continue;
+        if (result.empty() || resultFiles + count > pageFiles)
+        {
+            result.emplace_back();
+            resultFiles = 0;
+        }
+        result.back().insert(result.back().end(), page.begin(), page.end());
+        resultFiles += count;
+    }
+    return result;
+}
+
+std::vector<uint64_t> Archive::getTreeChildren(unsigned level, const std::vector<uint16_t>& indices) const
+{
+    lock_guard<std::recursive_mutex> lock(mutex);
+    vector<uint64_t> result;
+    result.reserve(indices.size()*MerkleTree::fanout);
+    for (uint16_t index : indices)
+    {
+        vector<uint64_t> children = getTree().getChildren(level, index);
+        result.insert(result.end(), children.begin(), children.end());
+    }
+    return result;
 }
 
 std::string Archive::getFilesDbPath() const
@@ -191,54 +446,246 @@ std::string Archive::getFolderDataPath() const
     return dataPath()+"archive/"+pathHash.toBase64();
 }
 
+std::string Archive::getArchiveFilePath(const PathHash& filePath) const
+{
+    string pathHashStr = filePath.toBase64();
+    return getFolderDataPath()+'/'+pathHashStr.substr(0,2)+'/'+pathHashStr.substr(2);
+}
+
+void Archive::setJournal(FolderJournal* newJournal)
+{
+    lock_guard<std::recursive_mutex> lock(mutex);
+    journal = newJournal;
+}
+
+void Archive::invalidateListPage(const PathHash& filePath)
+{
+    if (!listPages.empty())
+        listPages[MerkleTree::bucketIndex(filePath)].clear();
+}
+
 void Archive::removeData() const
 {
     lock_guard<std::recursive_mutex> lock(mutex);
     deleteFolderRecursively((dataPath()+"archive/"+pathHash.toBase64()).c_str());
 }
 
-void Archive::writeArchiveFile(const PathHash& filePath, uint64_t mtime, const std::vector<char>& data)
+void Archive::setPacking(bool enabled)
 {
-    lock_guard<std::recursive_mutex> lock(mutex);
+    packing = enabled;
+}
 
-    auto it = find_if(begin(files), end(files), [&filePath](const ArchiveFile& f){return f.getPathHash()==filePath;});
+Archive::DataReader Archive::openArchiveFile(const PathHash& filePath, uint64_t& size) const
+{
+    // Packed files are small, we read them at once
+    auto packed = make_shared<vector<char>>();
+    if (pack->read(filePath, *packed))
+    {
+        size = packed->size();
+        return [packed](uint64_t pos, uint64_t size)
+        {
+            if (pos >= packed->size())
+                return vector<char>();
+            size = min<uint64_t>(size, packed->size()-pos);
+            return vector<char>(packed->begin()+pos, packed->begin()+pos+size);
+        };
+    }
 
-    if (it == end(files))
+    // Writers replace the file instead of changing it, so we keep reading the version we opened
+    shared_ptr<FileLocker> file = make_shared<FileLocker>(getArchiveFilePath(filePath), FileLocker::ReadOnly);
+    size = file->size();
+    return [file](uint64_t pos, uint64_t size)
     {
-        actualSize += data.size();
-        files.emplace_back(this, filePath, mtime, data);
+        return file->read(pos, size);
+    };
+}
+
+void Archive::writeArchiveFile(const PathHash& filePath, uint64_t mtime, const std::vector<char>& data, bool durable)
+{
+    // The pack's version of a file wins over its own file, so we remove the one we don't write
+    string pathHashStr = filePath.toBase64();
+    if (packing && data.size() <= PACK_MAX_FILE_SIZE)
+    {
+        if (!pack->write(filePath, data, durable))
+            throw runtime_error("Archive::writeArchiveFile: Failed to pack "+pathHashStr);
+        unlink(getArchiveFilePath(filePath).c_str());
     }
     else
     {
-        actualSize -= it->getActualSize();
-        actualSize += data.size();
-        it->overwrite(mtime, data);
+        // Downloads of the old version may still be reading it, so we write a new file and rename it over the old one
+        createPathTo(getFolderDataPath(), pathHashStr.substr(0,2)+'/'+pathHashStr.substr(2));
+        string fullPath = getArchiveFilePath(filePath), tmpPath = fullPath+".tmp";
+        FileLocker file{tmpPath};
+        if (!file.overwrite(data) || (durable && !file.sync()) || rename(tmpPath.c_str(), fullPath.c_str()) < 0
+                || !pack->remove(filePath))
+            throw runtime_error("Archive::writeArchiveFile: Failed to write "+pathHashStr);
+    }
+
+    uint64_t record;
+    FolderJournal* recordJournal;
+    {
+        lock_guard<std::recursive_mutex> lock(mutex);
+        record = addOrUpdateFile(filePath, mtime, data.size());
+        recordJournal = journal;
     }
+    if (durable)
+        syncRecord(recordJournal, record);
 }
 
-bool Archive::removeArchiveFile(const PathHash& pathHash)
+unique_ptr<FileLocker> Archive::beginArchiveFile(const PathHash& filePath) const
+{
+    string pathHashStr = filePath.toBase64();
+    createPathTo(getFolderDataPath(), pathHashStr.substr(0,2)+'/'+pathHashStr.substr(2));
+    unique_ptr<FileLocker> file{new FileLocker(getArchiveFilePath(filePath)+".part")};
+    if (!file->truncate())
+        throw runtime_error("Archive::beginArchiveFile: Failed to truncate "+pathHashStr);
+    return file;
+}
+
+unique_ptr<FileLocker> Archive::resumeArchiveFile(const PathHash& filePath, uint64_t maxChunks, uint64_t& chunks) const
 {
-    string path = pathHash.toBase64();
-    string hashdirPath = getFolderDataPath()+"/"+path.substr(0,2);
-    string hashfilePath = hashdirPath+"/"+path.substr(2);
+    string partPath = getArchiveFilePath(filePath)+".part";
+    if (access(partPath.c_str(), F_OK) < 0)
+        return nullptr;
+    unique_ptr<FileLocker> file{new FileLocker(partPath)};
 
-    auto it = find_if(begin(files), end(files), [=](const ArchiveFile& f)
+    // The connection may have dropped in the middle of a chunk, we only keep whole ones
+    auto read = [&file](uint64_t pos, uint64_t size)
     {
-        return f.getPathHash()==pathHash;
-    });
-    if (it == end(files))
+        return file->read(pos, size);
+    };
+    uint64_t end = skipChunks(read, file->size(), maxChunks, chunks);
+    if (!end)
+        return nullptr;
+    if (!file->truncate(end))
+        throw runtime_error("Archive::resumeArchiveFile: Failed to truncate "+filePath.toBase64());
+    return file;
+}
+
+uint64_t Archive::skipChunks(const DataReader& read, uint64_t size, uint64_t maxChunks, uint64_t& chunks)
+{
+    uint64_t pos = 0;
+    // The metadata and each chunk are prefixed by their vuint size
+    auto skipFrame = [&]()
+    {
+        vector<char> header = read(pos, sizeof(uint64_t)+2);
+        size_t frameSize;
+        size_t headerSize = parseVUint(header.data(), header.size(), frameSize);
+        if (!headerSize || size-pos-headerSize < frameSize)
+            return false;
+        pos += headerSize+frameSize;
+        return true;
+    };
+
+    chunks = 0;
+    if (!skipFrame())
+        return 0;
+    while (chunks < maxChunks && skipFrame())
+        chunks++;
+    return pos;
+}
+
+void Archive::commitArchiveFile(const PathHash& filePath, uint64_t mtime, uint64_t size, bool durable)
+{
+    uint64_t record;
+    FolderJournal* recordJournal;
+    {
+        lock_guard<std::recursive_mutex> lock(mutex);
+
+        string fullPath = getArchiveFilePath(filePath);
+        if (rename((fullPath+".part").c_str(), fullPath.c_str()) < 0)
+            throw runtime_error("Archive::commitArchiveFile: Failed to rename "+fullPath);
+        if (!pack->remove(filePath))
+            throw runtime_error("Archive::commitArchiveFile: Failed to unpack "+filePath.toBase64());
+        record = addOrUpdateFile(filePath, mtime, size);
+        recordJournal = journal;
+    }
+    if (durable)
+        syncRecord(recordJournal, record);
+}
+
+void Archive::syncRecord(FolderJournal* recordJournal, uint64_t record) const
+{
+    if (recordJournal && (!record || !recordJournal->sync(record)))
+        throw runtime_error("Archive::syncRecord: Failed to sync the journal of "+pathHash.toBase64());
+}
+
+uint64_t Archive::addOrUpdateFile(const PathHash& filePath, uint64_t mtime, uint64_t size)
+{
+    uint64_t record = journal ? journal->fileSet(pathHash, filePath, mtime, size) : 0;
+    invalidateListPage(filePath);
+    unique_ptr<ArchiveFile> file = getFile(filePath);
+    if (!file)
+    {
+        ++fileCount;
+        if (treeBuilt)
+            tree.add(filePath, mtime);
+    }
+    else
+    {
+        actualSize -= file->getActualSize();
+        if (treeBuilt)
+            tree.update(filePath, file->getMtime(), mtime);
+    }
+    actualSize += size;
+    changes[filePath] = {mtime, size, false};
+    return record;
+}
+
+bool Archive::removeFile(const PathHash& filePath)
+{
+    unique_ptr<ArchiveFile> file = getFile(filePath);
+    if (!file)
         return false;
+    if (journal)
+        journal->fileRemoved(pathHash, filePath);
+    actualSize -= file->getActualSize();
+    --fileCount;
+    if (treeBuilt)
+        tree.remove(filePath, file->getMtime());
+    invalidateListPage(filePath);
+    changes[filePath] = {0, 0, true};
+    return true;
+}
 
-    actualSize -= it->getActualSize();
-    files.erase(it);
+bool Archive::removeArchiveFile(const PathHash& pathHash)
+{
+    lock_guard<std::recursive_mutex> lock(mutex);
+    string hashfilePath = getArchiveFilePath(pathHash);
 
-    try {
-        FileLocker filel(hashfilePath);
-        return filel.remove();
-    } catch (...)
+    if (!removeFile(pathHash))
+        return false;
+
+    // Killed between writing a packed version and unlinking the old one, we may have both
+    if (pack->contains(pathHash))
+    {
+        unlink(hashfilePath.c_str());
+        return pack->remove(pathHash);
+    }
+    // Downloads that opened the file keep reading it after the unlink
+    if (unlink(hashfilePath.c_str()) < 0)
     {
         cout << "Folder::removeArchiveFile: File "<<hashfilePath<<" not found"<<endl;
         return false;
     }
+    return true;
 }
 
+
+std::vector<bool> Archive::removeArchiveFiles(const std::vector<PathHash>& pathHashes)
+{
+    vector<bool> removed(pathHashes.size());
+
+    lock_guard<std::recursive_mutex> lock(mutex);
+    for (size_t i=0; i<pathHashes.size(); ++i)
+    {
+        if (!removeFile(pathHashes[i]))
+            continue;
+        bool packed = pack->contains(pathHashes[i]);
+        bool unlinked = unlink(getArchiveFilePath(pathHashes[i]).c_str()) == 0;
+        removed[i] = packed ? pack->remove(pathHashes[i]) : unlinked;
+        if (!removed[i])
+            cout << "Folder::removeArchiveFiles: File "<<getArchiveFilePath(pathHashes[i])<<" not found"<<endl;
+    }
+    return removed;
+}
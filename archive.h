@@ -3,15 +3,32 @@
 
 #include <string>
 #include <vector>
+#include <memory>
 #include <mutex>
+#include <map>
+#include <atomic>
+#include <functional>
 #include "archivefile.h"
+#include "merkletree.h"
 #include "crypto.h"
 
 class Server;
+class FileLocker;
+class FolderJournal;
+class MappedFile;
+class PackStore;
 
 /// Metadata about an archived folder, a set of compressed encrypted files.
+/// Archives are thread-safe, several clients may read and write the same archive
+/// The files list is a table sorted by hash in the files database, which we map in memory instead of reading it,
+/// plus the changes made since it was written. FolderDB writes the table again when it saves a snapshot.
+/// Each file's data is a file of its own, or a record in the pack segments for small files, see PackStore
 class Archive
 {
+public:
+    /// Reads up to size bytes at pos of a file's data
+    using DataReader = std::function<std::vector<char>(uint64_t pos, uint64_t size)>;
+
 public:
     Archive(const Archive& other);
     explicit Archive(PathHash pathHash); ///< Construct an empty archive
@@ -19,32 +36,99 @@ public:
     ~Archive();
     Archive& operator=(const Archive& other);
 
-    std::vector<char> serialize() const;
+    std::vector<char> serialize() const; ///< Only the path hash, the files list is saved by saveFiles
     void deserialize(const std::vector<char>& data);
 
     PathHash getPathHash() const;
     uint64_t getActualSize() const;
     size_t getFileCount() const;
-    ArchiveFile* getFile(PathHash filePathHash);
-    const std::vector<ArchiveFile>& getFiles() const;
+    /// Returns a copy of the file's metadata, or nullptr if there is no such file
+    std::unique_ptr<ArchiveFile> getFile(PathHash filePathHash) const;
+    std::vector<ArchiveFile> getFiles() const; ///< Returns a snapshot of the files list, sorted by hash
+    /// Returns a snapshot of the files in these buckets of the Merkle tree sorted by hash, see MerkleTree
+    std::vector<ArchiveFile> getFilesInBuckets(const std::vector<uint16_t>& buckets) const;
+    /// Returns the digests of the children of these nodes of the Merkle tree, in order
+    std::vector<uint64_t> getTreeChildren(unsigned level, const std::vector<uint16_t>& indices) const;
+    /// Returns the files in these buckets (in all of them if there are none) sorted by hash, as FolderListPage data
+    /// of about pageFiles files each. A bucket is only encoded again after its files changed, see FileListPage.
+    std::vector<std::vector<char>> getListPages(const std::vector<uint16_t>& buckets, size_t pageFiles) const;
+
+    /// Finds the end of the metadata and of the first complete chunks of an archive file's data, up to maxChunks
+    /// Returns that position and sets chunks, or returns 0 if even the metadata is incomplete
+    static uint64_t skipChunks(const DataReader& read, uint64_t size, uint64_t maxChunks, uint64_t& chunks);
+    static void setPacking(bool enabled); ///< Whether the following writes put small files in pack segments
+
+    /// Records our changes to the files list in this journal from now on, see FolderDB
+    void setJournal(FolderJournal* journal);
+    bool hasUnsavedFiles() const; ///< Whether the files list changed since it was last saved
+    /// Writes the files list in the files database if it changed, and maps it. Returns false on failure.
+    bool saveFiles();
 
     std::string getFilesDbPath() const; ///< Returns the path of the Files database for this Folder
     std::string getFolderDataPath() const; ///< Returns the path of the data folder, containing the files db
+    std::string getArchiveFilePath(const PathHash& filePath) const; ///< Returns the path of a file's data
 
     void removeData() const; ///< Delete this Folder's Files database and data path
-    /// Write a downloaded archive file to disk, adding it to our list if it's new
-    void writeArchiveFile(const PathHash& filePath, uint64_t mtime, const std::vector<char>& data);
+    /// Opens a file's data wherever it's stored and sets its size, the reader keeps the version it opened even if the
+    /// file is replaced or removed meanwhile. Throws if it can't be opened.
+    DataReader openArchiveFile(const PathHash& filePath, uint64_t& size) const;
+    /// Write a downloaded archive file to disk, adding it to our list if it's new. Throws if the write fails.
+    /// Only the list update holds our lock, so different files can be written in parallel.
+    /// If durable, waits until the data is on disk. Small files go in the pack segments if packing is on.
+    void writeArchiveFile(const PathHash& filePath, uint64_t mtime, const std::vector<char>& data, bool durable = false);
+    /// Opens a temporary file to receive an archive file in chunks. Throws if someone else is writing it
+    std::unique_ptr<FileLocker> beginArchiveFile(const PathHash& filePath) const;
+    /// Reopens the temporary file of an interrupted chunked upload, keeping at most maxChunks complete chunks
+    /// Returns the file positioned after the chunks it kept and sets chunks, or nullptr if there is nothing to resume
+    std::unique_ptr<FileLocker> resumeArchiveFile(const PathHash& filePath, uint64_t maxChunks, uint64_t& chunks) const;
+    /// Moves a file received by beginArchiveFile in place, adding it to our list if it's new
+    /// If durable, waits until the list update is on disk, the caller syncs the file itself. Throws on failure.
+    void commitArchiveFile(const PathHash& filePath, uint64_t mtime, uint64_t size, bool durable = false);
     /// Deletes an archive file, if it exists
     bool removeArchiveFile(const PathHash &pathHash);
+    /// Deletes many archive files at once, returns whether each file was deleted
+    std::vector<bool> removeArchiveFiles(const std::vector<PathHash>& pathHashes);
 
 private:
     std::vector<std::string> listfiles(const char *name, int level) const; ///< Lists files recursively
     void deleteFolderRecursively(const char* path) const; ///< Deletes the folder and all of its contents
+    void invalidateListPage(const PathHash& filePath); ///< The file was added, changed or removed
+    /// Adds a file or updates its metadata, keeping our size, count and tree in sync
+    /// Returns the number of its journal record for syncRecord, 0 if we have no journal or the record wasn't written
+    uint64_t addOrUpdateFile(const PathHash& filePath, uint64_t mtime, uint64_t size);
+    /// Waits until a record of the journal is on disk, without our lock. Throws if it can't be synced.
+    void syncRecord(FolderJournal* recordJournal, uint64_t record) const;
+    bool removeFile(const PathHash& filePath); ///< Drops a file from our list, returns false if it wasn't there
+    void loadFiles(); ///< Maps the files database, dropping the changes
+    /// Calls f for each file in the buckets [firstBucket, endBucket), in hash order
+    void forEachFile(unsigned firstBucket, unsigned endBucket, const std::function<void(const ArchiveFile&)>& f) const;
+    size_t tableCount() const; ///< Files in the mapped table
+    size_t tableLowerBound(const PathHash& filePath) const; ///< Position of the first file not before filePath
+    const char* tableRecord(size_t pos) const;
+    const MerkleTree& getTree() const; ///< Builds the tree the first time it's needed
+
+    friend class FolderDB; ///< Replays the journal through addOrUpdateFile and removeFile
 
 private:
+    /// A file added, updated or removed since the table was written
+    struct FileChange
+    {
+        uint64_t mtime, size;
+        bool removed;
+    };
+
     PathHash pathHash; ///< Hash of the absolute path of the folder
     uint64_t actualSize; ////< Actual disk space used, taking metadata, compression, etc into account
-    std::vector<ArchiveFile> files; ///< Files stored in this archive. NOT in the serialized data!
+    size_t fileCount;
+    /// Files database as of the last save: the uint64 actualSize, then each file's metadata sorted by hash
+    std::shared_ptr<const MappedFile> table;
+    std::map<PathHash, FileChange> changes; ///< Sorted like the table, so we can merge them
+    mutable MerkleTree tree; ///< Summary of the files list, kept in sync with it once built
+    mutable bool treeBuilt;
+    mutable std::vector<std::vector<char>> listPages; ///< Encoded list of each bucket, empty until encoded
+    std::shared_ptr<PackStore> pack; ///< Shared with our copies, it keeps its segments open
+    static std::atomic<bool> packing;
+    FolderJournal* journal = nullptr; ///< Not copied, a copy isn't part of the FolderDB
     mutable std::recursive_mutex mutex;
 };
 
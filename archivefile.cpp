@@ -1,15 +1,13 @@
 #include "archivefile.h"
 #include "archive.h"
-#include "util/filelocker.h"
-#include "util/pathtools.h"
 #include "serialize.h"
+#include <cstring>
 
 using namespace std;
 
-ArchiveFile::ArchiveFile(const Archive *parent, PathHash pathHash, uint64_t mtime, const std::vector<char> &data)
-    : pathHash{pathHash}, mtime{mtime}, actualSize{data.size()}, parent{parent}
+ArchiveFile::ArchiveFile(const Archive *parent, PathHash pathHash, uint64_t mtime, uint64_t actualSize)
+    : pathHash{pathHash}, mtime{mtime}, actualSize{actualSize}, parent{parent}
 {
-    overwrite(mtime, data);
 }
 
 ArchiveFile::ArchiveFile(const Archive *parent, vector<char>::const_iterator &serializedData)
@@ -20,6 +18,19 @@ ArchiveFile::ArchiveFile(const Archive *parent, vector<char>::const_iterator &se
     actualSize = ::deserializeConsume<decltype(actualSize)>(serializedData);
 }
 
+ArchiveFile::ArchiveFile(const Archive *parent, const char* serializedData)
+    : pathHash{(uint8_t*)serializedData}, parent{parent}
+{
+    serializedData += PathHash::hashlen;
+    memcpy(&mtime, serializedData, sizeof(mtime));
+    memcpy(&actualSize, serializedData+sizeof(mtime), sizeof(actualSize));
+}
+
+ArchiveFile::ArchiveFile(const Archive *parent, const ArchiveFile &other)
+    : pathHash{other.pathHash}, mtime{other.mtime}, actualSize{other.actualSize}, parent{parent}
+{
+}
+
 PathHash ArchiveFile::getPathHash() const
 {
     return pathHash;
@@ -37,10 +48,8 @@ uint64_t ArchiveFile::getActualSize() const
 
 std::vector<char> ArchiveFile::read(uint64_t startPos, uint64_t size) const
 {
-    string pathHashStr = pathHash.toBase64();
-    string fullPath = parent->getFolderDataPath()+'/'+pathHashStr.substr(0,2)+'/'+pathHashStr.substr(2);
-    FileLocker file{fullPath};
-    return file.read(startPos, size);
+    uint64_t fileSize;
+    return parent->openArchiveFile(pathHash, fileSize)(startPos, size);
 }
 
 std::vector<char> ArchiveFile::readMetadata() const
@@ -59,22 +68,8 @@ std::vector<char> ArchiveFile::readMetadata() const
 
 std::vector<char> ArchiveFile::readAll() const
 {
-    string pathHashStr = pathHash.toBase64();
-    string fullPath = parent->getFolderDataPath()+'/'+pathHashStr.substr(0,2)+'/'+pathHashStr.substr(2);
-    FileLocker file{fullPath};
-    return file.readAll();
-}
-
-void ArchiveFile::overwrite(uint64_t _mtime, const std::vector<char> &data)
-{
-    mtime = _mtime;
-    actualSize = data.size();
-
-    string pathHashStr = pathHash.toBase64();
-    string fullPath = parent->getFolderDataPath()+'/'+pathHashStr.substr(0,2)+'/'+pathHashStr.substr(2);
-    createPathTo(parent->getFolderDataPath(), pathHashStr.substr(0,2)+'/'+pathHashStr.substr(2));
-    FileLocker file{fullPath};
-    file.overwrite(data);
+    uint64_t size;
+    return parent->openArchiveFile(pathHash, size)(0, size);
 }
 
 void ArchiveFile::serializeInto(std::vector<char> &dest) const
@@ -9,8 +9,10 @@ class Archive;
 class ArchiveFile
 {
 public:
-    ArchiveFile(const Archive* parent, PathHash pathHash, uint64_t mtime, const std::vector<char>& data);
+    ArchiveFile(const Archive* parent, PathHash pathHash, uint64_t mtime, uint64_t actualSize); ///< For data already on disk
     ArchiveFile(const Archive* parent, std::vector<char>::const_iterator& serializedData); ///< Reads from serialized data
+    ArchiveFile(const Archive* parent, const char* serializedData); ///< Reads serializedSize() bytes of serialized data
+    ArchiveFile(const Archive* parent, const ArchiveFile& other); ///< Copies the metadata of a file from another archive
     PathHash getPathHash() const;
     uint64_t getMtime() const;
     uint64_t getActualSize() const;
@@ -18,7 +20,6 @@ public:
     std::vector<char> read(uint64_t startPos, uint64_t size) const;
     std::vector<char> readMetadata() const;
     std::vector<char> readAll() const;
-    void overwrite(uint64_t mtime, const std::vector<char>& data);
 
     /// Serializes only the metadata, not the content of the file
     void serializeInto(std::vector<char>& dest) const;
@@ -0,0 +1,99 @@
+#include "archivestream.h"
+#include "server.h"
+#include "serialize.h"
+#include "compression.h"
+#include "crypto.h"
+#include <stdexcept>
+
+using namespace std;
+
+ArchiveStreamReader::ArchiveStreamReader(const Server& s, const std::function<std::vector<char>()>& fetch)
+    : server{s}, fetchPiece{fetch}, format{SourceFile::ContentFormat::Whole}, pos{0}, done{false}
+{
+}
+
+std::vector<char> ArchiveStreamReader::readMetadata()
+{
+    vector<char> meta;
+    if (!nextSizedChunk(meta))
+        throw runtime_error("ArchiveStreamReader::readMetadata: No metadata");
+    Crypto::decrypt(meta, server, server.getPublicKey());
+    format = SourceFile::getContentFormat(meta);
+    return meta;
+}
+
+std::vector<char> ArchiveStreamReader::readChunk()
+{
+    vector<char> chunk;
+    if (format == SourceFile::ContentFormat::Chunked)
+    {
+        if (!nextSizedChunk(chunk))
+            return {};
+        return decode(move(chunk));
+    }
+
+    // Old archives are encrypted in one piece, we can only decode them once we have everything
+    while (fetch())
+        continue;
+    if (pos == buffer.size())
+        return {};
+    chunk.assign(buffer.cbegin()+pos, buffer.cend());
+    pos = buffer.size();
+    return decode(move(chunk));
+}
+
+std::vector<char> ArchiveStreamReader::encodeChunk(const std::vector<char>& data, const Server& s)
+{
+    vector<char> contents = Compression::deflate(data);
+    Crypto::encrypt(contents, s, s.getPublicKey());
+    vector<char> encoded = vuintToData(contents.size());
+    vectorAppend(encoded, move(contents));
+    return encoded;
+}
+
+bool ArchiveStreamReader::fetch()
+{
+    if (done)
+        return false;
+
+    vector<char> piece = fetchPiece();
+    if (piece.empty())
+    {
+        done = true;
+        return false;
+    }
+
+    buffer.erase(buffer.begin(), buffer.begin()+pos);
+    pos = 0;
+    vectorAppend(buffer, move(piece));
+    return true;
+}
+
+bool ArchiveStreamReader::nextSizedChunk(std::vector<char>& dest)
+{
+    for (;;)
+    {
+        size_t chunkSize;
+        size_t sizeSize = parseVUint(buffer.data()+pos, buffer.size()-pos, chunkSize);
+        if (sizeSize && buffer.size()-pos-sizeSize >= chunkSize)
+        {
+            auto chunkBegin = buffer.cbegin()+pos+sizeSize;
+            dest.assign(chunkBegin, chunkBegin+chunkSize);
+            pos += sizeSize+chunkSize;
+            return true;
+        }
+
+        if (!fetch())
+        {
+            if (pos != buffer.size())
+                throw runtime_error("ArchiveStreamReader: Truncated chunk");
+            return false;
+        }
+    }
+}
+
+std::vector<char> ArchiveStreamReader::decode(std::vector<char>&& data) const
+{
+    Crypto::decrypt(data, server, server.getPublicKey());
+    return Compression::inflate(data);
+}
@@ -0,0 +1,41 @@
+#ifndef ARCHIVESTREAM_H
+#define ARCHIVESTREAM_H
+
+#include "sourcefile.h"
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+class Server;
+
+/// Decodes an archived file downloaded in pieces, one chunk of content at a time
+/// Archived files are the vuint size of the encrypted metadata, the metadata, then the content
+class ArchiveStreamReader
+{
+public:
+    /// fetch must return the next downloaded piece of the file, or an empty vector after the last one
+    ArchiveStreamReader(const Server& s, const std::function<std::vector<char>()>& fetch);
+
+    /// Returns the decrypted metadata, must be called before readChunk
+    std::vector<char> readMetadata();
+    /// Returns the next decrypted and decompressed chunk, or an empty vector after the last one
+    std::vector<char> readChunk();
+
+    /// Compresses and encrypts a chunk of content, prefixed by its size
+    static std::vector<char> encodeChunk(const std::vector<char>& data, const Server& s);
+
+private:
+    bool fetch(); ///< Appends the next downloaded piece to our buffer, returns false if there is none
+    bool nextSizedChunk(std::vector<char>& dest); ///< Takes a vuint sized chunk from the buffer, fetching as needed
+    std::vector<char> decode(std::vector<char>&& data) const;
+
+private:
+    const Server& server;
+    std::function<std::vector<char>()> fetchPiece;
+    SourceFile::ContentFormat format;
+    std::vector<char> buffer; ///< Downloaded data we haven't decoded yet
+    size_t pos; ///< Start of the undecoded data in the buffer
+    bool done; ///< The last piece was fetched
+};
+
+#endif // ARCHIVESTREAM_H
@@ -13,10 +13,15 @@
 #include "util/pathtools.h"
 #include "util/vt100.h"
 #include "threadedworker.h"
+#include "merkletree.h"
+#include "util/ratelimiter.h"
+#include "transferjournal.h"
 #include <iostream>
 #include <memory>
 #include <algorithm>
 #include <cassert>
+#include <thread>
+#include <mutex>
 
 using namespace std;
 
@@ -28,18 +33,29 @@ void help()
     std::cout << "Usage: tbak <command> [<arg(s)>]\n"
                  "Commands:\n"
                  "folder show : Show the list of tracked folders\n"
-                 "folder status <path> : Query the nodes for this folder's status\n"
+                 "folder status <path> [--connect-timeout=<s>] : Query the nodes for this folder's status\n"
                  "folder add-source <path> : Start tracking a local folder\n"
-                 "folder add-archive <path> : Start tracking a remote folder\n"
+                 "folder add-archive <path> [--connect-timeout=<s>] : Start tracking a remote folder\n"
                  "folder remove-source <path> : Stop tracking a source folder\n"
                  "folder remove-archive <path> : Stop tracking an archive folder\n"
-                 "folder push <path> : Send the folder to other nodes's archive\n"
-                 "folder restore <path> : Download missing files from other node's archives\n"
+                 "folder push <path> [--streams=<n>] [<rate limits>] [--connect-timeout=<s>] : Send the folder to other nodes's archive, over n connections per node\n"
+                 "folder restore <path> [<rate limits>] [--connect-timeout=<s>] : Download missing files from other node's archives\n"
+                 "    --connect-timeout : Seconds to wait for a node to accept the connection, defaults to "+to_string(DEFAULT_CONNECT_TIMEOUT)+"\n"
+                 "    Rate limits, in bytes per second with an optional k/M/G suffix:\n"
+                 "    --rate=<r> : Limit for all nodes together\n"
+                 "    --node-rate=<r> : Limit for each node\n"
+                 "    --burst=<size> : Bytes that may be sent at once after being idle, defaults to one second of the rate\n"
                  "node showkey : Show our node's public key\n"
                  "node show : Show the list of remote nodes\n"
                  "node add <URL> [<key>] : Add a remote node by hostname, optionally with the provided public key\n"
                  "node remove <URL> : Remove a remote node\n"
-                 "node start : Start running as a server node\n"
+                 "node start [--max-clients=<n>] [--max-pending=<n>] [--evented] [--io-threads=<n>] [--durability=<d>] [--pack] : Start running as a server node\n"
+                 "    --max-clients : Number of clients served at the same time\n"
+                 "    --max-pending : Number of connections waiting for a free slot before new ones are refused\n"
+                 "    --evented : Multiplex all connections on one thread, --max-clients sets the number of workers\n"
+                 "    --io-threads : Number of threads writing uploaded files to disk\n"
+                 "    --durability : Acknowledge uploads once they are queued, written (default), or durable (synced to disk)\n"
+                 "    --pack : Append small archived files to a few large pack files instead of creating a file for each\n"
               << std::flush;
 }
 
@@ -124,121 +140,318 @@ bool folderAddArchive(const string &path)
     return true;
 }
 
-bool folderPush(const string &path)
+/// Summarizes our list of files, so we only compare the parts that differ from a node's
+static MerkleTree buildTree(const vector<SourceFile>& lEntries)
 {
-    FolderDB fdb(folderDBPath());
-    NodeDB ndb(nodeDBPath());
-    string sourcePath{normalizePath(path)};
-    PathHash sourcePathHash{sourcePath};
+    MerkleTree tree;
+    for (const SourceFile& file : lEntries)
+        tree.add(file.getPathHash(), file.getAttrs().mtime);
+    return tree;
+}
 
-    // Make a list of local files
-    const Source* src = fdb.getSource(sourcePath);
-    if (!src)
+/// Merges our list of files with a node's, both sorted by hash, while the node's list is still arriving
+/// Calls visit in hash order with the files only we have, only the node has, or both have (the other is then null)
+class ListMerger
+{
+public:
+    using Visitor = function<void(const SourceFile* local, const FileTime* remote)>;
+    explicit ListMerger(const Visitor& visit)
+        : visit{visit}
     {
-        cout <<"Source folder "<<sourcePath<<" not found"<<endl;
-        return false;
     }
-    cout << "Building list of local files..."<<flush;
-    vector<SourceFile> lEntries = src->getSourceFiles();
-    sort(begin(lEntries), end(lEntries));
-    cout << vt100::CLEARLINE() << "Found "<<lEntries.size()<<" local files"<<endl;
 
-    // Push to all the nodes
-    Server server(serverConfigPath(), ndb, fdb);
-    const vector<Node>& nodes = ndb.getNodes();
-    for (const Node& node : nodes)
+    void setLocal(const vector<SourceFile>& files) ///< Must be called before the remote files are added
     {
-        if (Server::abortall)
-            return true;
-        NetSock sock;
-        try {
-            NetSock sockTry(NetAddr{node.getUri()});
-            sock = move(sockTry);
-        } catch (const runtime_error& e) {
-            cout << "Failed to connect to node "<<node.getUri()<<endl;
-            continue;
+        lit = files.cbegin();
+        lend = files.cend();
+    }
+
+    void addRemote(const vector<FileTime>& files) ///< The next remote files, after the previous ones
+    {
+        for (const FileTime& rFile : files)
+        {
+            for (; lit != lend && lit->getPathHash() < rFile.hash; ++lit)
+                visit(&*lit, nullptr);
+            if (lit != lend && lit->getPathHash() == rFile.hash)
+                visit(&*lit++, &rFile);
+            else
+                visit(nullptr, &rFile);
         }
+    }
+
+    void finish() ///< Visits our files after the last remote file
+    {
+        for (; lit != lend; ++lit)
+            visit(&*lit, nullptr);
+    }
+
+private:
+    Visitor visit;
+    vector<SourceFile>::const_iterator lit, lend;
+};
+
+/// Merges the remote files that may differ from ours, by walking the node's Merkle tree if it has one
+/// If the tree narrowed down the buckets to compare, lChanged gets our files in these buckets and only those are merged.
+/// Otherwise all of our files are merged with the node's whole list. Throws if the node doesn't have the folder.
+static void mergeRemoteChanges(const NetSock& sock, const Server& server, const Node& node, const PathHash& folder,
+                               const vector<SourceFile>& lEntries, const MerkleTree& lTree,
+                               vector<SourceFile>& lChanged, ListMerger& merger)
+{
+    vector<uint16_t> buckets;
+    try {
+        buckets = node.fetchChangedBuckets(sock, server, folder, lTree);
+    } catch (const runtime_error& e) {
+        // Nodes that don't have trees don't have pages either
+        vector<FileTime> rEntries = node.fetchFolderList(sock, server, folder);
+        sort(begin(rEntries), end(rEntries));
+        merger.setLocal(lEntries);
+        merger.addRemote(rEntries);
+        return;
+    }
+
+    vector<bool> changed(MerkleTree::bucketCount);
+    for (uint16_t bucket : buckets)
+        changed[bucket] = true;
+    for (const SourceFile& file : lEntries)
+        if (changed[MerkleTree::bucketIndex(file.getPathHash())])
+            lChanged.push_back(file);
+    merger.setLocal(lChanged);
+    if (buckets.empty())
+        return;
+
+    // The pages come sorted, so we merge each one as soon as it arrives
+    if (!node.fetchFolderPages(sock, server, folder, buckets, [&merger](const vector<FileTime>& page){merger.addRemote(page);}))
+    {
+        vector<FileTime> rEntries = node.fetchBucketList(sock, server, folder, buckets);
+        sort(begin(rEntries), end(rEntries));
+        merger.addRemote(rEntries);
+    }
+}
 
+/// Outcome of pushing a folder to one node
+struct PushResult
+{
+    string error; ///< Empty if we could sync with the node
+    size_t toUpload = 0, uploaded = 0;
+    size_t toDelete = 0, deleted = 0;
+    uint64_t bytes = 0; ///< Bytes sent by the uploads
+    double rate = 0; ///< Average upload rate, in bytes per second
+};
+
+/// Pushes our files to a node's archive of the folder
+/// If prefixed, progress is printed as lines starting with the node's URI, so that pushes can run in parallel
+static PushResult pushToNode(Server& server, const Node& node, const PathHash& sourcePathHash,
+                             const vector<SourceFile>& allEntries, const MerkleTree& lTree,
+                             const PushOptions& options, RateLimiter& globalLimiter, bool prefixed)
+{
+    PushResult result;
+    prefixed = prefixed || options.streams > 1;
+    string prefix = prefixed ? node.getUri()+": " : "";
+    auto say = [&](const string& msg)
+    {
+        lock_guard<mutex> lock(ThreadedWorker::outputMutex);
+        cout << prefix << msg << endl;
+    };
+
+    if (Server::abortall)
+    {
+        result.error = "Aborted";
+        return result;
+    }
+    NetSock sock;
+    try {
+        NetSock sockTry(NetAddr{node.getUri()});
+        sock = move(sockTry);
+    } catch (const runtime_error& e) {
+        result.error = "Failed to connect to node";
+        say(result.error);
+        return result;
+    }
+
+    try {
         if (!Net::sendAuth(sock, server))
         {
-            cout << "Couldn't authenticate with node "<<node.getUri()<<endl;
-            continue;
+            result.error = "Couldn't authenticate with node";
+            say(result.error);
+            return result;
         }
-        cout << "Pushing to node "<<node.getUri()<<endl;
+        say("Pushing to node "+node.getUri());
+
+        // Both lists are sorted by hash, we iterate over both at the same time
+        // This allows us to find the files to upload and delete in one pass, while the remote list arrives
+        if (!prefixed)
+            cout << "Building diff..."<<flush;
+        vector<SourceFile> updiff; // Files we need to upload
+        vector<FileTime> deldiff; // Files we need to delete
+        ListMerger merger([&](const SourceFile* local, const FileTime* remote)
+        {
+            if (!remote)
+                updiff.push_back(*local);
+            else if (!local)
+                deldiff.push_back(*remote);
+            else if (remote->mtime != local->getAttrs().mtime)
+                updiff.push_back(*local);
+        });
 
         // Try to get the content list of the folder, create it if necessary
-        vector<FileTime> rEntries;
+        vector<SourceFile> lChanged;
         try {
-            rEntries = node.fetchFolderList(sock, server, sourcePathHash);
+            mergeRemoteChanges(sock, server, node, sourcePathHash, allEntries, lTree, lChanged, merger);
         } catch (const runtime_error& e) {
-            cout<<"Node "<<node.getUri()<<" doesn't have this folder, creating it"<<endl;
+            if (!prefixed)
+                cout << vt100::CLEARLINE();
+            say("Node "+node.getUri()+" doesn't have this folder, creating it");
             if (!node.createFolder(sock, server, sourcePathHash))
             {
-                cout << "Couldn't create the folder on node "+node.getUri()+'\n';
-                continue;
+                result.error = "Couldn't create the folder on node";
+                say(result.error);
+                return result;
             }
+            updiff.clear();
+            deldiff.clear();
+            merger.setLocal(allEntries);
+        }
+        merger.finish();
 
+        if (!prefixed)
+            cout << vt100::CLEARLINE();
+        say("Need to upload "+to_string(updiff.size())+" files and delete "
+            +to_string(deldiff.size())+" remote files");
+        result.toUpload = updiff.size();
+        result.toDelete = deldiff.size();
+
+        // If the upload might be interrupted, it's more useful to not upload in a random-ish order
+        sort(begin(updiff), end(updiff), [](const SourceFile& f1, const SourceFile& f2)
+        {
+            return f1.getPath()<f2.getPath();
+        });
+
+        // Continue where an interrupted push to this node left off
+        unique_ptr<TransferJournal> journal;
+        try {
+            journal.reset(new TransferJournal(TransferJournal::getPath(sourcePathHash, node.getPkString(), false)));
+            if (journal->getDoneCount() || journal->getPartialCount())
+                say("Resuming an interrupted push, "+to_string(journal->getDoneCount())+" files were already uploaded");
+        } catch (const runtime_error& e) {
+            say("Can't open the transfer journal, this push won't be resumable");
+        }
+
+        // Open the extra streams, each is a separate pipeline with its own connection
+        vector<NetSock> streams;
+        for (unsigned i=1; i<options.streams && updiff.size() > i; ++i)
+        {
             try {
-                rEntries = node.fetchFolderList(sock, server, sourcePathHash);
+                NetSock stream(NetAddr{node.getUri()});
+                if (!Net::sendAuth(stream, server))
+                    throw runtime_error("Couldn't authenticate");
+                streams.push_back(move(stream));
             } catch (const runtime_error& e) {
-                cout << "Error: "<<e.what()<<endl;
-                continue;
+                say("Failed to open stream "+to_string(i+1)+", continuing with "+to_string(i));
+                break;
             }
         }
 
-        // Both lists are sorted by hash, we iterate over both at the same time
-        // This allows us to find the files to upload and delete in one pass
-        cout << "Building diff..."<<flush;
-        vector<SourceFile> updiff; // Files we need to upload
-        vector<FileTime> deldiff; // Files we need to delete
-        if (rEntries.size() > lEntries.size())
-            deldiff.reserve(rEntries.size() - lEntries.size());
-        else if (lEntries.size() > rEntries.size())
-            updiff.reserve(lEntries.size() - rEntries.size());
-        sort(begin(rEntries), end(rEntries));
+        // Shared by the streams, this also measures the rate we got
+        RateLimiter nodeLimiter(options.limits.nodeRate, options.limits.burst);
+        if (streams.empty())
         {
-            auto lit = lEntries.begin(), lend = lEntries.end();
-            auto rit = rEntries.begin(), rend = rEntries.end();
-            while (lit != lend && rit != rend)
-            {
-                // If we don't have this remote file
-                if (rit->hash < lit->getPathHash())
-                {
-                    deldiff.push_back(*rit);
-                    ++rit;
-                }
-                // If the remote doesn't have this file
-                else if (lit->getPathHash() < rit->hash)
-                {
-                    updiff.push_back(*lit);
-                    ++lit;
-                }
-                // If we both have this file
-                else
+            ThreadedWorker worker(sock, server, node);
+            if (prefixed)
+                worker.setOutputPrefix(prefix);
+            worker.setRateLimiters(&globalLimiter, &nodeLimiter);
+            worker.setJournal(journal.get());
+            result.uploaded = worker.uploadFiles(sourcePathHash, updiff);
+        }
+        else
+        {
+            vector<vector<SourceFile>> parts = ThreadedWorker::splitUploads(updiff, streams.size()+1);
+            vector<unsigned> uploaded(parts.size());
+            vector<thread> threads;
+            for (size_t i=0; i<parts.size(); ++i)
+                threads.emplace_back([&, i]()
                 {
-                    if (rit->mtime != lit->getAttrs().mtime)
-                        updiff.push_back(*lit);
-                    ++lit;
-                    ++rit;
-                }
-            }
-            updiff.insert(updiff.end(), lit, lend);
-            deldiff.insert(deldiff.end(), rit, rend);
+                    ThreadedWorker worker(i ? streams[i-1] : sock, server, node);
+                    worker.setOutputPrefix(node.getUri()+" #"+to_string(i+1)+": ");
+                    worker.setRateLimiters(&globalLimiter, &nodeLimiter);
+                    worker.setJournal(journal.get());
+                    // Nothing may escape the thread, a failed stream only loses its own part
+                    try {
+                        uploaded[i] = worker.uploadFiles(sourcePathHash, parts[i]);
+                    } catch (const exception& e) {
+                        say("Stream "+to_string(i+1)+" failed: "+e.what());
+                    }
+                });
+            for (thread& t : threads)
+                t.join();
+            for (unsigned n : uploaded)
+                result.uploaded += n;
         }
+        result.bytes = nodeLimiter.getTotalBytes();
+        result.rate = nodeLimiter.getAverageRate();
+        if (journal && result.uploaded == result.toUpload)
+            journal->clear();
 
-        cout <<vt100::CLEARLINE()<<"Need to upload "<<updiff.size()
-            <<" files and delete "<<deldiff.size()<<" remote files"<<endl;
+        ThreadedWorker worker(sock, server, node);
+        if (prefixed)
+            worker.setOutputPrefix(prefix);
+        result.deleted = worker.deleteFiles(sourcePathHash, deldiff);
+    } catch (const runtime_error& e) {
+        result.error = e.what();
+        say("Error: "+result.error);
+    }
+    return result;
+}
 
-        // If the upload might be interrupted, it's more useful to not upload in a random-ish order
-        sort(begin(updiff), end(updiff), [](const SourceFile& f1, const SourceFile& f2)
+bool folderPush(const string &path, const PushOptions& options)
+{
+    FolderDB fdb(folderDBPath());
+    NodeDB ndb(nodeDBPath());
+    string sourcePath{normalizePath(path)};
+    PathHash sourcePathHash{sourcePath};
+
+    // Make a list of local files
+    const Source* src = fdb.getSource(sourcePath);
+    if (!src)
+    {
+        cout <<"Source folder "<<sourcePath<<" not found"<<endl;
+        return false;
+    }
+    cout << "Building list of local files..."<<flush;
+    vector<SourceFile> lEntries = src->getSourceFiles();
+    sort(begin(lEntries), end(lEntries));
+    MerkleTree lTree = buildTree(lEntries);
+    cout << vt100::CLEARLINE() << "Found "<<lEntries.size()<<" local files"<<endl;
+
+    // Push to all the nodes at the same time, a slow node shouldn't hold up the others
+    Server server(serverConfigPath(), ndb, fdb);
+    const vector<Node>& nodes = ndb.getNodes();
+    vector<PushResult> results(nodes.size());
+    RateLimiter globalLimiter(options.limits.rate, options.limits.burst);
+    vector<thread> threads;
+    bool prefixed = nodes.size() > 1;
+    for (size_t i=0; i<nodes.size(); ++i)
+        threads.emplace_back([&, i]()
         {
-            return f1.getPath()<f2.getPath();
+            results[i] = pushToNode(server, nodes[i], sourcePathHash, lEntries, lTree, options, globalLimiter, prefixed);
         });
+    for (thread& t : threads)
+        t.join();
 
-        ThreadedWorker worker(sock, server, node);
-        worker.uploadFiles(sourcePathHash, updiff);
-        worker.deleteFiles(sourcePathHash, deldiff);
+    cout << "Summary:"<<endl;
+    for (size_t i=0; i<nodes.size(); ++i)
+    {
+        const PushResult& r = results[i];
+        cout << "  "<<nodes[i].getUri()<<": ";
+        if (!r.error.empty())
+            cout << vt100::STYLE_ERROR() << r.error << vt100::STYLE_RESET() << endl;
+        else
+            cout << "uploaded "<<r.uploaded<<'/'<<r.toUpload<<" files, deleted "
+                 <<r.deleted<<'/'<<r.toDelete<<" remote files, sent "<<humanReadableSize(r.bytes)
+                 <<" at "<<humanReadableSize(r.rate)<<"/s"<<endl;
     }
+    if (nodes.size() > 1)
+        cout << "  Total: sent "<<humanReadableSize(globalLimiter.getTotalBytes())
+             <<" at "<<humanReadableSize(globalLimiter.getAverageRate())<<"/s"<<endl;
     return true;
 }
 
@@ -246,48 +459,64 @@ void folderStatus(const string &path)
 {
     FolderDB fdb(folderDBPath());
     NodeDB ndb(nodeDBPath());
-    printf("%*s %*s\n",24,"URI",12,"Size");
     string folderPath{normalizePath(path)};
     PathHash folderPathHash{folderPath};
 
+    // Query all the nodes at the same time, so unreachable nodes cost one connect timeout in total
     Server server(serverConfigPath(), ndb, fdb);
     const vector<Node>& nodes = ndb.getNodes();
-    for (const Node& node : nodes)
-    {
-        if (Server::abortall)
-            return;
-        NetSock sock;
-        try {
-            NetSock sockTry(NetAddr{node.getUri()});
-            sock = move(sockTry);
-        } catch (const runtime_error& e) {
-            cout << "Failed to connect to node "<<node.getUri()<<endl;
-            continue;
-        }
-        if (!Net::sendAuth(sock, server))
+    vector<string> lines(nodes.size());
+    vector<thread> threads;
+    for (size_t i=0; i<nodes.size(); ++i)
+        threads.emplace_back([&, i]()
         {
-            printf("%*s (couldn't authenticate with node)\n",24,node.getUri().c_str());
-            continue;
-        }
+            const Node& node = nodes[i];
+            char line[256];
+            if (Server::abortall)
+                return;
+            NetSock sock;
+            try {
+                NetSock sockTry(NetAddr{node.getUri()});
+                sock = move(sockTry);
+            } catch (const runtime_error& e) {
+                lines[i] = "Failed to connect to node "+node.getUri()+"\n";
+                return;
+            }
 
-        NetPacket request{NetPacket::FolderStats, ::serialize(folderPathHash)};
-        Crypto::encryptPacket(request, server, node.getPk());
-        sock.send(request);
-        NetPacket reply = sock.recvPacket();
-        Crypto::decryptPacket(reply, server, node.getPk());
-        if (reply.type != NetPacket::FolderStats)
-        {
-            printf("%*s ???\n",24,node.getUri().c_str());
-            continue;
-        }
-        auto it = reply.data.cbegin();
-        uint64_t size = ::deserializeConsume<uint64_t>(it);
-        printf("%*s %*s\n",24,node.getUri().c_str(),
-                                    12, humanReadableSize(size).c_str());
-    }
+            try {
+                if (!Net::sendAuth(sock, server))
+                {
+                    snprintf(line, sizeof(line), "%*s (couldn't authenticate with node)\n",24,node.getUri().c_str());
+                    lines[i] = line;
+                    return;
+                }
+
+                NetPacket reply = sock.secureRequest({NetPacket::FolderStats, ::serialize(folderPathHash)},
+                                                     server, node.getPk());
+                if (reply.type != NetPacket::FolderStats || reply.data.size() < sizeof(uint64_t))
+                {
+                    snprintf(line, sizeof(line), "%*s ???\n",24,node.getUri().c_str());
+                    lines[i] = line;
+                    return;
+                }
+                auto it = reply.data.cbegin();
+                uint64_t size = ::deserializeConsume<uint64_t>(it);
+                snprintf(line, sizeof(line), "%*s %*s\n",24,node.getUri().c_str(),
+                                            12, humanReadableSize(size).c_str());
+                lines[i] = line;
+            } catch (const runtime_error& e) {
+                lines[i] = "Lost connection to node "+node.getUri()+"\n";
+            }
+        });
+    for (thread& t : threads)
+        t.join();
+
+    printf("%*s %*s\n",24,"URI",12,"Size");
+    for (const string& line : lines)
+        fputs(line.c_str(), stdout);
 }
 
-bool folderRestore(const string &path)
+bool folderRestore(const string &path, const RateOptions& limits)
 {
     FolderDB fdb(folderDBPath());
     NodeDB ndb(nodeDBPath());
@@ -304,11 +533,13 @@ bool folderRestore(const string &path)
     cout << "Building list of local files..."<<flush;
     vector<SourceFile> lEntries = src->getSourceFiles();
     sort(begin(lEntries), end(lEntries));
+    MerkleTree lTree = buildTree(lEntries);
     cout << vt100::CLEARLINE() << "Found "<<lEntries.size()<<" local files"<<endl;
 
-    // Push to all the nodes
+    // Restore from all the nodes
     Server server(serverConfigPath(), ndb, fdb);
     const vector<Node>& nodes = ndb.getNodes();
+    RateLimiter globalLimiter(limits.rate, limits.burst);
     for (const Node& node : nodes)
     {
         if (Server::abortall)
@@ -328,83 +559,50 @@ bool folderRestore(const string &path)
         }
         cout << "Restoring from node "<<node.getUri()<<endl;
 
-        // Try to get the content list of the folder, create it if necessary
-        vector<FileTime> rEntries;
+        // Our partially restored files are newer than the remote's, only the journal knows they must be fetched again
+        unique_ptr<TransferJournal> journal;
         try {
-            rEntries = node.fetchFolderList(sock, server, sourcePathHash);
+            journal.reset(new TransferJournal(TransferJournal::getPath(sourcePathHash, node.getPkString(), true)));
+            if (journal->getDoneCount() || journal->getPartialCount())
+                cout << "Resuming an interrupted restore, "<<journal->getDoneCount()<<" files were already restored"<<endl;
         } catch (const runtime_error& e) {
-            cout<<"Node "<<node.getUri()<<" doesn't have this folder, skipping it"<<endl;
-            continue;
+            cout << "Can't open the transfer journal, this restore won't be resumable"<<endl;
         }
 
         // Both lists are sorted by hash, we iterate over both at the same time
-        // This allows us to find the files to download in one pass
+        // This allows us to find the files to download in one pass, while the remote list arrives
         cout << "Building diff..."<<flush;
         vector<FileTime> downdiff; // Files we need to download
-        if (rEntries.size() > lEntries.size())
-            downdiff.reserve(rEntries.size() - lEntries.size());
-        sort(begin(rEntries), end(rEntries));
+        ListMerger merger([&](const SourceFile* local, const FileTime* remote)
         {
-            auto lit = lEntries.begin(), lend = lEntries.end();
-            auto rit = rEntries.begin(), rend = rEntries.end();
-            while (lit != lend && rit != rend)
-            {
-                // If we don't have this remote file
-                if (rit->hash < lit->getPathHash())
-                {
-                    downdiff.push_back(*rit);
-                    ++rit;
-                }
-                // If the remote doesn't have this file
-                else if (lit->getPathHash() < rit->hash)
-                {
-                    ++lit;
-                }
-                // If we both have this file
-                else
-                {
-                    if (rit->mtime > lit->getAttrs().mtime)
-                        downdiff.push_back(*rit);
-                    ++lit;
-                    ++rit;
-                }
-            }
-            downdiff.insert(downdiff.end(), rit, rend);
+            if (!remote)
+                return;
+            if (!local || remote->mtime > local->getAttrs().mtime
+                    || (journal && journal->isPartial(remote->hash, remote->mtime)))
+                downdiff.push_back(*remote);
+        });
+        vector<SourceFile> lChanged;
+        try {
+            mergeRemoteChanges(sock, server, node, sourcePathHash, lEntries, lTree, lChanged, merger);
+        } catch (const runtime_error& e) {
+            cout<<vt100::CLEARLINE()<<"Node "<<node.getUri()<<" doesn't have this folder, skipping it"<<endl;
+            continue;
         }
 
         cout <<vt100::CLEARLINE()<<"Need to download "<<downdiff.size()<<" files"<<endl;
 
-        for (const FileTime& file : downdiff)
-        {
-            cout << "Downloading encrypted file metadata... "<<flush;
-            uint64_t fileSize;
-            string filePath;
-            vector<char> meta;
-            {
-                meta = node.downloadFileMetadata(sock, server, sourcePathHash, file.hash);
-                auto it = meta.cend()-sizeof(uint64_t);
-                fileSize = ::deserializeConsume<uint64_t>(it);
-                meta.erase(meta.cend()-sizeof(uint64_t), meta.cend());
-                Crypto::decrypt(meta, server, server.getPublicKey());
-                it = meta.cbegin();
-                filePath = ArchiveFile::deserializePath(it);
-            }
-
-            cout << vt100::CLEARLINE() << "Downloading file "<<filePath
-                 <<" ("<<humanReadableSize(fileSize)<<")..."<<endl;
-            vector<char> data = node.downloadFile(sock, server, sourcePathHash, file.hash);
-            uint64_t mtime;
-            {
-                auto it = data.cbegin();
-                mtime = ::deserializeConsume<uint64_t>(it);
-                size_t msize = ::dataToVUint(it);
-                data.erase(data.begin(), it+msize);
-            }
-            Crypto::decrypt(data, server, server.getPublicKey());
-            data = Compression::inflate(data);
-
-            src->restoreFile(meta, mtime, data);
+        RateLimiter nodeLimiter(limits.nodeRate, limits.burst);
+        try {
+            ThreadedWorker worker(sock, server, node);
+            worker.setRateLimiters(&globalLimiter, &nodeLimiter);
+            worker.setJournal(journal.get());
+            if (worker.downloadFiles(sourcePathHash, downdiff, *src) == downdiff.size() && journal)
+                journal->clear();
+        } catch (const runtime_error& e) {
+            cout << "Error: "<<e.what()<<endl;
         }
+        cout << "Received "<<humanReadableSize(nodeLimiter.getTotalBytes())<<" from node "<<node.getUri()
+             <<" at "<<humanReadableSize(nodeLimiter.getAverageRate())<<"/s"<<endl;
     }
     return true;
 }
@@ -438,11 +636,12 @@ void nodeRemove(const string &uri)
     ndb.removeNode(uri);
 }
 
-bool nodeStart()
+bool nodeStart(const ServerOptions& options)
 {
     FolderDB fdb(folderDBPath());
     NodeDB ndb(nodeDBPath());
     Server server(serverConfigPath(), ndb, fdb);
+    server.setOptions(options);
     int r = server.exec();
     cout << "Server exiting with status "<<r<<endl;
     return r==0;
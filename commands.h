@@ -2,6 +2,25 @@
 #define COMMANDS_H
 
 #include <string>
+#include "settings.h"
+#include <cstdint>
+
+struct ServerOptions;
+
+/// Bandwidth limits of a push or restore, in bytes per second, 0 means no limit
+struct RateOptions
+{
+    uint64_t rate = 0; ///< Limit for all nodes together
+    uint64_t nodeRate = 0; ///< Limit for each node
+    uint64_t burst = 0; ///< Bytes that may be sent at once after being idle, one second of the rate if 0
+};
+
+/// Tunables of a folder push
+struct PushOptions
+{
+    unsigned streams = DEFAULT_PUSH_STREAMS; ///< Connections opened to each node, the uploads are spread across them
+    RateOptions limits;
+};
 
 // Client command handlers
 namespace cmd
@@ -13,15 +32,15 @@ void folderRemoveSource(const std::string& path);
 void folderRemoveArchive(const std::string& path);
 void folderAddSource(const std::string& path);
 bool folderAddArchive(const std::string& path);
-bool folderPush(const std::string& path);
+bool folderPush(const std::string& path, const PushOptions& options);
 void folderStatus(const std::string& path);
-bool folderRestore(const std::string& path);
+bool folderRestore(const std::string& path, const RateOptions& limits);
 void nodeShow();
 void nodeShowkey();
 void nodeAdd(const std::string& uri);
 void nodeAdd(const std::string& uri, const std::string& pk);
 void nodeRemove(const std::string& uri);
-bool nodeStart();
+bool nodeStart(const ServerOptions& options);
 
 }
 
@@ -6,23 +6,62 @@
 #include <cstring>
 #include <fcntl.h>
 #include <iostream>
+#include <mutex>
+#include <map>
 
 Crypto::Crypto()
 {
 
 }
 
-int rawencrypt(char encrypted[], const uint8_t pk[], const uint8_t sk[], const char nonce[], const char plain[], int length)
+using SharedKey = std::array<unsigned char, crypto_box_BEFORENMBYTES>;
+
+/// Computing the shared key of a key pair is the slow part of crypto_box, so we only do it once per remote
+static SharedKey sharedKey(const Server& s, const PublicKey& remoteKey)
+{
+    static std::mutex mutex;
+    static std::map<PublicKey, SharedKey> cache; ///< The server's own keys never change
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto it = cache.find(remoteKey);
+    if (it != cache.end())
+        return it->second;
+
+    SharedKey key;
+    if (crypto_box_beforenm(key.data(), remoteKey.data(), s.getSecretKey().data()))
+        throw std::runtime_error("Crypto: Failed to compute shared key");
+    cache.emplace(remoteKey, key);
+    return key;
+}
+
+/// Nonces only need to be unique, so we increment a random starting nonce instead of generating new ones
+static void nextNonce(char nonce[])
+{
+    static std::mutex mutex;
+    static unsigned char counter[crypto_box_NONCEBYTES];
+    static bool initialized = false;
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (!initialized)
+    {
+        randombytes_buf(counter, sizeof(counter));
+        initialized = true;
+    }
+    sodium_increment(counter, sizeof(counter));
+    memcpy(nonce, counter, sizeof(counter));
+}
+
+int rawencrypt(char encrypted[], const SharedKey& key, const char nonce[], const char plain[], size_t length)
 {
-    if (crypto_box_easy((uint8_t*)encrypted, (uint8_t*)plain, length, (uint8_t*)nonce, pk, sk))
+    if (crypto_box_easy_afternm((uint8_t*)encrypted, (uint8_t*)plain, length, (uint8_t*)nonce, key.data()))
         throw std::runtime_error("Crypto encrypt: Encryption failed");
 
     return length;
 }
 
-int rawdecrypt(char plain[], const uint8_t pk[], const uint8_t sk[], const char nonce[], const char encrypted[], int length)
+int rawdecrypt(char plain[], const SharedKey& key, const char nonce[], const char encrypted[], size_t length)
 {
-    if (crypto_box_open_easy((uint8_t*)plain, (uint8_t*)encrypted, length, (uint8_t*)nonce, pk, sk))
+    if (crypto_box_open_easy_afternm((uint8_t*)plain, (uint8_t*)encrypted, length, (uint8_t*)nonce, key.data()))
         throw std::runtime_error("Crypto decrypt: Invalid or forged cyphertext");
 
     return length;
@@ -65,8 +104,8 @@ void Crypto::encryptPacket(NetPacket& packet, const Server &s, const PublicKey&
         return;
     size_t encryptedsize = packet.data.size()+crypto_box_NONCEBYTES+crypto_box_MACBYTES;
     std::vector<char> encrypted(encryptedsize);
-    randombytes((uint8_t*)&encrypted[0], crypto_box_NONCEBYTES);
-    rawencrypt(&encrypted[crypto_box_NONCEBYTES], &remoteKey[0], &s.getSecretKey()[0], &encrypted[0],
+    nextNonce(&encrypted[0]);
+    rawencrypt(&encrypted[crypto_box_NONCEBYTES], sharedKey(s, remoteKey), &encrypted[0],
             &packet.data[0], packet.data.size());
     packet.data = encrypted;
 }
@@ -80,7 +119,7 @@ void Crypto::decryptPacket(NetPacket& packet, const Server &s, const PublicKey&
     size_t plainsize = packet.data.size()-crypto_box_NONCEBYTES-crypto_box_MACBYTES;
     std::vector<char> plaintext(plainsize);
     char* nonce = &packet.data[0], *encrypted=&packet.data[0]+crypto_box_NONCEBYTES;
-    rawdecrypt(&plaintext[0], &remoteKey[0], &s.getSecretKey()[0], nonce, encrypted, packet.data.size()-crypto_box_NONCEBYTES);
+    rawdecrypt(&plaintext[0], sharedKey(s, remoteKey), nonce, encrypted, packet.data.size()-crypto_box_NONCEBYTES);
     packet.data = plaintext;
 }
 
@@ -90,8 +129,8 @@ void Crypto::encrypt(std::vector<char>& data, const Server& s, const PublicKey &
         return;
     size_t encryptedsize = data.size()+crypto_box_NONCEBYTES+crypto_box_MACBYTES;
     std::vector<char> encrypted(encryptedsize);
-    randombytes((uint8_t*)&encrypted[0], crypto_box_NONCEBYTES);
-    rawencrypt(&encrypted[crypto_box_NONCEBYTES], &remoteKey[0], &s.getSecretKey()[0], &encrypted[0],
+    nextNonce(&encrypted[0]);
+    rawencrypt(&encrypted[crypto_box_NONCEBYTES], sharedKey(s, remoteKey), &encrypted[0],
             &data[0], data.size());
     data = encrypted;
 }
@@ -105,7 +144,7 @@ void Crypto::decrypt(std::vector<char> &data, const Server& s, const PublicKey &
     size_t plainsize = data.size()-crypto_box_NONCEBYTES-crypto_box_MACBYTES;
     std::vector<char> plaintext(plainsize);
     char* nonce = &data[0], *encrypted=&data[0]+crypto_box_NONCEBYTES;
-    rawdecrypt(&plaintext[0], &remoteKey[0], &s.getSecretKey()[0], nonce, encrypted, data.size()-crypto_box_NONCEBYTES);
+    rawdecrypt(&plaintext[0], sharedKey(s, remoteKey), nonce, encrypted, data.size()-crypto_box_NONCEBYTES);
     data = plaintext;
 }
 
@@ -166,3 +205,34 @@ std::string Crypto::toBase64(const unsigned char *data, size_t length)
     }
     return encodedString;
 }
+
+bool Crypto::fromBase64(const std::string& str, std::vector<unsigned char>& data)
+{
+    static constexpr char charset[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    if (str.size() % 4)
+        return false;
+    data.clear();
+    data.reserve(str.size()/4*3);
+    uint32_t temp = 0;
+    size_t bits = 0, padding = 0;
+    for (size_t i=0; i<str.size(); ++i)
+    {
+        // Only the last two characters may be padding
+        if (str[i] == '=' && i+2 >= str.size())
+        {
+            padding++;
+            continue;
+        }
+        const char* pos = strchr(charset, str[i]);
+        if (padding || !str[i] || !pos)
+            return false;
+        temp = temp << 6 | (pos-charset);
+        bits += 6;
+        if (bits >= 8)
+        {
+            bits -= 8;
+            data.push_back((temp >> bits) & 0xFF);
+        }
+    }
+    return true;
+}
@@ -23,6 +23,8 @@ public:
     static void hashInto(const std::string &str, uint8_t* dest);
     static std::string toBase64(const std::vector<unsigned char>& data);
     static std::string toBase64(const unsigned char *data, size_t length);
+    /// Decodes the output of toBase64, returns false if str isn't valid
+    static bool fromBase64(const std::string& str, std::vector<unsigned char>& data);
 
     static void encrypt(std::vector<char> &data, const Server& s, const PublicKey &remoteKey);
     static void decrypt(std::vector<char>& data, const Server& s, const PublicKey &remoteKey);
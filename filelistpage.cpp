@@ -0,0 +1,70 @@
+#include "filelistpage.h"
+#include "serialize.h"
+#include <stdexcept>
+
+using namespace std;
+
+// Entries are the count of bytes shared with the previous hash, the rest of the hash,
+// then the zigzag vuint difference with the previous mtime. The page starts with the vuint count of entries.
+
+std::vector<char> FileListPage::encode(std::vector<FileTime>::const_iterator begin, std::vector<FileTime>::const_iterator end)
+{
+    vector<char> data = vuintToData(end-begin);
+    vector<char> prevHash(PathHash::hashlen);
+    uint64_t prevMtime = 0;
+    for (auto it = begin; it != end; ++it)
+    {
+        vector<char> hash = it->hash.serialize();
+        uint8_t shared = 0;
+        while (shared < PathHash::hashlen-1 && hash[shared] == prevHash[shared])
+            shared++;
+        data.push_back(shared);
+        data.insert(data.end(), hash.begin()+shared, hash.end());
+
+        int64_t delta = it->mtime - prevMtime;
+        vectorAppend(data, vuintToData(((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63)));
+        prevHash = move(hash);
+        prevMtime = it->mtime;
+    }
+    return data;
+}
+
+std::vector<FileTime> FileListPage::decode(const std::vector<char>& data)
+{
+    vector<FileTime> files;
+    const char* pos = data.data();
+    const char* end = pos + data.size();
+    do
+    {
+        size_t count;
+        size_t sizeSize = parseVUint(pos, end-pos, count);
+        if (!sizeSize || count > data.size())
+            throw runtime_error("FileListPage::decode: Invalid page");
+        pos += sizeSize;
+
+        uint8_t hash[PathHash::hashlen] = {};
+        uint64_t prevMtime = 0;
+        for (; count; --count)
+        {
+            if (pos == end)
+                throw runtime_error("FileListPage::decode: Truncated page");
+            uint8_t shared = *pos++;
+            if (shared >= PathHash::hashlen || end-pos < PathHash::hashlen-shared)
+                throw runtime_error("FileListPage::decode: Invalid entry");
+            copy(pos, pos+PathHash::hashlen-shared, hash+shared);
+            pos += PathHash::hashlen-shared;
+
+            size_t zigzag;
+            if (!(sizeSize = parseVUint(pos, end-pos, zigzag)))
+                throw runtime_error("FileListPage::decode: Truncated page");
+            pos += sizeSize;
+
+            FileTime file;
+            file.hash = PathHash(hash);
+            file.mtime = prevMtime + ((zigzag >> 1) ^ -(uint64_t)(zigzag & 1));
+            prevMtime = file.mtime;
+            files.push_back(file);
+        }
+    } while (pos != end);
+    return files;
+}
@@ -0,0 +1,19 @@
+#ifndef FILELISTPAGE_H
+#define FILELISTPAGE_H
+
+#include "filetime.h"
+#include <vector>
+
+/// Compact encoding of a page of a folder's list of (path hash, mtime), sorted by hash
+/// Sorted hashes share their first bytes with the previous one, so each hash only stores the bytes that differ,
+/// and mtimes are stored as the difference with the previous one
+class FileListPage
+{
+public:
+    /// Encodes files sorted by hash
+    static std::vector<char> encode(std::vector<FileTime>::const_iterator begin, std::vector<FileTime>::const_iterator end);
+    /// Decodes one or more pages written back to back, throws if they are invalid
+    static std::vector<FileTime> decode(const std::vector<char>& data);
+};
+
+#endif // FILELISTPAGE_H
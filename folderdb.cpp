@@ -2,30 +2,91 @@
 #include "serialize.h"
 #include "util/pathtools.h"
 #include "settings.h"
+#include "util/filelocker.h"
 #include <fstream>
+#include <cstdio>
 #include <algorithm>
 #include <iostream>
 
 using namespace std;
 
 FolderDB::FolderDB(const string &path)
-    : file{path}
+    : path{path}, journal{path+".journal"}
 {
     load();
 }
 
 FolderDB::~FolderDB()
 {
-    save();
+    if (journal.size())
+        compact();
 }
 
-void FolderDB::save() const
+void FolderDB::save()
 {
-    file.overwrite(serialize());
+    // Replaying is much faster than writing everything again, so we let the journal grow as large as the snapshot
+    if (journal.size() > max<uint64_t>(FOLDER_JOURNAL_COMPACT_SIZE, getSnapshotSize()))
+        compact();
+}
+
+uint64_t FolderDB::getSnapshotSize() const
+{
+    lock_guard<recursive_mutex> lock(mutex);
+    uint64_t size = 0;
+    for (const Archive& archive : archives)
+        size += archive.getFileCount()*ArchiveFile::serializedSize();
+    return size;
+}
+
+void FolderDB::compact()
+{
+    lock_guard<std::mutex> compactLock(compactMutex);
+    if (!journal.beginSnapshot())
+    {
+        cout << "FolderDB::compact: Couldn't set the journal aside, not saving"<<endl;
+        return;
+    }
+
+    // Every folder added before the records were set aside is in this list, later ones have their records in the journal
+    vector<Archive*> snapshotArchives;
+    vector<char> data;
+    {
+        lock_guard<recursive_mutex> lock(mutex);
+        for (Archive& archive : archives)
+            snapshotArchives.push_back(&archive);
+        data = serialize();
+    }
+
+    // The old snapshot stays in place until the new one is complete, and the journal until it replaced it
+    // Each archive's files database is replaced on its own, replaying the journal over the newer ones is harmless
+    // Clients keep using the database meanwhile, removeArchive waits for us so the pointers stay valid
+    for (Archive* archive : snapshotArchives)
+    {
+        if (!archive->saveFiles())
+        {
+            cout << "FolderDB::compact: Failed to write "<<archive->getFilesDbPath()<<endl;
+            return;
+        }
+    }
+    string tmpPath = path+".tmp";
+    bool written;
+    try {
+        FileLocker tmp(tmpPath);
+        written = tmp.overwrite(data) && tmp.sync();
+    } catch (...) {
+        written = false;
+    }
+    if (!written || rename(tmpPath.c_str(), path.c_str()) < 0)
+    {
+        cout << "FolderDB::compact: Failed to write "<<tmpPath<<endl;
+        return;
+    }
+    journal.endSnapshot();
 }
 
 vector<char> FolderDB::serialize() const
 {
+    lock_guard<recursive_mutex> lock(mutex);
     vector<char> data;
 
     vector<vector<char>> archivesData;
@@ -43,11 +104,33 @@ vector<char> FolderDB::serialize() const
 
 void FolderDB::load()
 {
-    deserialize(file.readAll());
+    ifstream f(path, ios_base::binary);
+    vector<char> data((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+    if (f.is_open())
+        f.close();
+    deserialize(data);
+
+    bool unsaved;
+    {
+        lock_guard<recursive_mutex> lock(mutex);
+        for (const FolderJournal::Record& record : journal.readRecords())
+            replay(record);
+        unsaved = journal.size();
+        for (Archive& archive : archives)
+        {
+            archive.setJournal(&journal);
+            unsaved |= archive.hasUnsavedFiles();
+        }
+    }
+
+    // Start from an empty journal, so that we don't replay the same records every time
+    if (unsaved)
+        compact();
 }
 
 void FolderDB::deserialize(const std::vector<char> &data)
 {
+    lock_guard<recursive_mutex> lock(mutex);
     createPathTo("/", dataPath()+"archive/");
 
     if (data.empty())
@@ -56,106 +139,162 @@ void FolderDB::deserialize(const std::vector<char> &data)
 
     vector<vector<char>> archivesData = deserializeConsume<decltype(archivesData)>(it);
     for (const vector<char>& vec : archivesData)
+    {
         archives.emplace_back(vec);
+        archivesIndex[archives.back().getPathHash()] = prev(archives.end());
+    }
     vector<vector<char>> sourcesData = deserializeConsume<decltype(sourcesData)>(it);
     for (const vector<char>& vec : sourcesData)
     {
         auto it = vec.begin();
         sources.emplace_back(::dataToString(it));
+        sourcesIndex[sources.back().getPath()] = prev(sources.end());
     }
 }
 
-const std::vector<Source> &FolderDB::getSources() const
+void FolderDB::replay(const FolderJournal::Record& record)
 {
+    // A record may already be in the snapshot, or be about an archive removed later, so we skip what doesn't apply
+    if (record.type == FolderJournal::FileSet || record.type == FolderJournal::FileRemoved)
+    {
+        auto it = archivesIndex.find(record.archive);
+        if (it == archivesIndex.end())
+            return;
+        Archive& archive = *it->second;
+        if (record.type == FolderJournal::FileSet)
+        {
+            archive.addOrUpdateFile(record.file, record.mtime, record.size);
+            return;
+        }
+        archive.removeFile(record.file);
+    }
+    else if (record.type == FolderJournal::ArchiveAdded)
+    {
+        if (archivesIndex.count(record.archive))
+            return;
+        archives.emplace_back(record.archive);
+        archivesIndex[record.archive] = prev(archives.end());
+    }
+    else if (record.type == FolderJournal::ArchiveRemoved)
+    {
+        // Its data was removed with it
+        auto it = archivesIndex.find(record.archive);
+        if (it == archivesIndex.end())
+            return;
+        archives.erase(it->second);
+        archivesIndex.erase(it);
+    }
+    else if (record.type == FolderJournal::SourceAdded)
+    {
+        if (sourcesIndex.count(record.path))
+            return;
+        sources.emplace_back(record.path);
+        sourcesIndex[record.path] = prev(sources.end());
+    }
+    else if (record.type == FolderJournal::SourceRemoved)
+    {
+        auto it = sourcesIndex.find(record.path);
+        if (it == sourcesIndex.end())
+            return;
+        sources.erase(it->second);
+        sourcesIndex.erase(it);
+    }
+}
+
+const std::list<Source> &FolderDB::getSources() const
+{
+    lock_guard<recursive_mutex> lock(mutex);
     return sources;
 }
 
-const std::vector<Archive>& FolderDB::getArchives() const
+const std::list<Archive>& FolderDB::getArchives() const
 {
+    lock_guard<recursive_mutex> lock(mutex);
     return archives;
 }
 
 Source *FolderDB::getSource(const string &path)
 {
-    auto it = find_if(begin(sources), end(sources), [&path](const Source& s)
-    {
-        return s.getPath() == path;
-    });
-    if (it == end(sources))
+    lock_guard<recursive_mutex> lock(mutex);
+    auto it = sourcesIndex.find(path);
+    if (it == sourcesIndex.end())
         return nullptr;
 
-    return &*it;
+    return &*it->second;
 }
 
 Archive *FolderDB::getArchive(const PathHash &pathHash)
 {
-    auto it = find_if(begin(archives), end(archives), [&pathHash](const Archive& a)
-    {
-        return a.getPathHash() == pathHash;
-    });
-    if (it == end(archives))
+    lock_guard<recursive_mutex> lock(mutex);
+    auto it = archivesIndex.find(pathHash);
+    if (it == archivesIndex.end())
         return nullptr;
 
-    return &*it;
+    return &*it->second;
 }
 
 void FolderDB::addArchive(PathHash pathHash)
 {
-    if (any_of(begin(archives), end(archives), [&pathHash](const Archive& a){return a.getPathHash() == pathHash;}))
+    lock_guard<recursive_mutex> lock(mutex);
+    if (archivesIndex.count(pathHash))
         return;
 
     archives.emplace_back(pathHash);
+    archivesIndex[pathHash] = prev(archives.end());
+    journal.archiveAdded(pathHash);
+    archives.back().setJournal(&journal);
 }
 
 void FolderDB::addSource(const std::string& path)
 {
-    if (any_of(begin(sources), end(sources), [&path](const Source& s){return s.getPath() == path;}))
+    lock_guard<recursive_mutex> lock(mutex);
+    if (sourcesIndex.count(path))
         return;
 
     sources.emplace_back(path);
+    sourcesIndex[path] = prev(sources.end());
+    journal.sourceAdded(path);
 }
 
 bool FolderDB::removeArchive(const PathHash& pathHash)
 {
-    auto it = find_if(begin(archives), end(archives), [&pathHash](const Archive& a)
-    {
-        return a.getPathHash() == pathHash;
-    });
-    if (it == end(archives))
+    lock_guard<std::mutex> compactLock(compactMutex);
+    lock_guard<recursive_mutex> lock(mutex);
+    auto it = archivesIndex.find(pathHash);
+    if (it == archivesIndex.end())
     {
         cout << "FolderDB::removeArchive: Archive "<<pathHash.toBase64()<<" not found"<<endl;
         return false;
     }
 
-    it->removeData();
-    archives.erase(it);
+    // Recorded first, if we're interrupted while deleting, the archive mustn't come back with missing data
+    journal.archiveRemoved(pathHash);
+    it->second->removeData();
+    archives.erase(it->second);
+    archivesIndex.erase(it);
     return true;
 }
 
 bool FolderDB::removeArchive(const string &pathHashStr)
 {
-    auto it = find_if(begin(archives), end(archives), [&pathHashStr](const Archive& a)
-    {
-        return a.getPathHash().toBase64() == pathHashStr;
-    });
-    if (it == end(archives))
+    vector<unsigned char> hash;
+    if (!Crypto::fromBase64(pathHashStr, hash) || hash.size() != PathHash::hashlen)
     {
         cout << "FolderDB::removeArchive: Archive "<<pathHashStr<<" not found"<<endl;
         return false;
     }
-
-    it->removeData();
-    archives.erase(it);
-    return true;
+    return removeArchive(PathHash(hash.data()));
 }
 
 bool FolderDB::removeSource(const std::string& path)
 {
-    size_t size = sources.size();
-    sources.erase(remove_if(begin(sources), end(sources), [&path](const Source& s)
-    {
-        return s.getPath() == path;
-    }), end(sources));
-    return size != sources.size();
-}
+    lock_guard<recursive_mutex> lock(mutex);
+    auto it = sourcesIndex.find(path);
+    if (it == sourcesIndex.end())
+        return false;
 
+    sources.erase(it->second);
+    sourcesIndex.erase(it);
+    journal.sourceRemoved(path);
+    return true;
+}
@@ -2,21 +2,26 @@
 #define FOLDERDB_H
 
 #include <vector>
+#include <list>
+#include <unordered_map>
 #include <string>
+#include <mutex>
 #include "archive.h"
 #include "source.h"
-#include "util/filelocker.h"
+#include "folderjournal.h"
 
 /// Maintains a database of Folders
+/// All methods are thread-safe, source and archive pointers stay valid until that folder is removed
+/// Changes are appended to a journal as they happen, and saved in a new snapshot of the whole database once in a while
 class FolderDB
 {
 public:
-    explicit FolderDB(const std::string& path); ///< Reads serialized data from file
+    explicit FolderDB(const std::string& path); ///< Reads the snapshot and replays the journal. Throws if it is in use.
     ~FolderDB(); ///< Saves automatically
-    void save() const;
+    void save(); ///< Writes a new snapshot if the journal grew too large
 
-    const std::vector<Source>& getSources() const;
-    const std::vector<Archive>& getArchives() const;
+    const std::list<Source>& getSources() const;
+    const std::list<Archive>& getArchives() const;
     Source* getSource(const std::string& path);
     Archive* getArchive(const PathHash &pathHash);
     void addSource(const std::string& path);
@@ -29,11 +34,22 @@ protected:
     void load();
     std::vector<char> serialize() const;
     void deserialize(const std::vector<char>& data);
+    void replay(const FolderJournal::Record& record); ///< Applies a change read back from the journal
+    /// Writes a snapshot with all the changes, then empties the journal
+    /// Only holds our lock to list the folders, each archive is saved under its own lock
+    void compact();
+    uint64_t getSnapshotSize() const; ///< Approximate size of the files databases
 
 private:
-    std::vector<Archive> archives;
-    std::vector<Source> sources;
-    FileLocker file;
+    /// Lists, so that adding or removing a folder doesn't move the ones other clients are using
+    std::list<Archive> archives;
+    std::list<Source> sources;
+    std::unordered_map<PathHash, std::list<Archive>::iterator> archivesIndex;
+    std::unordered_map<std::string, std::list<Source>::iterator> sourcesIndex; ///< By path
+    const std::string path;
+    FolderJournal journal; ///< Also keeps other processes from using the database
+    mutable std::recursive_mutex mutex;
+    std::mutex compactMutex; ///< One compaction at a time, archives aren't removed while their files are saved
 };
 
 #endif // FOLDERDB_H
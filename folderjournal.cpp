@@ -0,0 +1,194 @@
+#include "folderjournal.h"
+#include "serialize.h"
+#include "util/filelocker.h"
+#include <unistd.h>
+
+using namespace std;
+
+FolderJournal::FolderJournal(const std::string& path)
+    : appended{0}, synced{0}, oldPath{path+".old"}
+{
+    file.reset(new FileLocker(path));
+
+    // We were interrupted while writing a snapshot, it may not have these records
+    if (access(oldPath.c_str(), F_OK) == 0)
+        oldFile.reset(new FileLocker(oldPath));
+}
+
+FolderJournal::~FolderJournal() = default;
+
+std::vector<FolderJournal::Record> FolderJournal::readRecords()
+{
+    lock_guard<std::mutex> lock(mutex);
+    vector<Record> records;
+    if (oldFile)
+        readFile(*oldFile, records);
+    readFile(*file, records);
+    return records;
+}
+
+uint64_t FolderJournal::size() const
+{
+    lock_guard<std::mutex> lock(mutex);
+    return file->size() + (oldFile ? oldFile->size() : 0);
+}
+
+uint64_t FolderJournal::fileSet(const PathHash& archive, const PathHash& file, uint64_t mtime, uint64_t size)
+{
+    return append({FileSet, archive, file, mtime, size, {}});
+}
+
+void FolderJournal::fileRemoved(const PathHash& archive, const PathHash& file)
+{
+    append({FileRemoved, archive, file, 0, 0, {}});
+}
+
+void FolderJournal::archiveAdded(const PathHash& archive)
+{
+    append({ArchiveAdded, archive, PathHash(), 0, 0, {}});
+}
+
+void FolderJournal::archiveRemoved(const PathHash& archive)
+{
+    append({ArchiveRemoved, archive, PathHash(), 0, 0, {}});
+}
+
+void FolderJournal::sourceAdded(const std::string& path)
+{
+    append({SourceAdded, PathHash(), PathHash(), 0, 0, path});
+}
+
+void FolderJournal::sourceRemoved(const std::string& path)
+{
+    append({SourceRemoved, PathHash(), PathHash(), 0, 0, path});
+}
+
+bool FolderJournal::sync(uint64_t record)
+{
+    // Records moved aside by a snapshot were synced then, the others are still in our file
+    lock_guard<std::mutex> syncLock(syncMutex);
+    if (synced >= record)
+        return true;
+    uint64_t last;
+    {
+        lock_guard<std::mutex> lock(mutex);
+        last = appended;
+    }
+    if (!file->sync())
+        return false;
+    synced = last;
+    return true;
+}
+
+bool FolderJournal::beginSnapshot()
+{
+    lock_guard<std::mutex> lock(mutex);
+    try {
+        if (!oldFile)
+            oldFile.reset(new FileLocker(oldPath));
+    } catch (...) {
+        return false;
+    }
+
+    // A previous snapshot may have failed, its records are still needed so we add ours after them
+    uint64_t oldSize = oldFile->size();
+    vector<char> data = file->readAll();
+    if (!oldFile->truncate(oldSize) || !oldFile->write(data) || !oldFile->sync())
+    {
+        oldFile->truncate(oldSize);
+        return false;
+    }
+    return file->truncate();
+}
+
+void FolderJournal::endSnapshot()
+{
+    lock_guard<std::mutex> lock(mutex);
+    if (!oldFile)
+        return;
+    oldFile->remove();
+    oldFile.reset();
+}
+
+uint64_t FolderJournal::append(const Record& record)
+{
+    vector<char> data;
+    serializeAppend(data, (uint8_t)record.type);
+    if (record.type == SourceAdded || record.type == SourceRemoved)
+    {
+        vectorAppend(data, vuintToData(record.path.size()));
+        data.insert(data.end(), record.path.begin(), record.path.end());
+    }
+    else
+    {
+        serializeAppend(data, record.archive);
+    }
+    if (record.type == FileSet || record.type == FileRemoved)
+        serializeAppend(data, record.file);
+    if (record.type == FileSet)
+    {
+        serializeAppend(data, record.mtime);
+        serializeAppend(data, record.size);
+    }
+
+    // Appends aren't synced, the records survive a crash of the process but maybe not of the system until sync()
+    lock_guard<std::mutex> lock(mutex);
+    if (!file->write(data))
+        return 0;
+    return ++appended;
+}
+
+size_t FolderJournal::parseRecords(const std::vector<char>& data, std::vector<Record>& records)
+{
+    size_t pos = 0;
+    while (pos < data.size())
+    {
+        auto it = data.cbegin()+pos;
+        size_t left = data.size()-pos-1;
+        Record record{(RecordType)*it++, PathHash(), PathHash(), 0, 0, {}};
+        if (record.type == SourceAdded || record.type == SourceRemoved)
+        {
+            size_t pathSize;
+            size_t sizeSize = parseVUint(data.data()+pos+1, left, pathSize);
+            if (!sizeSize || left-sizeSize < pathSize)
+                break;
+            record.path.assign(it+sizeSize, it+sizeSize+pathSize);
+            it += sizeSize+pathSize;
+        }
+        else if (record.type <= ArchiveRemoved)
+        {
+            size_t recordSize = PathHash::hashlen;
+            if (record.type == FileSet || record.type == FileRemoved)
+                recordSize += PathHash::hashlen;
+            if (record.type == FileSet)
+                recordSize += 2*sizeof(uint64_t);
+            if (left < recordSize)
+                break;
+
+            record.archive = ::deserializeConsume<PathHash>(it);
+            if (record.type == FileSet || record.type == FileRemoved)
+                record.file = ::deserializeConsume<PathHash>(it);
+            if (record.type == FileSet)
+            {
+                record.mtime = ::deserializeConsume<uint64_t>(it);
+                record.size = ::deserializeConsume<uint64_t>(it);
+            }
+        }
+        else
+        {
+            break;
+        }
+        records.push_back(move(record));
+        pos = it-data.cbegin();
+    }
+    return pos;
+}
+
+void FolderJournal::readFile(const FileLocker& file, std::vector<Record>& records)
+{
+    // A record may have been cut short if we were killed while writing it, we'll append after the good ones
+    vector<char> data = file.readAll();
+    size_t size = parseRecords(data, records);
+    if (size != data.size())
+        file.truncate(size);
+}
@@ -0,0 +1,84 @@
+#ifndef FOLDERJOURNAL_H
+#define FOLDERJOURNAL_H
+
+#include "pathhash.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+
+class FileLocker;
+
+/// Write-ahead log of the changes to a FolderDB since its last snapshot, so a crash doesn't lose them
+/// Each change is appended as it happens, and replayed over the snapshot when the database is loaded
+/// Replaying a record twice is harmless, each one sets the final state of what it changes
+/// The journal is locked while open, which also keeps two processes from using the same database
+class FolderJournal
+{
+public:
+    enum RecordType : uint8_t
+    {
+        FileSet = 0, ///< A file was added or overwritten in an archive, with its mtime and size
+        FileRemoved = 1,
+        ArchiveAdded = 2,
+        ArchiveRemoved = 3,
+        SourceAdded = 4,
+        SourceRemoved = 5,
+    };
+    /// A change to the database, only the fields of its type are serialized
+    struct Record
+    {
+        RecordType type;
+        PathHash archive; ///< For the archive and file records
+        PathHash file; ///< For the file records
+        uint64_t mtime, size; ///< For FileSet
+        std::string path; ///< For the source records
+    };
+
+public:
+    /// Opens the journal at path. Throws if it is locked.
+    explicit FolderJournal(const std::string& path);
+    ~FolderJournal();
+
+    /// Returns the records left by the previous runs, dropping a record cut short by a crash
+    std::vector<Record> readRecords();
+    uint64_t size() const; ///< Bytes in the journal, including the records kept for the next snapshot
+
+    /// Returns the number of the record to sync, or 0 if it couldn't be written
+    uint64_t fileSet(const PathHash& archive, const PathHash& file, uint64_t mtime, uint64_t size);
+    void fileRemoved(const PathHash& archive, const PathHash& file);
+    void archiveAdded(const PathHash& archive);
+    void archiveRemoved(const PathHash& archive);
+    void sourceAdded(const std::string& path);
+    void sourceRemoved(const std::string& path);
+
+    /// Waits until the records up to this number are on disk, returns false if they couldn't be synced
+    /// Callers that wait meanwhile share the next sync, so concurrent durable writes don't sync one at a time
+    bool sync(uint64_t record);
+
+    /// Moves the records so far aside, before we write a snapshot that has them
+    /// Records appended meanwhile go to the journal as usual, they may or may not be in the snapshot
+    /// Returns false if they couldn't be moved, the snapshot must then be abandoned
+    bool beginSnapshot();
+    /// The snapshot is on disk, forgets the records moved aside
+    void endSnapshot();
+
+private:
+    uint64_t append(const Record& record); ///< Returns the record's number, or 0 if it couldn't be written
+    /// Parses the records of a journal file, returns the size of the complete ones
+    static size_t parseRecords(const std::vector<char>& data, std::vector<Record>& records);
+    /// Reads the records of a journal file and cuts a torn record off its end
+    static void readFile(const FileLocker& file, std::vector<Record>& records);
+
+private:
+    mutable std::mutex mutex;
+    std::mutex syncMutex; ///< Held while syncing, the appends go on meanwhile
+    uint64_t appended; ///< Number of the last record appended
+    uint64_t synced; ///< Records up to this number are on disk, with syncMutex
+    std::unique_ptr<FileLocker> file;
+    std::unique_ptr<FileLocker> oldFile; ///< Records that are in the snapshot being written, if any
+    const std::string oldPath;
+};
+
+#endif // FOLDERJOURNAL_H
@@ -5,6 +5,7 @@
 #include <algorithm>
 #include <thread>
 #include <cassert>
+#include <map>
 #include "nodedb.h"
 #include "folderdb.h"
 #include "settings.h"
@@ -12,6 +13,7 @@
 #include "server.h"
 #include "net/netpacket.h"
 #include "net/netaddr.h"
+#include "net/netsock.h"
 #include "net/net.h"
 #include "serialize.h"
 #include "compression.h"
@@ -35,6 +37,109 @@ void checkDataDir()
     }
 }
 
+/// Parses trailing "--name=value" and "--flag" arguments, returns false if any argument isn't an option
+bool parseOptions(int argc, char* argv[], int first, map<string, string>& options)
+{
+    for (int i=first; i<argc; ++i)
+    {
+        string arg{argv[i]};
+        if (arg.compare(0, 2, "--"))
+            return false;
+        size_t eq = arg.find('=');
+        if (eq == string::npos)
+            options[arg.substr(2)] = "";
+        else
+            options[arg.substr(2, eq-2)] = arg.substr(eq+1);
+    }
+    return true;
+}
+
+/// Reads a flag option, returns false if it was given a value
+bool readFlag(map<string, string>& options, const string& name, bool& value)
+{
+    auto it = options.find(name);
+    if (it == options.end())
+        return true;
+    if (!it->second.empty())
+    {
+        cerr << "Option --"<<name<<" doesn't take a value"<<endl;
+        return false;
+    }
+    value = true;
+    options.erase(it);
+    return true;
+}
+
+/// Reads an unsigned option, returns false if it's present but invalid
+bool readOption(map<string, string>& options, const string& name, unsigned& value)
+{
+    auto it = options.find(name);
+    if (it == options.end())
+        return true;
+    try {
+        value = stoul(it->second);
+    } catch (...) {
+        cerr << "Invalid value for option --"<<name<<endl;
+        return false;
+    }
+    options.erase(it);
+    return true;
+}
+
+/// Reads the --durability option of a server node, returns false if it's present but invalid
+bool readDurability(map<string, string>& options, Durability& value)
+{
+    auto it = options.find("durability");
+    if (it == options.end())
+        return true;
+    if (it->second == "queued")
+        value = Durability::Queued;
+    else if (it->second == "written")
+        value = Durability::Written;
+    else if (it->second == "durable")
+        value = Durability::Durable;
+    else
+    {
+        cerr << "Invalid value for option --durability"<<endl;
+        return false;
+    }
+    options.erase(it);
+    return true;
+}
+
+/// Reads a size option like "10M", returns false if it's present but invalid
+bool readSizeOption(map<string, string>& options, const string& name, uint64_t& value)
+{
+    auto it = options.find(name);
+    if (it == options.end())
+        return true;
+    if (!parseHumanReadableSize(it->second, value))
+    {
+        cerr << "Invalid value for option --"<<name<<endl;
+        return false;
+    }
+    options.erase(it);
+    return true;
+}
+
+/// Reads the rate limit options of a push or restore
+bool readRateOptions(map<string, string>& options, RateOptions& limits)
+{
+    return readSizeOption(options, "rate", limits.rate)
+            && readSizeOption(options, "node-rate", limits.nodeRate)
+            && readSizeOption(options, "burst", limits.burst);
+}
+
+/// Reads the --connect-timeout option of the commands that connect to nodes
+bool readConnectTimeout(map<string, string>& options)
+{
+    unsigned timeout = DEFAULT_CONNECT_TIMEOUT;
+    if (!readOption(options, "connect-timeout", timeout))
+        return false;
+    NetSock::setConnectTimeout(max(timeout, 1u));
+    return true;
+}
+
 int main(int argc, char* argv[])
 {
     using namespace cmd;
@@ -88,21 +193,59 @@ int main(int argc, char* argv[])
         }
         else if (subcommand == "add-archive")
         {
+            map<string, string> options;
+            if (!parseOptions(argc, argv, 4, options)
+                    || !readConnectTimeout(options)
+                    || !options.empty())
+            {
+                help();
+                return EXIT_FAILURE;
+            }
             if (!folderAddArchive(argv[3]))
                 return EXIT_FAILURE;
         }
         else if (subcommand == "push")
         {
-            if (!folderPush(argv[3]))
+            map<string, string> options;
+            PushOptions pushOptions;
+            if (!parseOptions(argc, argv, 4, options)
+                    || !readOption(options, "streams", pushOptions.streams)
+                    || !readRateOptions(options, pushOptions.limits)
+                    || !readConnectTimeout(options)
+                    || !options.empty())
+            {
+                help();
+                return EXIT_FAILURE;
+            }
+            pushOptions.streams = max(pushOptions.streams, 1u);
+            if (!folderPush(argv[3], pushOptions))
                 return EXIT_FAILURE;
         }
         else if (subcommand == "status")
         {
+            map<string, string> options;
+            if (!parseOptions(argc, argv, 4, options)
+                    || !readConnectTimeout(options)
+                    || !options.empty())
+            {
+                help();
+                return EXIT_FAILURE;
+            }
             folderStatus(argv[3]);
         }
         else if (subcommand == "restore")
         {
-            folderRestore(argv[3]);
+            map<string, string> options;
+            RateOptions limits;
+            if (!parseOptions(argc, argv, 4, options)
+                    || !readRateOptions(options, limits)
+                    || !readConnectTimeout(options)
+                    || !options.empty())
+            {
+                help();
+                return EXIT_FAILURE;
+            }
+            folderRestore(argv[3], limits);
         }
         else
         {
@@ -121,7 +264,21 @@ int main(int argc, char* argv[])
         }
         else if (subcommand == "start")
         {
-            if (!nodeStart())
+            map<string, string> options;
+            ServerOptions serverOptions;
+            if (!parseOptions(argc, argv, 3, options)
+                    || !readOption(options, "max-clients", serverOptions.maxClients)
+                    || !readOption(options, "max-pending", serverOptions.maxPendingClients)
+                    || !readFlag(options, "evented", serverOptions.evented)
+                    || !readOption(options, "io-threads", serverOptions.ioThreads)
+                    || !readDurability(options, serverOptions.durability)
+                    || !readFlag(options, "pack", serverOptions.pack)
+                    || !options.empty())
+            {
+                help();
+                return EXIT_FAILURE;
+            }
+            if (!nodeStart(serverOptions))
                 return EXIT_FAILURE;
         }
         else if (argc < 4)
@@ -0,0 +1,88 @@
+#include "merkletree.h"
+#include "crypto.h"
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+constexpr unsigned MerkleTree::fanout;
+constexpr unsigned MerkleTree::depth;
+constexpr unsigned MerkleTree::bucketCount;
+
+MerkleTree::MerkleTree()
+    : nodes(levelOffset(depth+1))
+{
+}
+
+void MerkleTree::add(const PathHash& hash, uint64_t mtime)
+{
+    toggle(hash, mtime);
+}
+
+void MerkleTree::remove(const PathHash& hash, uint64_t mtime)
+{
+    toggle(hash, mtime);
+}
+
+void MerkleTree::update(const PathHash& hash, uint64_t oldMtime, uint64_t newMtime)
+{
+    if (oldMtime == newMtime)
+        return;
+    toggle(hash, oldMtime);
+    toggle(hash, newMtime);
+}
+
+void MerkleTree::clear()
+{
+    fill(nodes.begin(), nodes.end(), 0);
+}
+
+uint64_t MerkleTree::getDigest(unsigned level, unsigned index) const
+{
+    if (level > depth || index >= nodeCount(level))
+        throw runtime_error("MerkleTree::getDigest: Invalid node");
+    return nodes[levelOffset(level)+index];
+}
+
+std::vector<uint64_t> MerkleTree::getChildren(unsigned level, unsigned index) const
+{
+    if (level >= depth || index >= nodeCount(level))
+        throw runtime_error("MerkleTree::getChildren: Invalid node");
+    auto first = nodes.cbegin()+levelOffset(level+1)+index*fanout;
+    return vector<uint64_t>(first, first+fanout);
+}
+
+unsigned MerkleTree::nodeCount(unsigned level)
+{
+    return 1u << (4*level);
+}
+
+unsigned MerkleTree::bucketIndex(const PathHash& hash)
+{
+    return hash.prefix(4*depth);
+}
+
+uint64_t MerkleTree::fileDigest(const PathHash& hash, uint64_t mtime)
+{
+    // The XOR of two lists can only collide by chance if the file digests are well mixed
+    static const unsigned char key[crypto_shorthash_KEYBYTES] = {0};
+    vector<char> data = hash.serialize();
+    data.insert(data.end(), (char*)&mtime, (char*)&mtime+sizeof(mtime));
+    uint64_t digest;
+    crypto_shorthash((unsigned char*)&digest, (unsigned char*)data.data(), data.size(), key);
+    return digest;
+}
+
+void MerkleTree::toggle(const PathHash& hash, uint64_t mtime)
+{
+    uint64_t digest = fileDigest(hash, mtime);
+    unsigned bucket = bucketIndex(hash);
+    for (unsigned level=0; level<=depth; ++level)
+        nodes[levelOffset(level) + (bucket >> (4*(depth-level)))] ^= digest;
+}
+
+unsigned MerkleTree::levelOffset(unsigned level)
+{
+    // 1 + 16 + 256 + ... nodes come before this level
+    return (nodeCount(level)-1) / (fanout-1);
+}
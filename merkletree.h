@@ -0,0 +1,42 @@
+#ifndef MERKLETREE_H
+#define MERKLETREE_H
+
+#include "pathhash.h"
+#include <vector>
+#include <cstdint>
+
+/// Summary of a folder's (path hash, mtime) list, to find which parts of two lists differ
+/// Files are put in buckets by the first bits of their path hash, the buckets are the leaves of a tree
+/// Each node's digest is the XOR of the digests of all the files under it, so it can be updated in place
+class MerkleTree
+{
+public:
+    static constexpr unsigned fanout = 16; ///< Children of each node
+    static constexpr unsigned depth = 3; ///< Level of the buckets, the root is level 0
+    static constexpr unsigned bucketCount = 4096; ///< fanout^depth
+
+public:
+    MerkleTree();
+
+    void add(const PathHash& hash, uint64_t mtime);
+    void remove(const PathHash& hash, uint64_t mtime);
+    void update(const PathHash& hash, uint64_t oldMtime, uint64_t newMtime);
+    void clear();
+
+    uint64_t getDigest(unsigned level, unsigned index) const;
+    /// Returns the digests of the fanout children of a node, the node must not be a bucket
+    std::vector<uint64_t> getChildren(unsigned level, unsigned index) const;
+
+    static unsigned nodeCount(unsigned level); ///< Number of nodes at this level
+    static unsigned bucketIndex(const PathHash& hash); ///< Bucket a file goes in
+
+private:
+    static uint64_t fileDigest(const PathHash& hash, uint64_t mtime);
+    void toggle(const PathHash& hash, uint64_t mtime); ///< XORs the file in or out of the tree
+    static unsigned levelOffset(unsigned level); ///< Position of a level's first node in nodes
+
+private:
+    std::vector<uint64_t> nodes; ///< Digests of each level, root first
+};
+
+#endif // MERKLETREE_H
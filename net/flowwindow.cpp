@@ -0,0 +1,73 @@
+#include "net/flowwindow.h"
+#include <algorithm>
+
+using namespace std;
+
+constexpr size_t FlowWindow::initialWindow;
+constexpr size_t FlowWindow::minWindow;
+constexpr size_t FlowWindow::maxWindow;
+
+/// How long a bandwidth or RTT sample stays relevant
+static constexpr chrono::seconds sampleLifetime{10};
+
+FlowWindow::FlowWindow()
+    : window{initialWindow}, inFlight{0}, currentBytes{0}, delivered{0}, deliveredTime{Clock::now()}
+{
+}
+
+bool FlowWindow::canSend() const
+{
+    return inFlight < window;
+}
+
+void FlowWindow::sent(size_t bytes, bool last, uint32_t id)
+{
+    inFlight += bytes;
+    currentBytes += bytes;
+    if (!last)
+        return;
+
+    // With nothing in flight, the time we spent idle isn't part of the delivery rate
+    if (requests.empty())
+        deliveredTime = Clock::now();
+    requests.push_back({id, currentBytes, Clock::now(), delivered, deliveredTime});
+    currentBytes = 0;
+}
+
+void FlowWindow::acked(uint32_t id)
+{
+    auto it = find_if(requests.begin(), requests.end(), [id](const Request& r){return r.id == id;});
+    if (it == requests.end())
+        return;
+    Request request = *it;
+    requests.erase(it);
+    inFlight -= request.bytes;
+
+    Clock::time_point now = Clock::now();
+    delivered += request.bytes;
+    deliveredTime = now;
+
+    // Delivery rate over the time the request was in flight, like BBR does
+    double interval = chrono::duration<double>(now - request.deliveredTimeAtSend).count();
+    if (interval > 0)
+        filterSample(bandwidth, {(delivered - request.deliveredAtSend) / interval, now}, true);
+    filterSample(rtt, {chrono::duration<double>(now - request.sendTime).count(), now}, false);
+
+    double bdp = bandwidth.front().value * rtt.front().value;
+    window = max(minWindow, min(maxWindow, (size_t)(2*bdp)));
+}
+
+size_t FlowWindow::getWindow() const
+{
+    return window;
+}
+
+void FlowWindow::filterSample(std::deque<Sample>& samples, Sample sample, bool keepMax)
+{
+    // Monotonic queue, the front is always the best sample of the last sampleLifetime
+    while (!samples.empty() && (keepMax ? samples.back().value <= sample.value : samples.back().value >= sample.value))
+        samples.pop_back();
+    samples.push_back(sample);
+    while (sample.time - samples.front().time > sampleLifetime)
+        samples.pop_front();
+}
@@ -0,0 +1,60 @@
+#ifndef FLOWWINDOW_H
+#define FLOWWINDOW_H
+
+#include <deque>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+/// Limits the bytes of requests in flight to about twice the bandwidth-delay product of the link
+/// The bandwidth and round trip time are measured from the replies, so the window adapts to the link:
+/// it grows while more data in flight means more throughput, and stops once the link is saturated.
+/// Replies are matched to their request by ID, so they may arrive in any order.
+/// Requests without an ID (0) are matched in the order they were sent.
+class FlowWindow
+{
+public:
+    static constexpr size_t initialWindow = 1024*1024, minWindow = 256*1024, maxWindow = 256*1024*1024;
+
+public:
+    FlowWindow();
+
+    bool canSend() const; ///< True if we may start sending a new request
+    /// Counts bytes sent for the current request, a request may span several packets
+    /// The request is complete once its last packet is sent, and its reply can then be measured
+    /// The ID is that of the request's reply (see NetPacket::id), it's only needed with the last packet
+    void sent(size_t bytes, bool last, uint32_t id);
+    void acked(uint32_t id); ///< The reply of a complete request arrived, does nothing if we don't know the ID
+    size_t getWindow() const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+    /// A request waiting for its reply
+    struct Request
+    {
+        uint32_t id;
+        size_t bytes;
+        Clock::time_point sendTime;
+        uint64_t deliveredAtSend; ///< Bytes acked when the request was sent
+        Clock::time_point deliveredTimeAtSend; ///< Time of the last ack when the request was sent
+    };
+    /// A bandwidth or round trip time sample, we keep the best one seen recently
+    struct Sample
+    {
+        double value;
+        Clock::time_point time;
+    };
+    static void filterSample(std::deque<Sample>& samples, Sample sample, bool keepMax);
+
+private:
+    size_t window;
+    size_t inFlight; ///< Bytes sent and not acked yet, including the request being sent
+    size_t currentBytes; ///< Bytes of the request being sent
+    std::deque<Request> requests;
+    uint64_t delivered; ///< Total bytes acked
+    Clock::time_point deliveredTime; ///< Time of the last ack
+    std::deque<Sample> bandwidth; ///< Max filter of the delivery rate, in bytes per second
+    std::deque<Sample> rtt; ///< Min filter of the round trip time, in seconds
+};
+
+#endif // FLOWWINDOW_H
@@ -30,10 +30,18 @@ void Net::sendPacket(NetPacket packet, NetAddr nodeAddr)
         sock.send(packet);
 }
 
-bool Net::sendAuth(const NetSock& sock, const Server& server)
+bool Net::sendAuth(NetSock& sock, const Server& server)
 {
     NetPacket packet{NetPacket::Type::Auth, ::serialize(server.getPublicKey())};
     sock.send(packet);
     NetPacket reply = sock.recvPacket();
-    return reply.type == NetPacket::Type::Auth;
+    if (reply.type != NetPacket::Type::Auth)
+        return false;
+
+    // Older servers reply without the bitmask of the features they support
+    size_t features = 0;
+    if (!reply.data.empty() && !parseVUint(reply.data.data(), reply.data.size(), features))
+        features = 0;
+    sock.setRequestIds(features & NetPacket::RequestIds);
+    return true;
 }
@@ -17,7 +17,8 @@ static PublicKey getNodePk(NetAddr nodeAddr);
 static void sendPacket(NetPacket packet, NetAddr nodeAddr);
 static void sendPacket(NetPacket packet, NetSock sock);
 
-static bool sendAuth(const NetSock& sock, const Server& server);
+/// Authenticates us to the remote, and enables numbered requests on sock if the remote takes them
+static bool sendAuth(NetSock& sock, const Server& server);
 
 private:
 
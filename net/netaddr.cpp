@@ -15,7 +15,7 @@ NetAddr::NetAddr(const std::string &uri)
     hints.ai_family = AF_UNSPEC;     // don't care IPv4 or IPv6
     hints.ai_socktype = SOCK_STREAM; // TCP stream sockets
     int r = getaddrinfo(uri.c_str(), PORT_NUMBER_STR, &hints, &sockaddr);
-    if (r < 0)
+    if (r != 0)
     {
         sockaddr = 0;
         throw std::runtime_error("NetAddr::NetAddr: getaddrinfo failed");
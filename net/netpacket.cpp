@@ -11,10 +11,25 @@ NetPacket::NetPacket(NetPacket::Type type, std::vector<char> data)
 {
 }
 
+NetPacket NetPacket::reply(NetPacket::Type type, std::vector<char> data) const
+{
+    NetPacket packet{type, std::move(data)};
+    packet.id = id;
+    return packet;
+}
+
 std::vector<char> NetPacket::serialize() const
 {
     std::vector<char> rawData;
-    serializeAppend(rawData, (uint8_t)type);
+    if (id)
+    {
+        serializeAppend(rawData, (uint8_t)(type | numberedFlag));
+        vectorAppend(rawData, vuintToData(id));
+    }
+    else
+    {
+        serializeAppend(rawData, (uint8_t)type);
+    }
     vectorAppend(rawData, vuintToData(data.size()));
     vectorAppend(rawData, data);
     return rawData;
@@ -23,7 +38,10 @@ std::vector<char> NetPacket::serialize() const
 NetPacket NetPacket::deserialize(std::vector<char>::const_iterator& data)
 {
     NetPacket packet;
-    packet.type = (NetPacket::Type)deserializeConsume<uint8_t>(data);
+    uint8_t type = deserializeConsume<uint8_t>(data);
+    packet.type = (NetPacket::Type)(type & ~numberedFlag);
+    if (type & numberedFlag)
+        packet.id = dataToVUint(data);
     size_t size = dataToVUint(data);
     packet.data.reserve(size);
     packet.data.insert(end(packet.data), data, data+size);
@@ -33,21 +51,28 @@ NetPacket NetPacket::deserialize(std::vector<char>::const_iterator& data)
 
 NetPacket NetPacket::deserialize(const NetSock& clientsock)
 {
-    NetPacket packet;
-    packet.type = (NetPacket::Type)clientsock.recvByte();
-
-    /// Read vuint packet size from socket
-    unsigned char num3;
-    size_t size = 0;
-    int num2 = 0;
-    int i=0;
-    do
+    return clientsock.recvPacket();
+}
+
+size_t NetPacket::parseHeader(const char* data, size_t size, Type& type, uint32_t& id, size_t& dataSize)
+{
+    if (!size)
+        return 0;
+    uint8_t rawType = data[0];
+    type = (NetPacket::Type)(rawType & ~numberedFlag);
+    size_t pos = 1;
+
+    id = 0;
+    if (rawType & numberedFlag)
     {
-        num3 = clientsock.recvByte(); i++;
-        size |= (num3 & 0x7f) << num2;
-        num2 += 7;
-    } while ((num3 & 0x80) != 0);
+        size_t rawId;
+        size_t idSize = parseVUint(data+pos, size-pos, rawId);
+        if (!idSize)
+            return 0;
+        id = rawId;
+        pos += idSize;
+    }
 
-    packet.data = clientsock.recv(size);
-    return packet;
+    size_t sizeSize = parseVUint(data+pos, size-pos, dataSize);
+    return sizeSize ? sizeSize+pos : 0;
 }
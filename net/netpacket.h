@@ -23,18 +23,46 @@ public:
         DownloadArchiveMetadata, ///< Fetch the metadata of a compressed/encrypted file from an archive folder
         UploadArchive, ///< Send compressed/encrypted file to an archive folder
         DeleteArchive, ///< Requests that the server deletes a file from its archive folder
+        UploadArchiveBegin, ///< Start sending a compressed/encrypted file in chunks, like UploadArchive without the content
+        UploadArchiveChunk, ///< Next chunk of the file started by UploadArchiveBegin
+        UploadArchiveEnd, ///< Commit the chunked file, the server replies like for UploadArchive
+        DownloadArchiveStream, ///< Fetch a compressed/encrypted file as a header followed by DownloadArchiveChunks
+        DownloadArchiveChunk, ///< Next chunk of the file requested by DownloadArchiveStream
+        FolderTree, ///< Digests of the children of some nodes of a folder's Merkle tree
+        FolderTreeList, ///< Like FolderList, but only the files in some buckets of the Merkle tree
+        UploadArchiveBatch, ///< Send many small compressed/encrypted files at once, the reply has a result per file
+        DeleteArchiveBatch, ///< Like DeleteArchive for many files at once, the reply is a bitmap of the deleted files
+        UploadArchiveResume, ///< Ask how many chunks of an interrupted chunked upload the server kept
+        UploadArchiveContinue, ///< Like UploadArchiveBegin, but appends to the chunks the server kept
+        FolderListPage, ///< A folder's list of files sorted by hash, sent in compact pages, optionally only some buckets
+    };
+
+    /// Set on the type byte of a numbered packet, whose type is then followed by its vuint request ID
+    static constexpr uint8_t numberedFlag = 0x80;
+
+    /// Protocol features a server announces in its reply to Auth, as a vuint bitmask
+    enum Feature : uint64_t
+    {
+        RequestIds = 1, ///< Numbered requests get numbered replies, which may come out of order
     };
 
 public:
     NetPacket()=default;
     NetPacket(NetPacket::Type type);
     NetPacket(NetPacket::Type type, std::vector<char> data);
+    NetPacket reply(NetPacket::Type type, std::vector<char> data = {}) const; ///< A reply to this request, with its ID
     std::vector<char> serialize() const;
     static NetPacket deserialize(std::vector<char>::const_iterator& data);
     static NetPacket deserialize(const NetSock &clientsock); ///< May rethrow exceptions from the socket
+    /// Parses the type, request ID and data size at the start of a serialized packet
+    /// Returns the size of this header, or 0 if more data is needed to parse it
+    static size_t parseHeader(const char* data, size_t size, NetPacket::Type& type, uint32_t& id, size_t& dataSize);
 
 public:
     NetPacket::Type type;
+    /// Request ID, 0 if unnumbered. A reply carries the ID of its request, and every chunk of a streamed reply too
+    /// Unnumbered requests are answered in order, the replies to numbered ones are matched by their ID
+    uint32_t id = 0;
     std::vector<char> data;
 };
 
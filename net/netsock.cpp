@@ -9,14 +9,21 @@
 #include <sys/ioctl.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
 #include <cstring>
 #include <system_error>
 #include <iostream>
+#include <chrono>
 
 using namespace std;
+using namespace std::chrono;
+
+std::atomic<unsigned> NetSock::connectTimeout{DEFAULT_CONNECT_TIMEOUT};
 
 NetSock::NetSock()
-    : sockfd{0}, connected{false}
+    : sockfd{0}, connected{false}, nonBlocking{false}, requestIds{false}, lastRequestId{0},
+      rpos{0}, wpos{0}, sendFailed{false}
 {
     sockfd = socket(AF_INET, SOCK_STREAM, 0);
 }
@@ -29,16 +36,15 @@ NetSock::NetSock(const NetAddr& addr)
 }
 
 NetSock::NetSock(int sockfd, bool connected)
-    : sockfd{sockfd}, connected{connected}
+    : sockfd{sockfd}, connected{connected}, nonBlocking{false}, requestIds{false}, lastRequestId{0},
+      rpos{0}, wpos{0}, sendFailed{false}
 {
 }
 
 NetSock::NetSock(NetSock&& other)
+    : NetSock(-1)
 {
-    sockfd = other.sockfd;
-    connected = other.connected;
-    other.connected = false;
-    other.sockfd = -1;
+    *this = move(other);
 }
 
 NetSock::~NetSock()
@@ -49,17 +55,113 @@ NetSock::~NetSock()
 
 NetSock& NetSock::operator=(NetSock&& other)
 {
+    if (this == &other)
+        return *this;
+    close(sockfd);
     sockfd = other.sockfd;
     connected = other.connected;
+    nonBlocking = other.nonBlocking;
+    requestIds = other.requestIds;
+    lastRequestId = other.lastRequestId.load();
+    rbuf = move(other.rbuf);
+    rpos = other.rpos;
+    wbuf = move(other.wbuf);
+    wpos = other.wpos;
+    sendFailed = other.sendFailed;
     other.connected = false;
     other.sockfd = -1;
+    return *this;
 }
 
 bool NetSock::connect(const NetAddr& addr)
 {
-    int result = ::connect(sockfd, addr.sockaddr->ai_addr, addr.sockaddr->ai_addrlen);
-    connected = (result >= 0);
-    return connected;
+    // Alternate between the families, starting with the one getaddrinfo prefers
+    vector<const addrinfo*> preferred, others, candidates;
+    for (const addrinfo* ai = addr.sockaddr; ai; ai = ai->ai_next)
+        (ai->ai_family == addr.sockaddr->ai_family ? preferred : others).push_back(ai);
+    for (size_t i=0; i<max(preferred.size(), others.size()); ++i)
+    {
+        if (i < preferred.size())
+            candidates.push_back(preferred[i]);
+        if (i < others.size())
+            candidates.push_back(others[i]);
+    }
+
+    // Happy eyeballs: an address that doesn't answer only delays the next one by CONNECT_ATTEMPT_DELAY
+    auto deadline = steady_clock::now() + seconds(connectTimeout);
+    auto nextStart = steady_clock::now();
+    vector<pollfd> pending; // Attempts in progress
+    size_t next = 0;
+    int winner = -1;
+    while (winner < 0)
+    {
+        auto now = steady_clock::now();
+        if (now >= deadline)
+            break;
+
+        if (next < candidates.size() && (now >= nextStart || pending.empty()))
+        {
+            const addrinfo* ai = candidates[next++];
+            int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0)
+                continue;
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            {
+                winner = fd;
+                break;
+            }
+            if (errno != EINPROGRESS)
+            {
+                close(fd);
+                continue;
+            }
+            pending.push_back({fd, POLLOUT, 0});
+            nextStart = now + milliseconds(CONNECT_ATTEMPT_DELAY);
+            continue;
+        }
+        if (pending.empty())
+            break;
+
+        auto wakeup = next < candidates.size() ? min(deadline, nextStart) : deadline;
+        int timeout = duration_cast<milliseconds>(wakeup-now).count() + 1;
+        if (poll(pending.data(), pending.size(), timeout) < 0 && errno != EINTR)
+            break;
+        for (size_t i=0; i<pending.size();)
+        {
+            if (!pending[i].revents)
+            {
+                ++i;
+                continue;
+            }
+            int error = 0;
+            socklen_t len = sizeof(error);
+            if (getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+                error = errno;
+            if (!error && winner < 0)
+                winner = pending[i].fd;
+            else
+                close(pending[i].fd);
+            // A refused attempt lets the next address start right away
+            if (error)
+                nextStart = steady_clock::now();
+            pending.erase(pending.begin()+i);
+        }
+    }
+    for (const pollfd& attempt : pending)
+        close(attempt.fd);
+
+    if (winner < 0)
+    {
+        connected = false;
+        return false;
+    }
+    if (!nonBlocking)
+        fcntl(winner, F_SETFL, fcntl(winner, F_GETFL) & ~O_NONBLOCK);
+    close(sockfd);
+    sockfd = winner;
+    connected = true;
+    return true;
 }
 
 bool NetSock::connect(const std::string& uri)
@@ -71,6 +173,11 @@ bool NetSock::connect(const std::string& uri)
     }
 }
 
+void NetSock::setConnectTimeout(unsigned seconds)
+{
+    connectTimeout = seconds;
+}
+
 bool NetSock::isConnected() const
 {
     return connected;
@@ -82,18 +189,68 @@ void NetSock::send(const NetPacket& packet) const
     if (!connected)
         throw std::runtime_error("NetSock::send: Not connected");
 
-    int r = ::write(sockfd, &data[0], data.size());
-    if (r<0)
+    unique_lock<mutex> lock(sendMutex);
+    if (!nonBlocking)
     {
-        perror("NetSock::send");
+        size_t sent = 0;
+        while (sent < data.size())
+        {
+            ssize_t r = ::send(sockfd, &data[sent], data.size()-sent, MSG_NOSIGNAL);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0)
+            {
+                perror("NetSock::send");
+                throw runtime_error("NetSock::send: Write failed");
+            }
+            sent += r;
+        }
+        return;
+    }
+
+    // Only write directly if we wouldn't jump ahead of buffered data
+    size_t sent = wpos == wbuf.size() ? writeSome(data.data(), data.size()) : 0;
+    wbuf.insert(wbuf.end(), data.begin()+sent, data.end());
+    sendCond.wait(lock, [this]{return wbuf.size()-wpos <= maxSendBuffered || sendFailed;});
+    if (sendFailed)
         throw runtime_error("NetSock::send: Write failed");
+}
+
+size_t NetSock::writeSome(const char* data, size_t size) const
+{
+    size_t sent = 0;
+    while (sent < size && !sendFailed)
+    {
+        ssize_t r = ::send(sockfd, data+sent, size-sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (r > 0)
+            sent += r;
+        else if (r < 0 && errno == EINTR)
+            continue;
+        else if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        else
+            sendFailed = true;
     }
-    else if ((unsigned)r!=data.size())
+    return sent;
+}
+
+bool NetSock::flush() const
+{
+    lock_guard<mutex> lock(sendMutex);
+    wpos += writeSome(wbuf.data()+wpos, wbuf.size()-wpos);
+    if (wpos == wbuf.size())
     {
-        perror("NetSock::send");
-        throw runtime_error("NetSock::send: Failed to send all data");
+        wbuf.clear();
+        wpos = 0;
     }
+    sendCond.notify_all();
+    return !sendFailed;
+}
 
+size_t NetSock::bufferedSize() const
+{
+    lock_guard<mutex> lock(sendMutex);
+    return wbuf.size()-wpos;
 }
 
 void NetSock::sendEncrypted(NetPacket &packet, const Server &s, const PublicKey &pk) const
@@ -138,56 +295,94 @@ NetSock NetSock::accept()
     sockaddr_in cli_addr;
     socklen_t clilen = sizeof(cli_addr);
     int newsockfd = ::accept(sockfd, (struct sockaddr *) &cli_addr, &clilen);
-    return NetSock(newsockfd, true);
+    return NetSock(newsockfd, newsockfd >= 0);
 }
 
 std::vector<char> NetSock::recv(int count) const
 {
-    std::vector<char> data;
-
-    if (!count)
-        return data;
-
-    const size_t bufsize = 4096;
-    char* buf = new char[bufsize];
-    unsigned totalReceived = 0;
-
-    do {
-        int result;
-        unsigned toReceive;
-        if (count == -1)
-            toReceive = bufsize;
-        else
-            toReceive = min((size_t)(count-totalReceived), bufsize);
-        result = ::read(sockfd, buf, toReceive);
-        if (result <= 0)
-        {
-            perror("NetSock::recv");
-            break;
-        }
-        totalReceived += result;
-        data.insert(end(data), buf, buf+result);
-    } while (totalReceived < (unsigned)count);
+    if (count == -1)
+    {
+        if (rpos == rbuf.size())
+            fillBuffer(true);
+        count = rbuf.size()-rpos;
+    }
 
-    delete[] buf;
+    std::vector<char> data(count);
+    size_t buffered = min((size_t)count, rbuf.size()-rpos);
+    copy(rbuf.data()+rpos, rbuf.data()+rpos+buffered, data.data());
+    rpos += buffered;
+    recvInto(data.data()+buffered, count-buffered);
     return data;
 }
 
 uint8_t NetSock::recvByte() const
 {
-    uint8_t byte;
-    int result = ::read(sockfd, &byte, 1);
-    if (result == 0)
-        throw std::runtime_error("NetSock::recvByte: Remote host closed connection");
-    else if (result < 0)
-        throw std::runtime_error("NetSock::recvByte: Error reading from socket");
-    else
-        return byte;
+    if (rpos == rbuf.size())
+        fillBuffer(true);
+    return rbuf[rpos++];
 }
 
 NetPacket NetSock::recvPacket() const
 {
-    return NetPacket::deserialize(*this);
+    NetPacket packet;
+    size_t headerSize, dataSize;
+    while (!(headerSize = NetPacket::parseHeader(rbuf.data()+rpos, rbuf.size()-rpos, packet.type, packet.id, dataSize)))
+        fillBuffer(true);
+    rpos += headerSize;
+
+    // Small packets are read through the buffer, large ones straight into the packet
+    while (rbuf.size()-rpos < dataSize && dataSize-(rbuf.size()-rpos) < recvChunkSize)
+        fillBuffer(true);
+    size_t buffered = min(dataSize, rbuf.size()-rpos);
+    packet.data.resize(dataSize);
+    copy(rbuf.data()+rpos, rbuf.data()+rpos+buffered, packet.data.data());
+    rpos += buffered;
+    recvInto(packet.data.data()+buffered, dataSize-buffered);
+    return packet;
+}
+
+size_t NetSock::fillBuffer(bool block) const
+{
+    if (rpos == rbuf.size())
+    {
+        rbuf.clear();
+        rpos = 0;
+    }
+    else if (rpos > rbuf.size()/2)
+    {
+        rbuf.erase(rbuf.begin(), rbuf.begin()+rpos);
+        rpos = 0;
+    }
+
+    size_t size = rbuf.size();
+    rbuf.resize(size+recvChunkSize);
+    ssize_t r;
+    do {
+        r = ::recv(sockfd, &rbuf[size], recvChunkSize, block ? 0 : MSG_DONTWAIT);
+    } while (r < 0 && errno == EINTR);
+    rbuf.resize(size + max<ssize_t>(r, 0));
+
+    if (r == 0)
+        throw std::runtime_error("NetSock::fillBuffer: Remote host closed connection");
+    else if (r < 0 && (block || (errno != EAGAIN && errno != EWOULDBLOCK)))
+        throw std::runtime_error("NetSock::fillBuffer: Error reading from socket");
+    return max<ssize_t>(r, 0);
+}
+
+void NetSock::recvInto(char* dest, size_t size) const
+{
+    while (size)
+    {
+        ssize_t r = ::recv(sockfd, dest, size, 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        else if (r == 0)
+            throw std::runtime_error("NetSock::recvInto: Remote host closed connection");
+        else if (r < 0)
+            throw std::runtime_error("NetSock::recvInto: Error reading from socket");
+        dest += r;
+        size -= r;
+    }
 }
 
 NetPacket NetSock::recvEncryptedPacket(const Server& s, const PublicKey& pk) const
@@ -197,6 +392,55 @@ NetPacket NetSock::recvEncryptedPacket(const Server& s, const PublicKey& pk) con
     return p;
 }
 
+void NetSock::shutdown() const
+{
+    // Shutdown first, so that a blocked sender releases sendMutex
+    ::shutdown(sockfd, SHUT_RDWR);
+    lock_guard<mutex> lock(sendMutex);
+    sendFailed = true;
+    sendCond.notify_all();
+}
+
+int NetSock::getFd() const
+{
+    return sockfd;
+}
+
+void NetSock::setRequestIds(bool enabled)
+{
+    requestIds = enabled;
+}
+
+uint32_t NetSock::nextRequestId() const
+{
+    if (!requestIds)
+        return 0;
+    // 0 means unnumbered, skip it when we wrap around
+    uint32_t id;
+    while (!(id = ++lastRequestId))
+        continue;
+    return id;
+}
+
+void NetSock::setNonBlocking()
+{
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+    nonBlocking = true;
+}
+
+size_t NetSock::readAvailable() const
+{
+    return fillBuffer(false);
+}
+
+bool NetSock::tryRecvPacket(NetPacket& packet) const
+{
+    if (!hasBufferedPacket())
+        return false;
+    packet = recvPacket();
+    return true;
+}
+
 bool NetSock::isShutdown() const
 {
     pollfd fds;
@@ -206,27 +450,22 @@ bool NetSock::isShutdown() const
     return (fds.revents & POLLRDHUP) | (fds.revents & POLLHUP);
 }
 
+bool NetSock::hasBufferedPacket() const
+{
+    NetPacket::Type type;
+    uint32_t id;
+    size_t dataSize, size = rbuf.size()-rpos;
+    size_t headerSize = NetPacket::parseHeader(rbuf.data()+rpos, size, type, id, dataSize);
+    return headerSize && size-headerSize >= dataSize;
+}
+
 bool NetSock::isPacketAvailable() const
 {
     try {
-        /// Read vuint packet size from socket
-        unsigned char num3;
-        size_t size = 0;
-        int num2 = 0;
-        unsigned i=0;
-        do
-        {
-            if (bytesAvailable() < i+1)
+        while (!hasBufferedPacket())
+            if (!fillBuffer(false))
                 return false;
-            num3 = peekByte(); i++;
-            size |= (num3 & 0x7f) << num2;
-            num2 += 7;
-        } while ((num3 & 0x80) != 0);
-
-        if (bytesAvailable() < i+size)
-            return false;
-        else
-            return true;
+        return true;
     } catch(...) {
         return false;
     }
@@ -238,17 +477,12 @@ size_t NetSock::bytesAvailable() const
     if (ioctl(sockfd, FIONREAD, &size) < 0)
         throw runtime_error("NetSock::bytesAvailable: ioctl FIONREAD failure");
 
-    return size;
+    return rbuf.size()-rpos + size;
 }
 
 uint8_t NetSock::peekByte() const
 {
-    uint8_t byte;
-    int result = ::recv(sockfd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
-    if (result == 0)
-        throw std::runtime_error("NetSock::peekByte: Remote host closed connection");
-    else if (result < 0)
-        throw std::runtime_error("NetSock::peekByte: Error reading from socket");
-    else
-        return byte;
+    if (rpos == rbuf.size() && !fillBuffer(false))
+        throw std::runtime_error("NetSock::peekByte: No data available");
+    return rbuf[rpos];
 }
@@ -5,6 +5,9 @@
 #include <vector>
 #include <cstdint>
 #include <cstddef>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include "crypto.h"
 
 class NetAddr;
@@ -12,6 +15,10 @@ class NetPacket;
 class Server;
 
 /// Abstraction of a network socket
+/// Sends are serialized, so several threads can send on the same socket
+/// Reads go through a receive buffer, so that small packets don't cost one syscall per byte
+/// In non-blocking mode, sends are buffered and the owner must call flush() when the socket is writable,
+/// and packets are received with readAvailable() and tryRecvPacket() instead of the blocking calls
 class NetSock
 {
 public:
@@ -28,13 +35,29 @@ public:
     NetPacket recvPacket() const;
     NetPacket recvEncryptedPacket(const Server& s, const PublicKey& pk) const; ///< Returns the decrypted packet
     uint8_t peekByte() const;
-    bool isPacketAvailable() const;
+    bool isPacketAvailable() const; ///< Reads without blocking, returns true if a whole packet was received
+    bool hasBufferedPacket() const; ///< True if recvPacket can return without reading from the socket
     size_t bytesAvailable() const;
 
+    /// Tries all the addresses, starting the next attempt while the previous ones are still pending
+    /// The first connection to complete wins. Returns false if none did before the connect timeout.
     bool connect(const NetAddr& addr);
     bool connect(const std::string& uri);
+    static void setConnectTimeout(unsigned seconds); ///< Applies to all the following connects
     bool isConnected() const;
     bool isShutdown() const;
+    void shutdown() const; ///< Shuts down both directions, wakes up any thread blocked on this socket
+    int getFd() const; ///< For use with poll/epoll
+
+    /// Set once the remote announced that it answers numbered requests, see NetPacket::id
+    void setRequestIds(bool enabled);
+    uint32_t nextRequestId() const; ///< Returns a new request ID, or 0 if the remote doesn't take numbered requests
+
+    void setNonBlocking();
+    size_t readAvailable() const; ///< Reads without blocking, returns the bytes read. Throws if the connection was closed.
+    bool tryRecvPacket(NetPacket& packet) const; ///< Takes a packet from the receive buffer, returns false if none is complete
+    bool flush() const; ///< Sends as much buffered data as the socket takes, returns false if the socket is dead
+    size_t bufferedSize() const; ///< Bytes waiting in the send buffer for the socket to be writable
     void send(const NetPacket& packet) const;
     void sendEncrypted(NetPacket& packet, const Server& s, const PublicKey& pk) const; ///< Modifies the packet inplace!
     void sendEncrypted(NetPacket&& packet, const Server& s, const PublicKey& pk) const;
@@ -50,9 +73,31 @@ private:
     NetSock(const NetSock& other) = delete;
     NetSock& operator=(const NetSock&) = delete;
 
+private:
+    size_t writeSome(const char* data, size_t size) const; ///< Non-blocking write, sets sendFailed on error
+    size_t fillBuffer(bool block) const; ///< Reads one chunk into rbuf, returns its size. Throws if the connection was closed.
+    void recvInto(char* dest, size_t size) const; ///< Reads exactly size bytes from the socket, bypassing rbuf
+
+public:
+    static constexpr size_t recvChunkSize = 64*1024;
+    static constexpr size_t maxSendBuffered = 4*1024*1024; ///< Senders wait for the buffer to drain past this
+
+private:
+    static std::atomic<unsigned> connectTimeout; ///< In seconds
+
 private:
     int sockfd;
     bool connected;
+    bool nonBlocking;
+    bool requestIds; ///< The remote takes numbered requests
+    mutable std::atomic<uint32_t> lastRequestId;
+    mutable std::vector<char> rbuf; ///< Received data not yet parsed as packets
+    mutable size_t rpos; ///< Start of the unparsed data in rbuf
+    mutable std::vector<char> wbuf; ///< Data waiting for the socket to be writable
+    mutable size_t wpos; ///< Start of the unsent data in wbuf
+    mutable bool sendFailed;
+    mutable std::mutex sendMutex;
+    mutable std::condition_variable sendCond;
 };
 
 #endif // NETSOCK_H
@@ -1,10 +1,12 @@
 #include "node.h"
+#include "merkletree.h"
 #include "serialize.h"
 #include "net/netsock.h"
 #include "net/netpacket.h"
 #include "compression.h"
 #include "sourcefile.h"
 #include "server.h"
+#include "filelistpage.h"
 #include <iostream>
 
 using namespace std;
@@ -67,22 +69,96 @@ std::vector<FileTime> Node::fetchFolderList(const NetSock &sock, const Server &s
             throw runtime_error("Unable to get folder list from node "+getUri()+", giving up\n");
         rFilesData = Compression::inflate(reply.data);
     }
+    return deserializeFileList(rFilesData);
+}
+
+std::vector<uint16_t> Node::fetchChangedBuckets(const NetSock &sock, const Server &s,
+                                                const PathHash &folder, const MerkleTree &local) const
+{
+    // Only the children of nodes that differ are fetched, so this costs a few requests per changed bucket
+    vector<uint16_t> changed{0};
+    for (unsigned level=0; level<MerkleTree::depth && !changed.empty(); ++level)
+    {
+        vector<char> request = ::serialize(folder);
+        serializeAppend(request, (uint8_t)level);
+        for (uint16_t index : changed)
+            serializeAppend(request, index);
+
+        NetPacket reply = sock.secureRequest({NetPacket::FolderTree, request}, s, pk);
+        if (reply.type != NetPacket::FolderTree)
+            throw runtime_error("Unable to get folder tree from node "+getUri()+"\n");
+        if (reply.data.size() != changed.size()*MerkleTree::fanout*sizeof(uint64_t))
+            throw runtime_error("Received invalid folder tree from node "+getUri()+"\n");
+
+        vector<uint16_t> children;
+        auto it = reply.data.cbegin();
+        for (uint16_t index : changed)
+        {
+            for (unsigned i=0; i<MerkleTree::fanout; ++i)
+            {
+                unsigned child = index*MerkleTree::fanout+i;
+                if (::deserializeConsume<uint64_t>(it) != local.getDigest(level+1, child))
+                    children.push_back(child);
+            }
+        }
+        changed = move(children);
+    }
+    return changed;
+}
 
+std::vector<FileTime> Node::fetchBucketList(const NetSock &sock, const Server &s,
+                                            const PathHash &folder, const std::vector<uint16_t> &buckets) const
+{
+    vector<char> request = ::serialize(folder);
+    for (uint16_t bucket : buckets)
+        serializeAppend(request, bucket);
+
+    NetPacket reply = sock.secureRequest({NetPacket::FolderTreeList, request}, s, pk);
+    if (reply.type != NetPacket::FolderTreeList)
+        throw runtime_error("Unable to get folder list from node "+getUri()+", giving up\n");
+    return deserializeFileList(Compression::inflate(reply.data));
+}
+
+bool Node::fetchFolderPages(const NetSock &sock, const Server &s, const PathHash &folder, const std::vector<uint16_t> &buckets,
+                            const std::function<void(const std::vector<FileTime>&)>& onPage) const
+{
+    vector<char> request = ::serialize(folder);
+    for (uint16_t bucket : buckets)
+        serializeAppend(request, bucket);
+    sock.sendEncrypted({NetPacket::FolderListPage, request}, s, pk);
+
+    // We only get an Abort before the first page
+    for (bool first = true;; first = false)
+    {
+        NetPacket reply = sock.recvEncryptedPacket(s, pk);
+        if (first && reply.type == NetPacket::Abort)
+            return false;
+        if (reply.type != NetPacket::FolderListPage)
+            throw runtime_error("Unable to get folder list from node "+getUri()+", giving up\n");
+        vector<FileTime> page = FileListPage::decode(reply.data);
+        if (page.empty())
+            return true;
+        onPage(page);
+    }
+}
+
+std::vector<FileTime> Node::deserializeFileList(const std::vector<char> &data) const
+{
     static constexpr int entrySize = PathHash::hashlen + sizeof(uint64_t);
-    if (rFilesData.size() % entrySize != 0)
+    if (data.size() % entrySize != 0)
         throw runtime_error("Received invalid data from node "+getUri()+", giving up\n");
 
-    vector<FileTime> rEntries;
-    rEntries.reserve(rFilesData.size()/entrySize);
-    auto it = rFilesData.cbegin();
-    while (it != rFilesData.cend())
+    vector<FileTime> entries;
+    entries.reserve(data.size()/entrySize);
+    auto it = data.cbegin();
+    while (it != data.cend())
     {
         FileTime e;
         e.hash = ::deserializeConsume<PathHash>(it);
         e.mtime = ::deserializeConsume<uint64_t>(it);
-        rEntries.push_back(move(e));
+        entries.push_back(move(e));
     }
-    return rEntries;
+    return entries;
 }
 
 void Node::uploadFileAsync(const NetSock &sock, const Server &s, const PathHash &folder, const SourceFile &file) const
@@ -106,32 +182,39 @@ void Node::uploadFileAsync(const NetSock &sock, const Server &s, const PathHash
     sock.sendEncrypted({NetPacket::UploadArchive, data}, s, pk);
 }
 
-void Node::deleteFileAsync(const NetSock &sock, const Server &s, const PathHash &folder, const PathHash &file) const
+void Node::deleteFilesAsync(const NetSock &sock, const Server &s, const PathHash &folder, const std::vector<PathHash> &files) const
 {
     vector<char> data;
-    serializeAppend(data, folder);
-    serializeAppend(data, file);
-    sock.sendEncrypted({NetPacket::DeleteArchive, data}, s, pk);
+    data.reserve((files.size()+1)*PathHash::hashlen);
+    folder.serializeInto(data);
+    for (const PathHash& file : files)
+        file.serializeInto(data);
+    sock.sendEncrypted({NetPacket::DeleteArchiveBatch, data}, s, pk);
 }
 
-std::vector<char> Node::downloadFileMetadata(const NetSock &sock, const Server &s, const PathHash &folder, const PathHash &file) const
+void Node::downloadFileAsync(const NetSock &sock, const Server &s, const PathHash &folder,
+                             const PathHash &file, uint64_t startChunk, uint32_t id) const
 {
     vector<char> data;
     serializeAppend(data, folder);
     serializeAppend(data, file);
-    NetPacket reply = sock.secureRequest({NetPacket::DownloadArchiveMetadata, data}, s, pk);
-    if (reply.type != NetPacket::DownloadArchiveMetadata)
-        throw runtime_error("Node::downloadFileMetadata: Download failed");
-    return reply.data;
+    if (startChunk)
+        serializeAppend(data, startChunk);
+    NetPacket packet{NetPacket::DownloadArchiveStream, data};
+    packet.id = id;
+    sock.sendEncrypted(packet, s, pk);
 }
 
-std::vector<char> Node::downloadFile(const NetSock &sock, const Server &s, const PathHash &folder, const PathHash &file) const
+uint64_t Node::fetchUploadProgress(const NetSock &sock, const Server &s, const PathHash &folder,
+                                   const PathHash &file, uint64_t maxChunks) const
 {
     vector<char> data;
     serializeAppend(data, folder);
     serializeAppend(data, file);
-    NetPacket reply = sock.secureRequest({NetPacket::DownloadArchive, data}, s, pk);
-    if (reply.type != NetPacket::DownloadArchive)
-        throw runtime_error("Node::downloadFile: Download failed");
-    return reply.data;
+    serializeAppend(data, maxChunks);
+    NetPacket reply = sock.secureRequest({NetPacket::UploadArchiveResume, data}, s, pk);
+    if (reply.type != NetPacket::UploadArchiveResume || reply.data.size() != sizeof(uint64_t))
+        throw runtime_error("Unable to get upload progress from node "+getUri());
+    auto it = reply.data.cbegin();
+    return min(::deserializeConsume<uint64_t>(it), maxChunks);
 }
@@ -4,6 +4,7 @@
 #include <vector>
 #include <string>
 #include <array>
+#include <functional>
 
 #include "crypto.h"
 #include "filetime.h"
@@ -11,6 +12,7 @@
 class NetSock;
 class Server;
 class SourceFile;
+class MerkleTree;
 
 class Node
 {
@@ -28,12 +30,30 @@ public:
     // RPC calls
     bool createFolder(const NetSock& sock, const Server& s, const PathHash& folder) const;
     std::vector<FileTime> fetchFolderList(const NetSock& sock, const Server& s, const PathHash& folder) const;
+    /// Descends the remote folder's Merkle tree where it differs from ours, returns the buckets that differ
+    std::vector<uint16_t> fetchChangedBuckets(const NetSock& sock, const Server& s,
+                                              const PathHash& folder, const MerkleTree& local) const;
+    /// Like fetchFolderList, but only lists the files in these buckets of the Merkle tree
+    std::vector<FileTime> fetchBucketList(const NetSock& sock, const Server& s,
+                                          const PathHash& folder, const std::vector<uint16_t>& buckets) const;
+    /// Receives the remote's list sorted by hash one page at a time, only the files in buckets unless it's empty
+    /// Returns false if the remote doesn't know FolderListPage requests, throws on other errors
+    bool fetchFolderPages(const NetSock& sock, const Server& s, const PathHash& folder, const std::vector<uint16_t>& buckets,
+                          const std::function<void(const std::vector<FileTime>&)>& onPage) const;
     void uploadFileAsync(const NetSock& sock, const Server& s, const PathHash& folder, const SourceFile& file) const;
-    void deleteFileAsync(const NetSock& sock, const Server& s, const PathHash& folder, const PathHash& file) const;
-    std::vector<char> downloadFileMetadata(const NetSock& sock, const Server& s,
-                                           const PathHash& folder, const PathHash& file) const;
-    std::vector<char> downloadFile(const NetSock& sock, const Server& s,
-                                   const PathHash& folder, const PathHash& file) const;
+    /// Deletes many files at once, the remote replies with a bitmap of the files it deleted
+    void deleteFilesAsync(const NetSock& sock, const Server& s, const PathHash& folder, const std::vector<PathHash>& files) const;
+    /// Requests a file in chunks, the remote replies with its mtime and size then DownloadArchiveChunks
+    /// With a startChunk, the remote sends the metadata then the content after that many chunks
+    /// With a request ID (see NetSock::nextRequestId), the replies carry it and may come between other replies
+    void downloadFileAsync(const NetSock& sock, const Server& s, const PathHash& folder,
+                           const PathHash& file, uint64_t startChunk = 0, uint32_t id = 0) const;
+    /// Returns how many chunks of an interrupted chunked upload the remote kept, at most maxChunks
+    uint64_t fetchUploadProgress(const NetSock& sock, const Server& s, const PathHash& folder,
+                                 const PathHash& file, uint64_t maxChunks) const;
+
+private:
+    std::vector<FileTime> deserializeFileList(const std::vector<char>& data) const;
 
 private:
     std::string uri;
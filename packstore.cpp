@@ -0,0 +1,275 @@
+#include "packstore.h"
+#include "serialize.h"
+#include "settings.h"
+#include "util/filelocker.h"
+#include "util/pathtools.h"
+#include <unistd.h>
+#include <algorithm>
+
+using namespace std;
+
+PackStore::PackStore(const std::string& path)
+    : path{path}, loaded{false}, segmentCount{0}, lastSegmentEnd{0}
+{
+}
+
+PackStore::~PackStore() = default;
+
+bool PackStore::read(const PathHash& file, std::vector<char>& data) const
+{
+    // A garbage collection may move the record while we read it without our lock, we then read its new copy
+    for (int attempt=0; attempt<2; ++attempt)
+    {
+        Location location;
+        shared_ptr<const FileLocker> segment;
+        {
+            lock_guard<std::mutex> lock(mutex);
+            try {
+                load();
+                auto it = index.find(file);
+                if (it == index.end())
+                    return false;
+                location = it->second;
+                segment = getSegment(location.segment);
+            } catch (...) {
+                return false;
+            }
+        }
+        data = segment->read(location.offset, location.size);
+        if (data.size() == location.size)
+            return true;
+    }
+    return false;
+}
+
+bool PackStore::write(const PathHash& file, const std::vector<char>& data, bool durable)
+{
+    vector<char> record;
+    serializeAppend(record, file);
+    serializeAppend(record, (uint64_t)data.size());
+    record.insert(record.end(), data.begin(), data.end());
+
+    lock_guard<std::mutex> lock(mutex);
+    Location location;
+    try {
+        if (!append(record, durable, location))
+            return false;
+    } catch (...) {
+        return false;
+    }
+    indexRecord(file, {location.segment, location.offset+headerSize, data.size()}, false);
+    collectGarbage();
+    return true;
+}
+
+bool PackStore::contains(const PathHash& file) const
+{
+    lock_guard<std::mutex> lock(mutex);
+    try {
+        load();
+    } catch (...) {
+        return false;
+    }
+    return index.count(file);
+}
+
+bool PackStore::remove(const PathHash& file)
+{
+    vector<char> record;
+    serializeAppend(record, file);
+    serializeAppend(record, removedSize);
+
+    lock_guard<std::mutex> lock(mutex);
+    Location location;
+    try {
+        load();
+        if (!index.count(file))
+            return true;
+        if (!append(record, false, location))
+            return false;
+    } catch (...) {
+        return false;
+    }
+    indexRecord(file, {location.segment, location.offset, 0}, true);
+    collectGarbage();
+    return true;
+}
+
+void PackStore::load() const
+{
+    if (loaded)
+        return;
+
+    // Only the headers are read, the data of each record is skipped
+    index.clear();
+    removals.clear();
+    usage.clear();
+    size_t count = 0;
+    uint64_t pos = 0;
+    for (; access(segmentPath(count).c_str(), F_OK) == 0; ++count)
+    {
+        FileLocker segment{segmentPath(count), FileLocker::ReadOnly};
+        uint64_t size = segment.size();
+        usage.push_back({0, 0});
+        pos = 0;
+        while (size-pos >= headerSize)
+        {
+            vector<char> header = segment.read(pos, headerSize);
+            if (header.size() != headerSize)
+                break;
+            auto it = header.cbegin();
+            PathHash file = ::deserializeConsume<PathHash>(it);
+            uint64_t fileSize = ::deserializeConsume<uint64_t>(it);
+            if (fileSize == removedSize)
+            {
+                indexRecord(file, {count, pos, 0}, true);
+                pos += headerSize;
+                usage.back().size = pos;
+                continue;
+            }
+            // A record may have been cut short if we were killed while writing it, the next append overwrites it
+            if (size-pos-headerSize < fileSize)
+                break;
+            indexRecord(file, {count, pos+headerSize, fileSize}, false);
+            pos += headerSize+fileSize;
+            usage.back().size = pos;
+        }
+    }
+
+    if (count)
+        lastSegment.reset(new FileLocker(segmentPath(count-1)));
+    segmentCount = count;
+    lastSegmentEnd = pos;
+    loaded = true;
+}
+
+std::string PackStore::segmentPath(size_t segment) const
+{
+    return path+to_string(segment)+".pack";
+}
+
+std::shared_ptr<const FileLocker> PackStore::getSegment(size_t segment) const
+{
+    if (segment == segmentCount-1)
+        return lastSegment;
+
+    auto it = find_if(openSegments.begin(), openSegments.end(), [segment](const pair<size_t, shared_ptr<FileLocker>>& s)
+    {
+        return s.first == segment;
+    });
+    if (it != openSegments.end())
+    {
+        openSegments.splice(openSegments.begin(), openSegments, it);
+    }
+    else
+    {
+        openSegments.emplace_front(segment, make_shared<FileLocker>(segmentPath(segment), FileLocker::ReadOnly));
+        if (openSegments.size() > PACK_OPEN_SEGMENTS)
+            openSegments.pop_back();
+    }
+    return openSegments.front().second;
+}
+
+bool PackStore::append(const std::vector<char>& record, bool durable, Location& location)
+{
+    load();
+    if (!lastSegment || (lastSegmentEnd && lastSegmentEnd+record.size() > PACK_SEGMENT_SIZE))
+    {
+        // The full segment is closed, reads will reopen it. It's synced first, so moving records out of it is safe.
+        if (lastSegment && !lastSegment->sync())
+            return false;
+        createDirectory(path);
+        lastSegment.reset(new FileLocker(segmentPath(segmentCount)));
+        ++segmentCount;
+        usage.push_back({0, 0});
+        lastSegmentEnd = 0;
+    }
+
+    // This also drops what a failed append may have left, and puts us at the end
+    const FileLocker& segment = *lastSegment;
+    if (!segment.truncate(lastSegmentEnd) || !segment.write(record) || (durable && !segment.sync()))
+        return false;
+    location = {segmentCount-1, lastSegmentEnd, record.size()};
+    lastSegmentEnd += record.size();
+    usage.back().size = lastSegmentEnd;
+    return true;
+}
+
+void PackStore::indexRecord(const PathHash& file, const Location& location, bool removed) const
+{
+    // An older record may still be in a segment while the file has a record or a removal record
+    bool hidesOlder = false;
+    auto it = index.find(file);
+    if (it != index.end())
+    {
+        usage[it->second.segment].garbage += headerSize+it->second.size;
+        index.erase(it);
+        hidesOlder = true;
+    }
+    auto rit = removals.find(file);
+    if (rit != removals.end())
+    {
+        usage[rit->second.segment].garbage += headerSize;
+        removals.erase(rit);
+        hidesOlder = true;
+    }
+
+    if (!removed)
+        index[file] = location;
+    else if (hidesOlder)
+        removals[file] = location;
+    else
+        usage[location.segment].garbage += headerSize;
+}
+
+bool PackStore::collectGarbage()
+{
+    size_t segment = 0;
+    while (segment+1 < segmentCount && usage[segment].garbage*100 <= usage[segment].size*PACK_GARBAGE_PERCENT)
+        segment++;
+    if (segment+1 >= segmentCount)
+        return true;
+
+    vector<pair<PathHash, Location>> files, removed;
+    for (const auto& entry : index)
+        if (entry.second.segment == segment)
+            files.push_back(entry);
+    for (const auto& entry : removals)
+        if (entry.second.segment == segment)
+            removed.push_back(entry);
+
+    // The copies are appended like any other record, if we're killed before emptying the segment the later ones win
+    try {
+        shared_ptr<const FileLocker> source = getSegment(segment);
+        for (const auto& entry : files)
+        {
+            vector<char> record;
+            serializeAppend(record, entry.first);
+            serializeAppend(record, entry.second.size);
+            vectorAppend(record, source->read(entry.second.offset, entry.second.size));
+            Location location;
+            if (record.size() != headerSize+entry.second.size || !append(record, false, location))
+                return false;
+            indexRecord(entry.first, {location.segment, location.offset+headerSize, entry.second.size}, false);
+        }
+        for (const auto& entry : removed)
+        {
+            vector<char> record;
+            serializeAppend(record, entry.first);
+            serializeAppend(record, removedSize);
+            Location location;
+            if (!append(record, false, location))
+                return false;
+            indexRecord(entry.first, {location.segment, location.offset, 0}, true);
+        }
+    } catch (...) {
+        return false;
+    }
+
+    // The segment keeps its number, but none of its records are needed anymore once the copies are on disk
+    if (!lastSegment->sync() || truncate(segmentPath(segment).c_str(), 0) < 0)
+        return false;
+    openSegments.remove_if([segment](const pair<size_t, shared_ptr<FileLocker>>& s){return s.first == segment;});
+    usage[segment] = {0, 0};
+    return true;
+}
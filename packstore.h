@@ -0,0 +1,78 @@
+#ifndef PACKSTORE_H
+#define PACKSTORE_H
+
+#include "pathhash.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <list>
+#include <unordered_map>
+#include <cstdint>
+
+class FileLocker;
+
+/// Stores the small files of an archive appended together in a few large segment files, instead of one file each
+/// Each record is a file's path hash and uint64 size followed by its data, a size of -1 records that it was removed
+/// The index of the records is built from their headers the first time it's needed, later records win
+/// Records of overwritten and removed files become garbage. Once most of a full segment is garbage, the records
+/// it still needs are appended again and the segment is emptied, its number stays so the order of the others holds.
+/// Only the last segment stays open for appends, the full ones are opened to read them and only a few stay open
+class PackStore
+{
+public:
+    explicit PackStore(const std::string& path); ///< Directory of the segments, created by the first write
+    ~PackStore();
+
+    /// Reads a whole packed file, returns false if the file isn't packed or can't be read
+    bool read(const PathHash& file, std::vector<char>& data) const;
+    /// Appends a new version of a file, if durable waits until it's on disk. Returns false on failure.
+    bool write(const PathHash& file, const std::vector<char>& data, bool durable);
+    bool contains(const PathHash& file) const;
+    /// Records that a file was removed or is now stored elsewhere, returns false on failure
+    /// Does nothing if the file isn't packed
+    bool remove(const PathHash& file);
+
+private:
+    /// Where a file's data is in the segments, or a removal record with a size of 0
+    struct Location
+    {
+        size_t segment;
+        uint64_t offset, size;
+    };
+    /// Bytes of complete records in a segment, and how many of them are garbage
+    struct Usage
+    {
+        uint64_t size, garbage;
+    };
+    static constexpr size_t headerSize = PathHash::hashlen+sizeof(uint64_t);
+    static constexpr uint64_t removedSize = UINT64_MAX;
+
+    void load() const; ///< Builds the index and opens the last segment, once. Throws if a segment is locked.
+    std::string segmentPath(size_t segment) const;
+    /// Returns an open segment to read, reopening a full one if needed. Throws if it can't be opened.
+    std::shared_ptr<const FileLocker> getSegment(size_t segment) const;
+    /// Appends a record to the last segment, starting a new one when it's full. Sets the record's position.
+    /// Throws if a segment can't be opened, returns false if the write fails.
+    bool append(const std::vector<char>& record, bool durable, Location& location);
+    /// Indexes the newest record of a file, counting the records it makes useless as garbage
+    /// A removal record is kept as long as an older record of the file may still be in a segment
+    void indexRecord(const PathHash& file, const Location& location, bool removed) const;
+    /// Empties the first full segment that is over PACK_GARBAGE_PERCENT garbage, if any. Returns false if that failed.
+    bool collectGarbage();
+
+private:
+    const std::string path;
+    mutable std::mutex mutex;
+    mutable bool loaded;
+    mutable size_t segmentCount;
+    mutable std::vector<Usage> usage; ///< Of each segment
+    mutable std::shared_ptr<FileLocker> lastSegment; ///< Locked for appends, null if there are no segments yet
+    mutable uint64_t lastSegmentEnd; ///< Size of the complete records of the last segment
+    /// Full segments opened for reads, most recently used first. Readers may still use one after it's closed.
+    mutable std::list<std::pair<size_t, std::shared_ptr<FileLocker>>> openSegments;
+    mutable std::unordered_map<PathHash, Location> index;
+    mutable std::unordered_map<PathHash, Location> removals; ///< Removal records that hide older records
+};
+
+#endif // PACKSTORE_H
@@ -1,6 +1,7 @@
 #include "pathhash.h"
 #include "crypto.h"
 #include "cassert"
+#include <cstring>
 
 using namespace std;
 
@@ -34,6 +35,12 @@ void PathHash::rehash(const string &str)
     Crypto::hashInto(str, hash);
 }
 
+unsigned PathHash::prefix(unsigned bits) const
+{
+    assert(bits <= 16);
+    return ((unsigned)hash[0]<<8 | hash[1]) >> (16-bits);
+}
+
 bool PathHash::operator==(const PathHash &other) const noexcept
 {
     return equal(hash, hash+hashlen, other.hash);
@@ -56,3 +63,11 @@ void PathHash::serializeInto(std::vector<char> &dest) const
     dest.resize(size+hashlen);
     copy(&hash[0], &hash[hashlen], &dest[size]);
 }
+
+size_t std::hash<PathHash>::operator()(const PathHash& pathHash) const noexcept
+{
+    // The hash is already uniform. Take its last bytes, the first ones pick the Merkle tree bucket.
+    size_t value;
+    memcpy(&value, pathHash.hash+PathHash::hashlen-sizeof(value), sizeof(value));
+    return value;
+}
@@ -4,6 +4,7 @@
 #include <string>
 #include <vector>
 #include <cstdint>
+#include <functional>
 
 class PathHash
 {
@@ -13,8 +14,10 @@ public:
     explicit PathHash(uint8_t* data); ///< Read hash from serialized data
     explicit PathHash(const char* ambiguous) = delete; ///< Ambigous, string or serialized data?
     PathHash(const PathHash& other);
+    PathHash& operator=(const PathHash& other) = default;
     std::string toBase64() const;
     void rehash(const std::string& str);
+    unsigned prefix(unsigned bits) const; ///< Returns the first bits of the hash, at most 16
 
     bool operator==(const PathHash& other) const noexcept;
     bool operator<(const PathHash& other) const noexcept;
@@ -25,7 +28,17 @@ public:
 public:
     static constexpr int hashlen = 18;
 private:
+    friend struct std::hash<PathHash>;
     uint8_t hash[hashlen];
 };
 
+namespace std
+{
+/// For unordered containers, see FolderDB
+template<> struct hash<PathHash>
+{
+    size_t operator()(const PathHash& pathHash) const noexcept;
+};
+}
+
 #endif // PATHHASH_H
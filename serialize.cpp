@@ -17,6 +17,7 @@
 #include <iostream>
 #include <cassert>
 #include <algorithm>
+#include <stdexcept>
 #include "serialize.h"
 #include "crypto.h"
 #include "pathhash.h"
@@ -243,13 +244,28 @@ size_t dataToVUint(std::vector<char>::const_iterator& data)
     do
     {
         num3 = data[i]; i++;
-        num |= (num3 & 0x7f) << num2;
+        num |= (size_t)(num3 & 0x7f) << num2;
         num2 += 7;
     } while ((num3 & 0x80) != 0);
     data += i;
     return num;
 }
 
+size_t parseVUint(const char* data, size_t size, size_t& num)
+{
+    num = 0;
+    for (size_t i=0, shift=0; i<size; ++i, shift+=7)
+    {
+        if (shift >= 8*sizeof(size_t))
+            throw std::runtime_error("parseVUint: Invalid variable length integer");
+        uint8_t byte = data[i];
+        num |= (size_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return i+1;
+    }
+    return 0;
+}
+
 unsigned getVUint32Size(std::vector<char> data)
 {
     unsigned lensize=0;
@@ -319,8 +335,8 @@ void uint64ToData(std::vector<char> &dest, uint64_t num)
 
 std::vector<char> vuintToData(size_t num)
 {
-    std::vector<char> data(sizeof(size_t),0);
-    // Write the size in a Uint of variable lenght (8-32 bits)
+    std::vector<char> data(10,0);
+    // Write the size in a Uint of variable lenght (8-64 bits)
     int i=0;
     while (num >= 0x80)
     {
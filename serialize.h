@@ -38,6 +38,8 @@ uint16_t dataToUint16(std::vector<char>::const_iterator& data);
 uint32_t dataToUint32(std::vector<char>::const_iterator& data);
 uint64_t dataToUint64(std::vector<char>::const_iterator& data);
 size_t dataToVUint(std::vector<char>::const_iterator& data);
+/// Safe to use on partial data, returns the size of the vuint or 0 if more data is needed
+size_t parseVUint(const char* data, size_t size, size_t& num);
 unsigned getVUint32Size(std::vector<char> data);
 std::vector<char> uint8ToData(uint8_t num);
 std::vector<char> uint16ToData(uint16_t num);
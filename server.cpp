@@ -10,11 +10,15 @@
 #include <fstream>
 #include <cstring>
 #include <algorithm>
+#include <thread>
+#include <poll.h>
+#include <cerrno>
 
 using namespace std;
 using ::NetPacket;
 
 std::atomic<bool> Server::abortall{false};
+const EventFd Server::abortEvent;
 
 Server::Server(const std::string& configFilePath, NodeDB &ndb, FolderDB &fdb)
     : ndb{ndb}, fdb{fdb}
@@ -70,6 +74,16 @@ void Server::deserialize(const std::vector<char> &data)
 }
 
 int Server::exec()
+{
+    // Clients wait for their writes when they leave, so this outlives them
+    writeBehind.reset(new WriteBehind(options.ioThreads, WRITE_BEHIND_MAX_SIZE, options.durability));
+    Archive::setPacking(options.pack);
+    int result = options.evented ? execEvented() : execThreaded();
+    writeBehind.reset();
+    return result;
+}
+
+int Server::execThreaded()
 {
     if (!insock.listen())
     {
@@ -77,18 +91,77 @@ int Server::exec()
         return -1;
     }
 
-    for (;;)
+    vector<thread> workers;
+    for (unsigned i=0; i<options.maxClients; ++i)
+        workers.emplace_back(&Server::clientWorker, this);
+
+    while (!abortall)
     {
-        if (abortall)
-            return 0;
+        // The signal may be caught by another thread, so we also wait on abortEvent
+        pollfd fds[] = {{insock.getFd(), POLLIN, 0}, {abortEvent.getFd(), POLLIN, 0}};
+        if (poll(fds, 2, -1) <= 0 || !(fds[0].revents & POLLIN))
+            continue;
 
         NetSock client = insock.accept();
-        handleClient(client);
+        if (!client.isConnected())
+            continue;
+
+        unique_lock<mutex> lock(clientsMutex);
+        if (pendingClients.size() >= options.maxPendingClients)
+        {
+            lock.unlock();
+            cout << "Server::exec: Too many pending clients, refusing connection"<<endl;
+            try {
+                client.send({NetPacket::Abort});
+            } catch (...) {}
+            continue;
+        }
+        pendingClients.push_back(move(client));
+        clientsCond.notify_one();
     }
 
+    // Drop the clients that are still waiting, and kick out the ones being served
+    {
+        lock_guard<mutex> lock(clientsMutex);
+        pendingClients.clear();
+        for (NetSock* client : activeClients)
+            client->shutdown();
+    }
+    clientsCond.notify_all();
+    for (thread& worker : workers)
+        worker.join();
+
     return 0;
 }
 
+void Server::clientWorker()
+{
+    for (;;)
+    {
+        NetSock client;
+        {
+            unique_lock<mutex> lock(clientsMutex);
+            clientsCond.wait(lock, [this]{return abortall || !pendingClients.empty();});
+            if (abortall)
+                return;
+            client = move(pendingClients.front());
+            pendingClients.pop_front();
+            activeClients.push_back(&client);
+        }
+
+        handleClient(client);
+
+        lock_guard<mutex> lock(clientsMutex);
+        activeClients.erase(find(begin(activeClients), end(activeClients), &client));
+    }
+}
+
+void Server::setOptions(const ServerOptions& newOptions)
+{
+    options = newOptions;
+    options.maxClients = max(options.maxClients, 1u);
+}
+
 const PublicKey& Server::getPublicKey() const
 {
     return pk;
@@ -101,8 +174,9 @@ const SecretKey& Server::getSecretKey() const
 
 void Server::handleClient(NetSock& client)
 {
-    bool authenticated = false;
-    PublicKey remoteKey;
+    EventFd repliesReady; // Outlives state, the I/O threads notify it until the writes are done
+    ClientState state;
+    state.notifyReplies = [&repliesReady]{repliesReady.notify();};
 
     for (;;)
     {
@@ -110,77 +184,39 @@ void Server::handleClient(NetSock& client)
         {
             if (abortall)
                 break;
+            if (state.writes)
+                state.writes->sendReplies();
 
-            if (client.isShutdown())
+            // Between the chunks of numbered streams, answer the requests that arrived so they don't wait behind them
+            if (!state.streams.empty() && !client.isPacketAvailable())
             {
-                cout << "Client disconnected"<<endl;
-                break;
+                DownloadStream& stream = state.streams.front();
+                if (!sendStreamChunk(client, stream, state.remoteKey) || stream.pos >= stream.size)
+                    state.streams.pop_front();
+                continue;
             }
-            NetPacket packet = NetPacket::deserialize(client);
 
-            // Unauthenticated packets
-            if (packet.type == NetPacket::GetPk)
+            // While writes are queued, we also wake up to send their replies
+            if (state.writes && !client.hasBufferedPacket())
             {
-                cmdGetPk(client);
+                pollfd fds[] = {{client.getFd(), POLLIN | POLLRDHUP, 0}, {repliesReady.getFd(), POLLIN, 0}};
+                if (poll(fds, 2, -1) < 0 && errno != EINTR)
+                    throw runtime_error("Server::handleClient: poll failed");
+                if (fds[1].revents & POLLIN)
+                    repliesReady.consume();
+                if (!fds[0].revents)
+                    continue;
             }
-            else if (packet.type == NetPacket::Auth)
-            {
-                if (cmdAuth(client, packet, remoteKey))
-                    authenticated = true;
-                else
-                    break;
-            }
-            else if (!authenticated)
+
+            // Pipelined requests may already be buffered, no need to wait on the socket
+            if (!client.hasBufferedPacket() && client.isShutdown())
             {
-                cerr << "Unauthenticated packet of type "<<(int)packet.type<<" with size "<<packet.data.size()<<" received"<<endl;
-                client.send({NetPacket::Abort});
+                cout << "Client disconnected"<<endl;
                 break;
             }
-            else // Authenticated packets
-            {
-                Crypto::decryptPacket(packet, *this, remoteKey);
-
-                if (packet.type == NetPacket::FolderStats)
-                {
-                    if (!cmdFolderStats(client, packet, remoteKey))
-                        continue;
-                }
-                else if (packet.type == NetPacket::FolderCreate)
-                {
-                    if (!cmdFolderCreate(client, packet, remoteKey))
-                        continue;
-                }
-                else if (packet.type == NetPacket::FolderList)
-                {
-                    if (!cmdFolderList(client, packet, remoteKey))
-                        continue;
-                }
-                else if (packet.type == NetPacket::DownloadArchive)
-                {
-                    if (!cmdDownloadArchive(client, packet, remoteKey))
-                        continue;
-                }
-                else if (packet.type == NetPacket::DownloadArchiveMetadata)
-                {
-                    if (!cmdDownloadArchiveMetadata(client, packet, remoteKey))
-                        continue;
-                }
-                else if (packet.type == NetPacket::UploadArchive)
-                {
-                    if (!cmdUploadArchive(client, packet, remoteKey))
-                        continue;
-                }
-                else if (packet.type == NetPacket::DeleteArchive)
-                {
-                    if (!cmdDeleteArchive(client, packet, remoteKey))
-                        continue;
-                }
-                else
-                {
-                    cerr << "Unknown packet of type "<<(int)packet.type<<" with size "<<packet.data.size()<<" received"<<endl;
-                    client.send({NetPacket::Abort});
-                }
-            }
+            NetPacket packet = NetPacket::deserialize(client);
+            if (!handlePacket(client, packet, state))
+                break;
         }
         catch (const exception& e)
         {
@@ -196,3 +232,80 @@ void Server::handleClient(NetSock& client)
 
     fdb.save();
 }
+
+bool Server::handlePacket(NetSock& client, NetPacket& packet, ClientState& state)
+{
+    // Unauthenticated packets
+    if (packet.type == NetPacket::GetPk)
+    {
+        cmdGetPk(client);
+    }
+    else if (packet.type == NetPacket::Auth)
+    {
+        if (!cmdAuth(client, packet, state.remoteKey))
+            return false;
+        state.authenticated = true;
+    }
+    else if (!state.authenticated)
+    {
+        cerr << "Unauthenticated packet of type "<<(int)packet.type<<" with size "<<packet.data.size()<<" received"<<endl;
+        client.send(packet.reply(NetPacket::Abort));
+        return false;
+    }
+    else // Authenticated packets
+    {
+        PublicKey& remoteKey = state.remoteKey;
+        Crypto::decryptPacket(packet, *this, remoteKey);
+
+        // A client's requests are handled one at a time in the order they arrived, only upload writes and stream chunks overlap them
+        // Uploads may still be in the write queue, other requests must see them and reply after them
+        bool queuesWrites = packet.type == NetPacket::UploadArchive || packet.type == NetPacket::UploadArchiveBatch
+                || packet.type == NetPacket::UploadArchiveBegin || packet.type == NetPacket::UploadArchiveChunk
+                || packet.type == NetPacket::UploadArchiveContinue;
+        if (state.writes && !queuesWrites)
+            state.writes->wait();
+
+        if (packet.type == NetPacket::FolderStats)
+            cmdFolderStats(client, packet, remoteKey);
+        else if (packet.type == NetPacket::FolderCreate)
+            cmdFolderCreate(client, packet, remoteKey);
+        else if (packet.type == NetPacket::FolderList)
+            cmdFolderList(client, packet, remoteKey);
+        else if (packet.type == NetPacket::DownloadArchive)
+            cmdDownloadArchive(client, packet, remoteKey);
+        else if (packet.type == NetPacket::DownloadArchiveMetadata)
+            cmdDownloadArchiveMetadata(client, packet, remoteKey);
+        else if (packet.type == NetPacket::UploadArchive)
+            cmdUploadArchive(client, packet, state);
+        else if (packet.type == NetPacket::DeleteArchive)
+            cmdDeleteArchive(client, packet, remoteKey);
+        else if (packet.type == NetPacket::UploadArchiveBegin)
+            cmdUploadArchiveBegin(client, packet, state);
+        else if (packet.type == NetPacket::UploadArchiveChunk)
+            cmdUploadArchiveChunk(client, packet, state);
+        else if (packet.type == NetPacket::UploadArchiveEnd)
+            cmdUploadArchiveEnd(client, packet, state);
+        else if (packet.type == NetPacket::DownloadArchiveStream)
+            cmdDownloadArchiveStream(client, packet, state);
+        else if (packet.type == NetPacket::FolderTree)
+            cmdFolderTree(client, packet, remoteKey);
+        else if (packet.type == NetPacket::FolderTreeList)
+            cmdFolderTreeList(client, packet, remoteKey);
+        else if (packet.type == NetPacket::UploadArchiveBatch)
+            cmdUploadArchiveBatch(client, packet, state);
+        else if (packet.type == NetPacket::DeleteArchiveBatch)
+            cmdDeleteArchiveBatch(client, packet, remoteKey);
+        else if (packet.type == NetPacket::FolderListPage)
+            cmdFolderListPage(client, packet, remoteKey);
+        else if (packet.type == NetPacket::UploadArchiveResume)
+            cmdUploadArchiveResume(client, packet, remoteKey);
+        else if (packet.type == NetPacket::UploadArchiveContinue)
+            cmdUploadArchiveContinue(client, packet, state);
+        else
+        {
+            cerr << "Unknown packet of type "<<(int)packet.type<<" with size "<<packet.data.size()<<" received"<<endl;
+            client.send(packet.reply(NetPacket::Abort));
+        }
+    }
+    return true;
+}
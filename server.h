@@ -3,11 +3,65 @@
 
 #include "net/netsock.h"
 #include "crypto.h"
+#include "settings.h"
+#include "util/eventfd.h"
+#include "util/filelocker.h"
+#include "pathhash.h"
+#include "archive.h"
+#include "writebehind.h"
 #include <atomic>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <memory>
+#include <condition_variable>
 
 class NodeDB;
 class FolderDB;
 
+/// Tunables of a server node
+struct ServerOptions
+{
+    unsigned maxClients = DEFAULT_MAX_CLIENTS; ///< Clients handled concurrently by exec()
+    unsigned maxPendingClients = DEFAULT_MAX_PENDING_CLIENTS; ///< Accepted clients that can wait for a worker before we refuse new ones
+    bool evented = false; ///< Multiplex all clients on one epoll thread, maxClients is then the number of packet workers
+    unsigned ioThreads = DEFAULT_IO_THREADS; ///< Threads writing uploaded files
+    Durability durability = Durability::Written; ///< When uploaded files are acknowledged
+    bool pack = false; ///< Store small archive files in pack segments instead of a file each, see PackStore
+};
+
+/// An archive file being received in chunks
+/// If the client leaves before the end, the temporary file is kept so that a later UploadArchiveContinue can resume it
+struct ArchiveUpload
+{
+    PathHash folderHash, fileHash;
+    uint64_t mtime;
+    uint64_t size = 0;
+    std::unique_ptr<FileLocker> tmpFile; ///< Null if the upload failed, UploadArchiveEnd then replies with an Abort
+};
+
+/// A streamed download whose chunks are still being sent
+struct DownloadStream
+{
+    uint32_t id; ///< Request ID, carried by every chunk
+    PathHash fileHash;
+    Archive::DataReader read; ///< Keeps the file locked until the last chunk is sent
+    uint64_t pos, metaEnd, skipEnd, size; ///< We send [0, metaEnd) and [skipEnd, size), pos is the next byte to send
+};
+
+/// What the server remembers about a connected client
+struct ClientState
+{
+    bool authenticated = false;
+    PublicKey remoteKey;
+    std::unique_ptr<ArchiveUpload> upload; ///< Chunked upload in progress, if any
+    /// Wakes up the thread handling this client when write replies are ready to send, set by the server mode
+    std::function<void()> notifyReplies;
+    std::unique_ptr<ClientWrites> writes; ///< Replies owed for queued writes, created by the first upload
+    /// Numbered streamed downloads, oldest first. Their chunks are sent one at a time between the client's requests
+    std::deque<DownloadStream> streams;
+};
+
 /// Server node class.
 class Server
 {
@@ -16,6 +70,7 @@ public:
     Server(const std::string& configFilePath, NodeDB& ndb, FolderDB& fdb);
 
     int exec(); ///< Enters the server's event loop. Blocks until the server exits.
+    void setOptions(const ServerOptions& options);
 
     const PublicKey& getPublicKey() const;
     const SecretKey& getSecretKey() const;
@@ -26,7 +81,14 @@ protected:
     void save(const std::string& path) const;
     std::vector<char> serialize() const;
 
+    int execThreaded(); ///< exec() with a thread per client
+    int execEvented(); ///< exec() for the evented mode, see servereventloop.cpp
     void handleClient(NetSock& client);
+    void clientWorker(); ///< Handles clients from the pending queue until the server exits
+    /// Handles one packet from a client, returns false if the client must be dropped
+    bool handlePacket(NetSock& client, NetPacket& packet, ClientState& state);
+    /// Sends the next chunk of a streamed download, returns false if the file couldn't be read
+    bool sendStreamChunk(NetSock& client, DownloadStream& stream, const PublicKey& remoteKey);
 
 private:
     // Server commands
@@ -37,8 +99,19 @@ private:
     bool cmdFolderList(NetSock& client, NetPacket& packet, PublicKey& remoteKey);
     bool cmdDownloadArchive(NetSock& client, NetPacket& packet, PublicKey& remoteKey);
     bool cmdDownloadArchiveMetadata(NetSock& client, NetPacket& packet, PublicKey& remoteKey);
-    bool cmdUploadArchive(NetSock& client, NetPacket& packet, PublicKey& remoteKey);
+    bool cmdUploadArchive(NetSock& client, NetPacket& packet, ClientState& state);
+    bool cmdUploadArchiveBatch(NetSock& client, NetPacket& packet, ClientState& state);
     bool cmdDeleteArchive(NetSock& client, NetPacket& packet, PublicKey& remoteKey);
+    bool cmdDeleteArchiveBatch(NetSock& client, NetPacket& packet, PublicKey& remoteKey);
+    bool cmdUploadArchiveBegin(NetSock& client, NetPacket& packet, ClientState& state);
+    bool cmdUploadArchiveChunk(NetSock& client, NetPacket& packet, ClientState& state);
+    bool cmdUploadArchiveEnd(NetSock& client, NetPacket& packet, ClientState& state);
+    bool cmdUploadArchiveResume(NetSock& client, NetPacket& packet, PublicKey& remoteKey);
+    bool cmdUploadArchiveContinue(NetSock& client, NetPacket& packet, ClientState& state);
+    bool cmdDownloadArchiveStream(NetSock& client, NetPacket& packet, ClientState& state);
+    bool cmdFolderTree(NetSock& client, NetPacket& packet, PublicKey& remoteKey);
+    bool cmdFolderTreeList(NetSock& client, NetPacket& packet, PublicKey& remoteKey);
+    bool cmdFolderListPage(NetSock& client, NetPacket& packet, PublicKey& remoteKey);
 
 private:
     NetSock insock;
@@ -47,8 +120,16 @@ private:
     NodeDB& ndb;
     FolderDB& fdb;
 
+    ServerOptions options;
+    std::mutex clientsMutex;
+    std::condition_variable clientsCond;
+    std::deque<NetSock> pendingClients; ///< Accepted clients waiting for a worker
+    std::vector<NetSock*> activeClients; ///< Clients being handled by a worker
+    std::unique_ptr<WriteBehind> writeBehind; ///< Only while exec() runs
+
 public:
     static std::atomic<bool> abortall; ///< If set to true, the server will return form its event loop
+    static const EventFd abortEvent; ///< Readable once abortall is set, to wake up threads blocked in poll
 };
 
 #endif // SERVER_H
@@ -5,11 +5,30 @@
 #include "folderdb.h"
 #include "compression.h"
 #include "util/humanreadable.h"
+#include "util/filelocker.h"
+#include "settings.h"
+#include "filelistpage.h"
 #include <iostream>
 #include <algorithm>
 
 using namespace std;
 
+/// Appends data to a chunked upload, or marks it as failed
+static bool appendUploadData(ArchiveUpload& upload, const char* data, size_t size)
+{
+    if (!upload.tmpFile)
+        return false;
+    if (!upload.tmpFile->write(data, size))
+    {
+        cout << "Failed to write chunk of "<<upload.fileHash.toBase64()<<endl;
+        upload.tmpFile->remove();
+        upload.tmpFile.reset();
+        return false;
+    }
+    upload.size += size;
+    return true;
+}
+
 void Server::cmdGetPk(NetSock &client)
 {
     cout << "Public key requested" << endl;
@@ -29,14 +48,15 @@ bool Server::cmdAuth(NetSock& client, NetPacket& packet, PublicKey& remoteKey)
                 continue;
 
             cout << "Auth successful"<<endl;
-            client.send(NetPacket{NetPacket::Auth});
+            // Tell the client what it can use, older clients ignore this
+            client.send(packet.reply(NetPacket::Auth, vuintToData(NetPacket::RequestIds)));
             remoteKey = node.getPk();
             return true;
         }
     }
 
     cout << "Auth failed"<<endl;
-    client.send(NetPacket{NetPacket::Abort});
+    client.send(packet.reply(NetPacket::Abort));
     return false;
 }
 
@@ -49,13 +69,13 @@ bool Server::cmdFolderStats(NetSock& client, NetPacket& packet, PublicKey& remot
     if (!archive)
     {
         std::cout<<"cmdFolderStats: No such folder "<<pathHash.toBase64()<<endl;
-        client.send({NetPacket::Abort});
+        client.send(packet.reply(NetPacket::Abort));
         return false;
     }
 
     std::cout<<"Folder stats requested for "<<pathHash.toBase64()<<endl;
     vector<char> data = ::serialize(archive->getActualSize());
-    client.sendEncrypted({NetPacket::FolderStats, data}, *this, remoteKey);
+    client.sendEncrypted(packet.reply(NetPacket::FolderStats, data), *this, remoteKey);
     return true;
 }
 
@@ -69,7 +89,7 @@ bool Server::cmdFolderCreate(NetSock& client, NetPacket& packet, PublicKey&)
     PathHash pathHash((uint8_t*)packet.data.data());
     std::cout<<"Folder creation requested for "<<pathHash.toBase64()<<endl;
     fdb.addArchive(pathHash);
-    client.send({NetPacket::FolderCreate});
+    client.send(packet.reply(NetPacket::FolderCreate));
     return true;
 }
 
@@ -86,7 +106,7 @@ bool Server::cmdFolderList(NetSock& client, NetPacket& packet, PublicKey& remote
     Archive* archive = fdb.getArchive(pathHash);
     if (!archive)
     {
-        client.send({NetPacket::Abort});
+        client.send(packet.reply(NetPacket::Abort));
         return false;
     }
 
@@ -97,7 +117,112 @@ bool Server::cmdFolderList(NetSock& client, NetPacket& packet, PublicKey& remote
         ::serializeAppend(data, file.getMtime());
     }
     data = Compression::deflate(data);
-    client.sendEncrypted({NetPacket::FolderList, data}, *this, remoteKey);
+    client.sendEncrypted(packet.reply(NetPacket::FolderList, data), *this, remoteKey);
+    return true;
+}
+
+bool Server::cmdFolderTree(NetSock& client, NetPacket& packet, PublicKey& remoteKey)
+{
+    if (packet.data.size() < PathHash::hashlen+1 || (packet.data.size()-PathHash::hashlen-1) % sizeof(uint16_t))
+    {
+        std::cout << "Server::cmdFolderTree: Received invalid data, aborting"<<endl;
+        client.send(packet.reply(NetPacket::Abort));
+        return false;
+    }
+    auto pit = packet.data.cbegin();
+    PathHash pathHash = ::deserializeConsume<PathHash>(pit);
+    unsigned level = ::deserializeConsume<uint8_t>(pit);
+    vector<uint16_t> indices;
+    while (pit != packet.data.cend())
+        indices.push_back(::deserializeConsume<uint16_t>(pit));
+
+    Archive* archive = fdb.getArchive(pathHash);
+    if (!archive)
+    {
+        client.send(packet.reply(NetPacket::Abort));
+        return false;
+    }
+
+    vector<uint64_t> digests;
+    try {
+        digests = archive->getTreeChildren(level, indices);
+    } catch (const runtime_error& e) {
+        std::cout << "Server::cmdFolderTree: "<<e.what()<<endl;
+        client.send(packet.reply(NetPacket::Abort));
+        return false;
+    }
+
+    vector<char> data;
+    data.reserve(digests.size()*sizeof(uint64_t));
+    for (uint64_t digest : digests)
+        ::serializeAppend(data, digest);
+    client.sendEncrypted(packet.reply(NetPacket::FolderTree, data), *this, remoteKey);
+    return true;
+}
+
+bool Server::cmdFolderTreeList(NetSock& client, NetPacket& packet, PublicKey& remoteKey)
+{
+    if (packet.data.size() < PathHash::hashlen || (packet.data.size()-PathHash::hashlen) % sizeof(uint16_t))
+    {
+        std::cout << "Server::cmdFolderTreeList: Received invalid data, aborting"<<endl;
+        client.send(packet.reply(NetPacket::Abort));
+        return false;
+    }
+    auto pit = packet.data.cbegin();
+    PathHash pathHash = ::deserializeConsume<PathHash>(pit);
+    vector<uint16_t> buckets;
+    while (pit != packet.data.cend())
+        buckets.push_back(::deserializeConsume<uint16_t>(pit));
+
+    std::cout<<"Folder time list of "<<buckets.size()<<" buckets requested for "<<pathHash.toBase64()<<endl;
+    Archive* archive = fdb.getArchive(pathHash);
+    if (!archive)
+    {
+        client.send(packet.reply(NetPacket::Abort));
+        return false;
+    }
+
+    vector<char> data;
+    for (const ArchiveFile& file : archive->getFilesInBuckets(buckets))
+    {
+        ::serializeAppend(data, file.getPathHash());
+        ::serializeAppend(data, file.getMtime());
+    }
+    data = Compression::deflate(data);
+    client.sendEncrypted(packet.reply(NetPacket::FolderTreeList, data), *this, remoteKey);
+    return true;
+}
+
+bool Server::cmdFolderListPage(NetSock& client, NetPacket& packet, PublicKey& remoteKey)
+{
+    if (packet.data.size() < PathHash::hashlen || (packet.data.size()-PathHash::hashlen) % sizeof(uint16_t))
+    {
+        std::cout << "Server::cmdFolderListPage: Received invalid data, aborting"<<endl;
+        client.send(packet.reply(NetPacket::Abort));
+        return false;
+    }
+    auto pit = packet.data.cbegin();
+    PathHash pathHash = ::deserializeConsume<PathHash>(pit);
+    vector<uint16_t> buckets;
+    while (pit != packet.data.cend())
+        buckets.push_back(::deserializeConsume<uint16_t>(pit));
+
+    Archive* archive = fdb.getArchive(pathHash);
+    if (!archive)
+    {
+        client.send(packet.reply(NetPacket::Abort));
+        return false;
+    }
+
+    // No buckets means the whole folder. The archive caches the encoded pages of its buckets.
+    vector<vector<char>> pages = archive->getListPages(buckets, FOLDER_LIST_PAGE_SIZE);
+    std::cout<<"Folder time list of "<<(buckets.empty() ? "all" : to_string(buckets.size()))
+             <<" buckets requested for "<<pathHash.toBase64()<<endl;
+
+    // The client merges each page with its own list as it arrives, an empty page ends the list
+    for (vector<char>& page : pages)
+        client.sendEncrypted(packet.reply(NetPacket::FolderListPage, move(page)), *this, remoteKey);
+    client.sendEncrypted(packet.reply(NetPacket::FolderListPage, vuintToData(0)), *this, remoteKey);
     return true;
 }
 
@@ -116,26 +241,33 @@ bool Server::cmdDownloadArchive(NetSock& client, NetPacket& packet, PublicKey& r
     Archive* archive = fdb.getArchive(folderPathHash);
     if (!archive)
     {
-        client.send({NetPacket::Abort});
+        client.send(packet.reply(NetPacket::Abort));
         cout << "cmdDownloadArchive: Requested folder "<<folderPathHash.toBase64()<<" not found"<<endl;
         return false;
     }
 
     // Find file
-    ArchiveFile* file = archive->getFile(filePathHash);
+    unique_ptr<ArchiveFile> file = archive->getFile(filePathHash);
     if (!file)
     {
-        client.send({NetPacket::Abort});
+        client.send(packet.reply(NetPacket::Abort));
         cout << "cmdDownloadArchive: Requested file "<<filePathHash.toBase64()
              <<" in folder "<<folderPathHash.toBase64()<<" not found"<<endl;
         return false;
     }
 
     vector<char> fdata = ::serialize(file->getMtime());
-    vectorAppend(fdata, file->readAll());
+    try {
+        vectorAppend(fdata, file->readAll());
+    } catch (const runtime_error& e) {
+        // Another client may be writing this very file
+        client.send(packet.reply(NetPacket::Abort));
+        cout << "cmdDownloadArchive: Failed to read file "<<filePathHash.toBase64()<<": "<<e.what()<<endl;
+        return false;
+    }
     cout << "Download request in "<<folderPathHash.toBase64()<<" of "<<filePathHash.toBase64()
          <<" ("<<humanReadableSize(file->getActualSize())<<')'<<endl;
-    client.sendEncrypted({NetPacket::DownloadArchive, fdata}, *this, remoteKey);
+    client.sendEncrypted(packet.reply(NetPacket::DownloadArchive, fdata), *this, remoteKey);
     return true;
 }
 
@@ -154,37 +286,50 @@ bool Server::cmdDownloadArchiveMetadata(NetSock& client, NetPacket& packet, Publ
     Archive* archive = fdb.getArchive(folderPathHash);
     if (!archive)
     {
-        client.send({NetPacket::Abort});
+        client.send(packet.reply(NetPacket::Abort));
         cout << "cmdDownloadArchiveMetadata: Requested folder "<<folderPathHash.toBase64()<<" not found"<<endl;
         return false;
     }
 
     // Find file
-    ArchiveFile* file = archive->getFile(filePathHash);
+    unique_ptr<ArchiveFile> file = archive->getFile(filePathHash);
     if (!file)
     {
-        client.send({NetPacket::Abort});
+        client.send(packet.reply(NetPacket::Abort));
         cout << "cmdDownloadArchiveMetadata: Requested file "<<filePathHash.toBase64()
              <<" in folder "<<folderPathHash.toBase64()<<" not found"<<endl;
         return false;
     }
-    vector<char> data = file->readMetadata();
+    vector<char> data;
+    try {
+        data = file->readMetadata();
+    } catch (const runtime_error&) {
+    }
     if (!data.size())
     {
         cout << "cmdDownloadArchiveMetadata: Failed to read from file "<<filePathHash.toBase64()
              <<" in folder "<<folderPathHash.toBase64()<<endl;
-        client.send({NetPacket::Abort});
+        client.send(packet.reply(NetPacket::Abort));
         return false;
     }
     cout << "File size is "<<file->getActualSize()<<endl;
     serializeAppend(data, file->getActualSize());
     cout << "Metadata download request in "<<folderPathHash.toBase64()<<" of "<<filePathHash.toBase64()<<endl;
-    client.sendEncrypted({NetPacket::DownloadArchiveMetadata, data}, *this, remoteKey);
+    client.sendEncrypted(packet.reply(NetPacket::DownloadArchiveMetadata, data), *this, remoteKey);
     return true;
 }
 
-bool Server::cmdUploadArchive(NetSock& client, NetPacket& packet, PublicKey&)
+/// Returns the client's replies for queued writes, creating them on the first upload
+static ClientWrites& getClientWrites(NetSock& client, ClientState& state)
+{
+    if (!state.writes)
+        state.writes.reset(new ClientWrites(client, state.notifyReplies));
+    return *state.writes;
+}
+
+bool Server::cmdUploadArchive(NetSock& client, NetPacket& packet, ClientState& state)
 {
+    ClientWrites& writes = getClientWrites(client, state);
     if (packet.data.size() < 2*PathHash::hashlen+sizeof(uint64_t))
     {
         cout << "Server::cmdUploadArchive: Received invalid data, aborting"<<endl;
@@ -200,15 +345,77 @@ bool Server::cmdUploadArchive(NetSock& client, NetPacket& packet, PublicKey&)
     if (!a)
     {
         cout << "cmdUploadArchive: Folder "<<folderPathHash.toBase64()<<" not found"<<endl;
-        client.send({NetPacket::Abort});
+        writes.sendInOrder(packet.reply(NetPacket::Abort));
         return false;
     }
 
-    vector<char> data(pit, packet.data.cend());
+    vector<WriteBehind::FileWrite> files(1);
+    files[0].hash = filePathHash;
+    files[0].mtime = mtime;
+    files[0].data.assign(pit, packet.data.cend());
     cout << "Upload request in "<<folderPathHash.toBase64()<<" of "<<filePathHash.toBase64()
-         <<" ("<<humanReadableSize(data.size())<<')'<<endl;
-    a->writeArchiveFile(filePathHash, mtime, data);
-    client.send({NetPacket::UploadArchive});
+         <<" ("<<humanReadableSize(files[0].data.size())<<')'<<endl;
+    writeBehind->submit(writes, *a, move(files), packet.id, [](const vector<bool>& results)
+    {
+        return NetPacket(results[0] ? NetPacket::UploadArchive : NetPacket::Abort);
+    });
+    return true;
+}
+
+bool Server::cmdUploadArchiveBatch(NetSock& client, NetPacket& packet, ClientState& state)
+{
+    static constexpr size_t entryHeaderSize = PathHash::hashlen+sizeof(uint64_t);
+    ClientWrites& writes = getClientWrites(client, state);
+    if (packet.data.size() < PathHash::hashlen)
+    {
+        cout << "Server::cmdUploadArchiveBatch: Received invalid data, aborting"<<endl;
+        writes.sendInOrder(packet.reply(NetPacket::Abort));
+        return false;
+    }
+    auto pit = packet.data.cbegin();
+    PathHash folderPathHash = ::deserializeConsume<PathHash>(pit);
+
+    Archive* a = fdb.getArchive(folderPathHash);
+    if (!a)
+    {
+        cout << "cmdUploadArchiveBatch: Folder "<<folderPathHash.toBase64()<<" not found"<<endl;
+        writes.sendInOrder(packet.reply(NetPacket::Abort));
+        return false;
+    }
+
+    vector<WriteBehind::FileWrite> files;
+    uint64_t totalSize = 0;
+    while (pit != packet.data.cend())
+    {
+        size_t left = packet.data.cend()-pit, blobSize, sizeSize;
+        if (left < entryHeaderSize
+                || !(sizeSize = parseVUint(&*pit+entryHeaderSize, left-entryHeaderSize, blobSize))
+                || left-entryHeaderSize-sizeSize < blobSize)
+        {
+            cout << "Server::cmdUploadArchiveBatch: Received invalid data, aborting"<<endl;
+            writes.sendInOrder(packet.reply(NetPacket::Abort));
+            return false;
+        }
+        WriteBehind::FileWrite file;
+        file.hash = ::deserializeConsume<PathHash>(pit);
+        file.mtime = ::deserializeConsume<uint64_t>(pit);
+        pit += sizeSize;
+        file.data.assign(pit, pit+blobSize);
+        pit += blobSize;
+        totalSize += blobSize;
+        files.push_back(move(file));
+    }
+
+    cout << "Batch upload request in "<<folderPathHash.toBase64()<<" of "<<files.size()
+         <<" files ("<<humanReadableSize(totalSize)<<')'<<endl;
+    // One result byte per file, a bad file doesn't fail the others
+    PublicKey remoteKey = state.remoteKey;
+    writeBehind->submit(writes, *a, move(files), packet.id, [this, remoteKey](const vector<bool>& results)
+    {
+        NetPacket reply{NetPacket::UploadArchiveBatch, vector<char>(results.begin(), results.end())};
+        Crypto::encryptPacket(reply, *this, remoteKey);
+        return reply;
+    });
     return true;
 }
 
@@ -227,7 +434,7 @@ bool Server::cmdDeleteArchive(NetSock& client, NetPacket& packet, PublicKey&)
     Archive* archive = fdb.getArchive(folderPathHash);
     if (!archive)
     {
-        client.send({NetPacket::Abort});
+        client.send(packet.reply(NetPacket::Abort));
         cout << "Requested folder not found, sending Abort"<<endl;
         return false;
     }
@@ -236,7 +443,7 @@ bool Server::cmdDeleteArchive(NetSock& client, NetPacket& packet, PublicKey&)
     if (archive->removeArchiveFile(filePathHash))
     {
         cout << "Removal request in "<<folderPathHash.toBase64()<<" of "<<filePathHash.toBase64()<<endl;
-        client.send({NetPacket::DeleteArchive});
+        client.send(packet.reply(NetPacket::DeleteArchive));
         return true;
     }
     else
@@ -246,3 +453,309 @@ bool Server::cmdDeleteArchive(NetSock& client, NetPacket& packet, PublicKey&)
         return false;
     }
 }
+
+bool Server::cmdDeleteArchiveBatch(NetSock& client, NetPacket& packet, PublicKey& remoteKey)
+{
+    if (packet.data.size() < PathHash::hashlen || (packet.data.size()-PathHash::hashlen) % PathHash::hashlen)
+    {
+        cout << "Server::cmdDeleteArchiveBatch: Received invalid data, aborting"<<endl;
+        client.send(packet.reply(NetPacket::Abort));
+        return false;
+    }
+    auto pit = packet.data.cbegin();
+    PathHash folderPathHash = ::deserializeConsume<PathHash>(pit);
+    vector<PathHash> filePathHashes;
+    filePathHashes.reserve((packet.data.size()-PathHash::hashlen) / PathHash::hashlen);
+    while (pit != packet.data.cend())
+        filePathHashes.push_back(::deserializeConsume<PathHash>(pit));
+
+    Archive* archive = fdb.getArchive(folderPathHash);
+    if (!archive)
+    {
+        client.send(packet.reply(NetPacket::Abort));
+        cout << "Requested folder not found, sending Abort"<<endl;
+        return false;
+    }
+
+    vector<bool> removed = archive->removeArchiveFiles(filePathHashes);
+    vector<char> bitmap((removed.size()+7)/8);
+    size_t count = 0;
+    for (size_t i=0; i<removed.size(); ++i)
+    {
+        if (!removed[i])
+            continue;
+        bitmap[i/8] |= 1 << (i%8);
+        count++;
+    }
+    cout << "Removal request in "<<folderPathHash.toBase64()<<" of "<<removed.size()
+         <<" files, removed "<<count<<endl;
+    client.sendEncrypted(packet.reply(NetPacket::DeleteArchiveBatch, bitmap), *this, remoteKey);
+    return true;
+}
+
+bool Server::cmdUploadArchiveBegin(NetSock&, NetPacket& packet, ClientState& state)
+{
+    // The client sends the chunks without waiting for a reply, so errors are only reported at UploadArchiveEnd
+    state.upload.reset(new ArchiveUpload);
+    ArchiveUpload& upload = *state.upload;
+    if (packet.data.size() < 2*PathHash::hashlen+sizeof(uint64_t))
+    {
+        cout << "Server::cmdUploadArchiveBegin: Received invalid data"<<endl;
+        return false;
+    }
+    auto pit = packet.data.cbegin();
+    upload.folderHash = ::deserializeConsume<PathHash>(pit);
+    upload.fileHash = ::deserializeConsume<PathHash>(pit);
+    upload.mtime = ::deserializeConsume<uint64_t>(pit);
+
+    // Find folder
+    Archive* a = fdb.getArchive(upload.folderHash);
+    if (!a)
+    {
+        cout << "cmdUploadArchiveBegin: Folder "<<upload.folderHash.toBase64()<<" not found"<<endl;
+        return false;
+    }
+
+    try {
+        upload.tmpFile = a->beginArchiveFile(upload.fileHash);
+    } catch (const runtime_error& e) {
+        // Another client may be writing this very file
+        cout << "cmdUploadArchiveBegin: "<<e.what()<<endl;
+        return false;
+    }
+
+    cout << "Chunked upload request in "<<upload.folderHash.toBase64()<<" of "<<upload.fileHash.toBase64()<<endl;
+    size_t headerSize = pit - packet.data.cbegin();
+    return appendUploadData(upload, packet.data.data()+headerSize, packet.data.size()-headerSize);
+}
+
+bool Server::cmdUploadArchiveChunk(NetSock&, NetPacket& packet, ClientState& state)
+{
+    if (!state.upload)
+    {
+        cout << "Server::cmdUploadArchiveChunk: No upload in progress"<<endl;
+        return false;
+    }
+    return appendUploadData(*state.upload, packet.data.data(), packet.data.size());
+}
+
+bool Server::cmdUploadArchiveEnd(NetSock& client, NetPacket& packet, ClientState& state)
+{
+    unique_ptr<ArchiveUpload> upload = move(state.upload);
+    if (!upload || !upload->tmpFile)
+    {
+        cout << "Server::cmdUploadArchiveEnd: Upload failed, sending Abort"<<endl;
+        client.send(packet.reply(NetPacket::Abort));
+        return false;
+    }
+    else if (!packet.data.empty())
+    {
+        cout << "Upload of "<<upload->fileHash.toBase64()<<" cancelled by the client"<<endl;
+        upload->tmpFile->remove();
+        client.send(packet.reply(NetPacket::Abort));
+        return false;
+    }
+
+    // The folder may have been removed in the meantime
+    Archive* a = fdb.getArchive(upload->folderHash);
+    bool durable = options.durability == Durability::Durable;
+    try {
+        if (!a)
+            throw runtime_error("Folder "+upload->folderHash.toBase64()+" not found");
+        if (durable && !upload->tmpFile->sync())
+            throw runtime_error("Failed to sync "+upload->fileHash.toBase64());
+        a->commitArchiveFile(upload->fileHash, upload->mtime, upload->size, durable);
+    } catch (const runtime_error& e) {
+        cout << "cmdUploadArchiveEnd: "<<e.what()<<endl;
+        client.send(packet.reply(NetPacket::Abort));
+        return false;
+    }
+    upload->tmpFile.reset();
+
+    cout << "Chunked upload in "<<upload->folderHash.toBase64()<<" of "<<upload->fileHash.toBase64()
+         <<" complete ("<<humanReadableSize(upload->size)<<')'<<endl;
+    client.send(packet.reply(NetPacket::UploadArchive));
+    return true;
+}
+
+bool Server::cmdUploadArchiveResume(NetSock& client, NetPacket& packet, PublicKey& remoteKey)
+{
+    if (packet.data.size() != 2*PathHash::hashlen+sizeof(uint64_t))
+    {
+        cout << "Server::cmdUploadArchiveResume: Received invalid data, aborting"<<endl;
+        client.send(packet.reply(NetPacket::Abort));
+        return false;
+    }
+    auto pit = packet.data.cbegin();
+    PathHash folderPathHash = ::deserializeConsume<PathHash>(pit);
+    PathHash filePathHash = ::deserializeConsume<PathHash>(pit);
+    uint64_t maxChunks = ::deserializeConsume<uint64_t>(pit);
+
+    // We reply 0 if there is nothing to resume, the client then starts over
+    uint64_t chunks = 0;
+    Archive* archive = fdb.getArchive(folderPathHash);
+    try {
+        if (archive)
+            archive->resumeArchiveFile(filePathHash, maxChunks, chunks);
+    } catch (const runtime_error& e) {
+        // Another client may be writing this very file
+        cout << "cmdUploadArchiveResume: "<<e.what()<<endl;
+        chunks = 0;
+    }
+
+    cout << "Resume request in "<<folderPathHash.toBase64()<<" of "<<filePathHash.toBase64()
+         <<", kept "<<chunks<<" chunks"<<endl;
+    client.sendEncrypted(packet.reply(NetPacket::UploadArchiveResume, ::serialize(chunks)), *this, remoteKey);
+    return true;
+}
+
+bool Server::cmdUploadArchiveContinue(NetSock&, NetPacket& packet, ClientState& state)
+{
+    // Like UploadArchiveBegin, errors are only reported at UploadArchiveEnd
+    state.upload.reset(new ArchiveUpload);
+    ArchiveUpload& upload = *state.upload;
+    if (packet.data.size() != 2*PathHash::hashlen+2*sizeof(uint64_t))
+    {
+        cout << "Server::cmdUploadArchiveContinue: Received invalid data"<<endl;
+        return false;
+    }
+    auto pit = packet.data.cbegin();
+    upload.folderHash = ::deserializeConsume<PathHash>(pit);
+    upload.fileHash = ::deserializeConsume<PathHash>(pit);
+    upload.mtime = ::deserializeConsume<uint64_t>(pit);
+    uint64_t chunks = ::deserializeConsume<uint64_t>(pit);
+
+    Archive* a = fdb.getArchive(upload.folderHash);
+    if (!a)
+    {
+        cout << "cmdUploadArchiveContinue: Folder "<<upload.folderHash.toBase64()<<" not found"<<endl;
+        return false;
+    }
+
+    // The client continues after the chunks we said we had, we must still have exactly those
+    uint64_t kept = 0;
+    try {
+        upload.tmpFile = a->resumeArchiveFile(upload.fileHash, chunks, kept);
+    } catch (const runtime_error& e) {
+        cout << "cmdUploadArchiveContinue: "<<e.what()<<endl;
+        return false;
+    }
+    if (!upload.tmpFile || kept != chunks)
+    {
+        cout << "cmdUploadArchiveContinue: Only "<<kept<<" of "<<chunks<<" chunks of "
+             <<upload.fileHash.toBase64()<<" left, can't resume"<<endl;
+        upload.tmpFile.reset();
+        return false;
+    }
+    upload.size = upload.tmpFile->size();
+
+    cout << "Resuming chunked upload in "<<upload.folderHash.toBase64()<<" of "<<upload.fileHash.toBase64()
+         <<" after "<<chunks<<" chunks"<<endl;
+    return true;
+}
+
+bool Server::cmdDownloadArchiveStream(NetSock& client, NetPacket& packet, ClientState& state)
+{
+    if (packet.data.size() != 2*PathHash::hashlen && packet.data.size() != 2*PathHash::hashlen+sizeof(uint64_t))
+    {
+        cout << "Server::cmdDownloadArchiveStream: Received invalid data, aborting"<<endl;
+        return false;
+    }
+    auto pit = packet.data.cbegin();
+    PathHash folderPathHash = ::deserializeConsume<PathHash>(pit);
+    PathHash filePathHash = ::deserializeConsume<PathHash>(pit);
+    // A resumed download skips the first chunks of the content, but still needs the metadata
+    uint64_t startChunk = pit != packet.data.cend() ? ::deserializeConsume<uint64_t>(pit) : 0;
+
+    // Find folder
+    Archive* archive = fdb.getArchive(folderPathHash);
+    if (!archive)
+    {
+        client.send(packet.reply(NetPacket::Abort));
+        cout << "cmdDownloadArchiveStream: Requested folder "<<folderPathHash.toBase64()<<" not found"<<endl;
+        return false;
+    }
+
+    // Find file
+    unique_ptr<ArchiveFile> file = archive->getFile(filePathHash);
+    if (!file)
+    {
+        client.send(packet.reply(NetPacket::Abort));
+        cout << "cmdDownloadArchiveStream: Requested file "<<filePathHash.toBase64()
+             <<" in folder "<<folderPathHash.toBase64()<<" not found"<<endl;
+        return false;
+    }
+
+    // We send the version we open now until the last chunk, other clients may read or replace it meanwhile
+    Archive::DataReader read;
+    uint64_t size;
+    try {
+        read = archive->openArchiveFile(filePathHash, size);
+    } catch (const runtime_error& e) {
+        client.send(packet.reply(NetPacket::Abort));
+        cout << "cmdDownloadArchiveStream: Failed to read file "<<filePathHash.toBase64()<<": "<<e.what()<<endl;
+        return false;
+    }
+    uint64_t metaEnd = size, skipEnd = size; // We send [0, metaEnd) and [skipEnd, size)
+    if (startChunk)
+    {
+        uint64_t chunks;
+        metaEnd = Archive::skipChunks(read, size, 0, chunks);
+        skipEnd = Archive::skipChunks(read, size, startChunk, chunks);
+        if (!metaEnd || chunks != startChunk)
+        {
+            client.send(packet.reply(NetPacket::Abort));
+            cout << "cmdDownloadArchiveStream: File "<<filePathHash.toBase64()<<" doesn't have "<<startChunk<<" chunks"<<endl;
+            return false;
+        }
+    }
+
+    cout << "Streamed download request in "<<folderPathHash.toBase64()<<" of "<<filePathHash.toBase64()
+         <<" ("<<humanReadableSize(size)<<')';
+    if (startChunk)
+        cout << ", resuming after "<<startChunk<<" chunks";
+    cout << endl;
+    vector<char> header = ::serialize(file->getMtime());
+    serializeAppend(header, metaEnd+size-skipEnd);
+    client.sendEncrypted(packet.reply(NetPacket::DownloadArchiveStream, header), *this, state.remoteKey);
+
+    DownloadStream stream{packet.id, filePathHash, move(read), 0, metaEnd, skipEnd, size};
+    if (packet.id)
+    {
+        // The client matches the chunks by ID, we send them between its next requests
+        state.streams.push_back(move(stream));
+        return true;
+    }
+    while (stream.pos < stream.size)
+        if (!sendStreamChunk(client, stream, state.remoteKey))
+            return false;
+    return true;
+}
+
+bool Server::sendStreamChunk(NetSock& client, DownloadStream& stream, const PublicKey& remoteKey)
+{
+    if (stream.pos == stream.metaEnd)
+        stream.pos = stream.skipEnd;
+    uint64_t chunkSize = min<uint64_t>(STREAM_CHUNK_SIZE, (stream.pos < stream.metaEnd ? stream.metaEnd : stream.size)-stream.pos);
+    if (!chunkSize)
+    {
+        stream.pos = stream.size;
+        return true;
+    }
+
+    vector<char> chunk = stream.read(stream.pos, chunkSize);
+    stream.pos += chunkSize;
+    if (chunk.size() != chunkSize)
+    {
+        cout << "cmdDownloadArchiveStream: Failed to read file "<<stream.fileHash.toBase64()<<endl;
+        stream.pos = stream.size;
+        NetPacket abort{NetPacket::Abort};
+        abort.id = stream.id;
+        client.send(abort);
+        return false;
+    }
+    NetPacket reply{NetPacket::DownloadArchiveChunk, move(chunk)};
+    reply.id = stream.id;
+    client.sendEncrypted(reply, *this, remoteKey);
+    return true;
+}
@@ -0,0 +1,321 @@
+#include "server.h"
+#include "net/netpacket.h"
+#include "folderdb.h"
+#include "settings.h"
+#include "util/eventfd.h"
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <iostream>
+#include <memory>
+#include <unordered_map>
+#include <thread>
+
+using namespace std;
+
+namespace
+{
+
+/// A client connection multiplexed by the event loop
+struct Connection : enable_shared_from_this<Connection>
+{
+    explicit Connection(NetSock&& sock) : sock{move(sock)} {}
+
+    NetSock sock;
+    deque<NetPacket> packets; ///< Received packets waiting for a worker
+    bool busy = false; ///< A worker owns this connection, it'll hand it back to the loop when done
+    bool paused = false; ///< We stopped reading because too many packets are waiting
+    bool closed = false; ///< Drop this connection as soon as no worker is using it
+    bool draining = false; ///< Stream chunks are waiting for the send buffer to drain, the loop requeues us on EPOLLOUT
+    bool repliesReady = false; ///< Replies to queued writes are ready, a worker should send them
+    ClientState state; ///< Last, its writes are finished before the flags and socket they notify go away
+
+    /// We only queue another stream chunk once the send buffer is this low, so a worker never waits on the socket
+    bool canSendChunk() const { return sock.bufferedSize() + STREAM_CHUNK_SIZE <= NetSock::maxSendBuffered; }
+};
+
+/// State shared by the event loop thread and the packet workers
+struct Dispatcher
+{
+    mutex lock;
+    condition_variable workCond;
+    deque<shared_ptr<Connection>> ready; ///< Connections with packets for the workers
+    vector<shared_ptr<Connection>> resumed; ///< Paused connections the loop should read again
+    vector<shared_ptr<Connection>> finished; ///< Closed connections the workers are done with
+    EventFd wakeup; ///< Wakes the loop up when resumed or finished aren't empty
+    /// Connections the loop dropped, a worker waits for their queued writes before they're destroyed
+    vector<shared_ptr<Connection>> dropped;
+    bool saveNeeded = false; ///< A client left, a worker should save the FolderDB since saving can compact and sync
+};
+
+/// A client can't have more packets than this waiting, so a fast uploader can't exhaust our memory
+constexpr size_t maxQueuedPackets = 16;
+
+}
+
+int Server::execEvented()
+{
+    if (!insock.listen())
+    {
+        cerr << "Server::execEvented: Couldn't listen on port "<<PORT_NUMBER_STR<<endl;
+        return -1;
+    }
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+    {
+        perror("Server::execEvented");
+        return -1;
+    }
+
+    Dispatcher d;
+    unordered_map<int, shared_ptr<Connection>> connections;
+
+    auto watch = [epfd](int fd, uint32_t events)
+    {
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.fd = fd;
+        return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+    };
+    watch(insock.getFd(), EPOLLIN);
+    watch(d.wakeup.getFd(), EPOLLIN);
+    watch(abortEvent.getFd(), EPOLLIN);
+
+    // Only called by the loop. If a worker is busy with the client, it'll be dropped when the worker hands it back.
+    // The loop never touches the disk, a worker finishes the client's writes and saves the FolderDB for us.
+    auto dropClient = [&](const shared_ptr<Connection>& conn)
+    {
+        {
+            lock_guard<mutex> lock(d.lock);
+            conn->closed = true;
+            conn->packets.clear();
+            conn->sock.shutdown();
+            if (conn->busy)
+                return;
+        }
+        epoll_ctl(epfd, EPOLL_CTL_DEL, conn->sock.getFd(), nullptr);
+        connections.erase(conn->sock.getFd());
+        cout << "Client disconnected"<<endl;
+        lock_guard<mutex> lock(d.lock);
+        d.dropped.push_back(conn);
+        d.workCond.notify_one();
+    };
+
+    // Reads until the socket would block or too many packets are waiting, queues the packets for the workers
+    auto readClient = [&](const shared_ptr<Connection>& conn)
+    {
+        {
+            lock_guard<mutex> lock(d.lock);
+            if (conn->paused || conn->closed)
+                return;
+        }
+        try {
+            for (;;)
+            {
+                {
+                    lock_guard<mutex> lock(d.lock);
+                    NetPacket packet;
+                    while (conn->packets.size() < maxQueuedPackets && conn->sock.tryRecvPacket(packet))
+                        conn->packets.push_back(move(packet));
+                    if (!conn->packets.empty() && !conn->busy)
+                    {
+                        conn->busy = true;
+                        d.ready.push_back(conn);
+                        d.workCond.notify_one();
+                    }
+                    conn->paused = conn->packets.size() >= maxQueuedPackets;
+                    if (conn->paused)
+                        return;
+                }
+                if (!conn->sock.readAvailable())
+                    return;
+            }
+        } catch (const exception&) {
+            dropClient(conn);
+        }
+    };
+
+    // Workers handle one packet or stream chunk at a time, a connection is only ever owned by one worker to keep replies in order
+    auto worker = [&]()
+    {
+        unique_lock<mutex> lock(d.lock);
+        for (;;)
+        {
+            d.workCond.wait(lock, [&]{return abortall || !d.dropped.empty() || d.saveNeeded || !d.ready.empty();});
+            if (abortall)
+                return;
+            if (!d.dropped.empty())
+            {
+                // Once its writes are done, whoever holds the last reference can destroy the connection without waiting
+                vector<shared_ptr<Connection>> dropped;
+                swap(dropped, d.dropped);
+                lock.unlock();
+                for (const shared_ptr<Connection>& conn : dropped)
+                    conn->state.writes.reset();
+                dropped.clear();
+                lock.lock();
+                d.saveNeeded = true;
+                continue;
+            }
+            if (d.saveNeeded)
+            {
+                // Clients that leave meanwhile ask for another save, which will have their changes
+                d.saveNeeded = false;
+                lock.unlock();
+                fdb.save();
+                lock.lock();
+                continue;
+            }
+            shared_ptr<Connection> conn = move(d.ready.front());
+            d.ready.pop_front();
+            conn->draining = false;
+            conn->repliesReady = false;
+            // Like handleClient, requests that arrived go before the next chunk of the streams
+            bool hasPacket = !conn->packets.empty();
+            NetPacket packet;
+            if (hasPacket)
+            {
+                packet = move(conn->packets.front());
+                conn->packets.pop_front();
+            }
+            lock.unlock();
+
+            bool keep = true;
+            try {
+                if (conn->state.writes)
+                    conn->state.writes->sendReplies();
+                if (hasPacket)
+                {
+                    keep = handlePacket(conn->sock, packet, conn->state);
+                }
+                else if (!conn->state.streams.empty())
+                {
+                    DownloadStream& stream = conn->state.streams.front();
+                    if (!sendStreamChunk(conn->sock, stream, conn->state.remoteKey) || stream.pos >= stream.size)
+                        conn->state.streams.pop_front();
+                }
+            } catch (const exception& e) {
+                cout << "Server::execEvented: Caught exception ("<<e.what()<<"), dropping client"<<endl;
+                keep = false;
+            }
+
+            lock.lock();
+            if (!keep)
+            {
+                conn->closed = true;
+                conn->packets.clear();
+            }
+
+            if (conn->closed)
+            {
+                conn->busy = false;
+                d.finished.push_back(conn);
+                d.wakeup.notify();
+            }
+            else if (!conn->packets.empty() || conn->repliesReady || (!conn->state.streams.empty() && conn->canSendChunk()))
+            {
+                d.ready.push_back(conn);
+            }
+            else
+            {
+                conn->busy = false;
+                conn->draining = !conn->state.streams.empty();
+                if (conn->paused)
+                {
+                    conn->paused = false;
+                    d.resumed.push_back(conn);
+                    d.wakeup.notify();
+                }
+            }
+        }
+    };
+
+    vector<thread> workers;
+    for (unsigned i=0; i<options.maxClients; ++i)
+        workers.emplace_back(worker);
+
+    epoll_event events[64];
+    while (!abortall)
+    {
+        // abortEvent wakes us up even if the signal is caught by another thread
+        int count = epoll_wait(epfd, events, sizeof(events)/sizeof(*events), -1);
+        for (int i=0; i<count; ++i)
+        {
+            int fd = events[i].data.fd;
+            if (fd == insock.getFd())
+            {
+                NetSock sock = insock.accept();
+                if (!sock.isConnected())
+                    continue;
+                sock.setNonBlocking();
+                int clientfd = sock.getFd();
+                if (!watch(clientfd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET))
+                    continue;
+                shared_ptr<Connection> conn = make_shared<Connection>(move(sock));
+                // Called by the I/O threads while the connection's writes can't finish, so conn is still alive
+                Connection* connPtr = conn.get();
+                conn->state.notifyReplies = [&d, connPtr]
+                {
+                    lock_guard<mutex> lock(d.lock);
+                    connPtr->repliesReady = true;
+                    if (connPtr->busy || connPtr->closed)
+                        return;
+                    connPtr->busy = true;
+                    d.ready.push_back(connPtr->shared_from_this());
+                    d.workCond.notify_one();
+                };
+                connections[clientfd] = move(conn);
+            }
+            else if (fd == d.wakeup.getFd())
+            {
+                d.wakeup.consume();
+                vector<shared_ptr<Connection>> resumed, finished;
+                {
+                    lock_guard<mutex> lock(d.lock);
+                    swap(resumed, d.resumed);
+                    swap(finished, d.finished);
+                }
+                for (const shared_ptr<Connection>& conn : finished)
+                    dropClient(conn);
+                for (const shared_ptr<Connection>& conn : resumed)
+                    readClient(conn);
+            }
+            else
+            {
+                auto it = connections.find(fd);
+                if (it == connections.end())
+                    continue;
+                shared_ptr<Connection> conn = it->second;
+                uint32_t ev = events[i].events;
+                if ((ev & EPOLLERR) || ((ev & EPOLLOUT) && !conn->sock.flush()))
+                {
+                    dropClient(conn);
+                    continue;
+                }
+                if (ev & EPOLLOUT)
+                {
+                    // The worker checked the buffer with the lock held, so either it saw this flush or we see its flag
+                    lock_guard<mutex> lock(d.lock);
+                    if (conn->draining && !conn->busy && !conn->closed && conn->canSendChunk())
+                    {
+                        conn->draining = false;
+                        conn->busy = true;
+                        d.ready.push_back(conn);
+                        d.workCond.notify_one();
+                    }
+                }
+                if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))
+                    readClient(conn);
+            }
+        }
+    }
+
+    // Kick out every client, this also wakes up workers waiting to send
+    for (auto& conn : connections)
+        conn.second->sock.shutdown();
+    d.workCond.notify_all();
+    for (thread& t : workers)
+        t.join();
+    close(epfd);
+
+    return 0;
+}
@@ -30,5 +30,28 @@ const std::string& serverConfigPath()
     return path;
 }
 
+const std::string& journalPath()
+{
+    static std::string path = getHomePath() + "/.tbak/journal/";
+    return path;
+}
+
 const int PORT_NUMBER = 6700;
 const char* PORT_NUMBER_STR = "6700";
+const unsigned DEFAULT_MAX_CLIENTS = 8;
+const unsigned DEFAULT_MAX_PENDING_CLIENTS = 32;
+const unsigned DEFAULT_IO_THREADS = 2;
+const size_t WRITE_BEHIND_MAX_SIZE = 64*1024*1024;
+const unsigned DEFAULT_PUSH_STREAMS = 1;
+const unsigned DEFAULT_CONNECT_TIMEOUT = 10;
+const unsigned CONNECT_ATTEMPT_DELAY = 250;
+const size_t STREAM_CHUNK_SIZE = 1024*1024;
+const size_t BATCH_UPLOAD_SIZE = 256*1024;
+const size_t BATCH_UPLOAD_MAX_FILE_SIZE = 16*1024;
+const size_t BATCH_DELETE_COUNT = 4096;
+const size_t FOLDER_LIST_PAGE_SIZE = 4096;
+const size_t PACK_MAX_FILE_SIZE = 64*1024;
+const size_t PACK_SEGMENT_SIZE = 64*1024*1024;
+const size_t PACK_OPEN_SEGMENTS = 4;
+const unsigned PACK_GARBAGE_PERCENT = 50;
+const size_t FOLDER_JOURNAL_COMPACT_SIZE = 16*1024*1024;
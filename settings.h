@@ -7,8 +7,26 @@ const std::string& dataPath();
 const std::string& folderDBPath();
 const std::string& nodeDBPath();
 const std::string& serverConfigPath();
+const std::string& journalPath(); ///< Directory of the transfer journals, see TransferJournal
 
 extern const int PORT_NUMBER;
 extern const char* PORT_NUMBER_STR;
+extern const unsigned DEFAULT_MAX_CLIENTS; ///< Clients a server node serves at the same time
+extern const unsigned DEFAULT_MAX_PENDING_CLIENTS; ///< Accepted clients waiting for a free server worker
+extern const unsigned DEFAULT_IO_THREADS; ///< Threads writing uploaded files to disk on a server node
+extern const size_t WRITE_BEHIND_MAX_SIZE; ///< Uploaded data a server node may hold before it stops receiving
+extern const unsigned DEFAULT_PUSH_STREAMS; ///< Connections a push opens to each node
+extern const unsigned DEFAULT_CONNECT_TIMEOUT; ///< Seconds we try to connect to a node before giving up on it
+extern const unsigned CONNECT_ATTEMPT_DELAY; ///< Milliseconds before we also try a node's next address
+extern const size_t STREAM_CHUNK_SIZE; ///< Larger files are compressed, encrypted and transferred in chunks of this size
+extern const size_t BATCH_UPLOAD_SIZE; ///< Small files are uploaded together in batches of up to this size
+extern const size_t BATCH_DELETE_COUNT; ///< Remote files are deleted in batches of up to this many
+extern const size_t FOLDER_LIST_PAGE_SIZE; ///< Files in each page of a folder's list
+extern const size_t PACK_MAX_FILE_SIZE; ///< Archive files up to this size go in pack segments when packing is on, see PackStore
+extern const size_t PACK_SEGMENT_SIZE; ///< A new pack segment is started once the last one reaches this size
+extern const size_t PACK_OPEN_SEGMENTS; ///< Full pack segments kept open for reads per archive, the others are reopened
+extern const unsigned PACK_GARBAGE_PERCENT; ///< A full pack segment is emptied once more than this percentage of it is garbage
+extern const size_t FOLDER_JOURNAL_COMPACT_SIZE; ///< The folders database is saved again once its journal grows past this
+extern const size_t BATCH_UPLOAD_MAX_FILE_SIZE; ///< Files that are at most this size once compressed and encrypted are batched
 
 #endif // SETTINGS_H
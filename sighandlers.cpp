@@ -5,6 +5,7 @@
 static void sigtermHandler(int)
 {
     Server::abortall = true;
+    Server::abortEvent.notify();
     std::cout << "Caught signal, exiting gracefully..."<<std::endl;
 }
 
@@ -63,6 +63,12 @@ void Source::restoreFile(const std::vector<char> &metadata, uint64_t mtime, cons
     sourceFiles.emplace_back(this, metadata, mtime, data);
 }
 
+void Source::restoreFile(const std::vector<char> &metadata, uint64_t mtime, uint64_t startPos,
+                         const std::function<std::vector<char>()>& readChunk)
+{
+    sourceFiles.emplace_back(this, metadata, mtime, startPos, readChunk);
+}
+
 void Source::listFilesInto(const char *name, std::vector<string> &dest) const
 {
     size_t namelen = strlen(name);
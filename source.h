@@ -16,6 +16,9 @@ public:
     const std::vector<SourceFile>& getSourceFiles() const; ///< Uses cached data
     /// Writes a source file from downloaded metadata and file data
     void restoreFile(const std::vector<char>& metadata, uint64_t mtime, const std::vector<char>& data);
+    /// Writes a source file from downloaded metadata and file data read in chunks, see SourceFile
+    void restoreFile(const std::vector<char>& metadata, uint64_t mtime, uint64_t startPos,
+                     const std::function<std::vector<char>()>& readChunk);
 
 private:
     void listFilesInto(const char *name, std::vector<std::string>& dest) const; ///< Lists files recursively
@@ -58,11 +58,7 @@ SourceFile::SourceFile(const Source* parent, const std::vector<char> &metadata,
                        uint64_t mtime, const std::vector<char> &data)
     : pathHashReady{false}, parent{parent}
 {
-    auto mit = metadata.begin();
-    path = ::deserializeConsume<decltype(path)>(mit);
-    attrs.userId = ::deserializeConsume<decltype(attrs.userId)>(mit);
-    attrs.groupId = ::deserializeConsume<decltype(attrs.groupId)>(mit);
-    attrs.mode = ::deserializeConsume<decltype(attrs.mode)>(mit);
+    deserializeMetadata(metadata);
     attrs.mtime = mtime;
     rawSize = data.size();
 
@@ -76,6 +72,33 @@ SourceFile::SourceFile(const Source* parent, const std::vector<char> &metadata,
     applyAttrs();
 }
 
+SourceFile::SourceFile(const Source* parent, const std::vector<char> &metadata, uint64_t mtime,
+                       uint64_t startPos, const std::function<std::vector<char>()>& readChunk)
+    : pathHashReady{false}, parent{parent}
+{
+    deserializeMetadata(metadata);
+    attrs.mtime = mtime;
+    rawSize = startPos;
+
+    string fullPath = parent->getPath()+'/'+path;
+    createPathTo("/", fullPath);
+    {
+        FileLocker file{fullPath};
+        if (file.size() < startPos)
+            throw runtime_error("SourceFile: Can't resume "+path+", it's shorter than what we restored");
+        file.truncate(startPos);
+        vector<char> chunk;
+        while (!(chunk = readChunk()).empty())
+        {
+            if (!file.write(chunk))
+                throw runtime_error("SourceFile: Failed to write "+path);
+            rawSize += chunk.size();
+        }
+    }
+
+    applyAttrs();
+}
+
 uint64_t SourceFile::getRawSize() const
 {
     return rawSize;
@@ -101,6 +124,29 @@ PathHash SourceFile::getPathHash() const
     return pathHash;
 }
 
+std::vector<char> SourceFile::read(uint64_t startPos, uint64_t size) const
+{
+    string fullpath = parent->getPath()+"/"+path;
+
+    int fd = open(fullpath.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw runtime_error("SourceFile::read: Unabled to open "+fullpath);
+
+    vector<char> data(size);
+    size_t pos = 0;
+    while (pos < size)
+    {
+        auto r = pread(fd, data.data()+pos, size-pos, startPos+pos);
+        if (r <= 0)
+            break;
+        pos += r;
+    }
+    data.resize(pos);
+
+    close(fd);
+    return data;
+}
+
 std::vector<char> SourceFile::readAll() const
 {
     string fullpath = parent->getPath()+"/"+path;
@@ -113,9 +159,22 @@ std::vector<char> SourceFile::readAll() const
     lseek(fd, 0, SEEK_SET);
 
     vector<char> data(size);
-    auto r = read(fd, data.data(), size);
-    if (r<0)
-        data.clear();
+    size_t pos = 0;
+    while (pos < size)
+    {
+        auto r = ::read(fd, data.data()+pos, size-pos);
+        if (r<0)
+        {
+            data.clear();
+            break;
+        }
+        else if (r == 0)
+        {
+            break;
+        }
+        pos += r;
+    }
+    data.resize(pos);
 
     close(fd);
     return data;
@@ -129,15 +188,35 @@ std::vector<char> SourceFile::serializeMetadata() const
     ::serializeAppend(data, attrs.userId);
     ::serializeAppend(data, attrs.groupId);
     ::serializeAppend(data, attrs.mode);
+    ::serializeAppend(data, (uint8_t)ContentFormat::Chunked);
 
     return data;
 }
 
+SourceFile::ContentFormat SourceFile::getContentFormat(const std::vector<char>& metadata)
+{
+    auto mit = metadata.cbegin();
+    ::deserializeConsume<string>(mit);
+    mit += sizeof(FileAttr::userId) + sizeof(FileAttr::groupId) + sizeof(FileAttr::mode);
+    if (mit >= metadata.cend())
+        return ContentFormat::Whole;
+    return (ContentFormat)::deserializeConsume<uint8_t>(mit);
+}
+
 bool SourceFile::operator <(const SourceFile &other) const
 {
     return getPathHash() < other.getPathHash();
 }
 
+void SourceFile::deserializeMetadata(const std::vector<char>& metadata)
+{
+    auto mit = metadata.begin();
+    path = ::deserializeConsume<decltype(path)>(mit);
+    attrs.userId = ::deserializeConsume<decltype(attrs.userId)>(mit);
+    attrs.groupId = ::deserializeConsume<decltype(attrs.groupId)>(mit);
+    attrs.mode = ::deserializeConsume<decltype(attrs.mode)>(mit);
+}
+
 void SourceFile::applyAttrs()
 {
     string fullPath = parent->getPath()+'/'+path;
@@ -4,6 +4,7 @@
 #include <string>
 #include <vector>
 #include <cstdint>
+#include <functional>
 #include "pathhash.h"
 
 class Source;
@@ -19,25 +20,40 @@ struct FileAttr
 /// Provides access to a source file
 class SourceFile
 {
+public:
+    /// How the content of an archived file is compressed and encrypted, stored in the metadata
+    enum class ContentFormat : uint8_t
+    {
+        Whole, ///< Compressed then encrypted in one piece, metadata without a format byte is in this format
+        Chunked, ///< A list of chunks prefixed by their vuint size, each compressed then encrypted separately
+    };
+
 public:
     SourceFile(const Source* parent, const std::string& path); ///< Construct from a real source file
     SourceFile(const Source* parent, std::string&& path); ///< Construct from a real source file
     SourceFile(const Source* parent, std::string&& path, const char* fullpath); ///< Construct from a real source file
     SourceFile(const Source* parent, const std::vector<char>& metadata,
                uint64_t mtime, const std::vector<char>& data); ///< Construct from downloaded data
+    /// Construct from data downloaded in chunks, readChunk must return an empty vector after the last chunk
+    /// The chunks are written from startPos, keeping what we already restored of the file before that
+    SourceFile(const Source* parent, const std::vector<char>& metadata, uint64_t mtime,
+               uint64_t startPos, const std::function<std::vector<char>()>& readChunk);
 
     uint64_t getRawSize() const;
     FileAttr getAttrs() const;
     std::string getPath() const;
     PathHash getPathHash() const;
 
+    std::vector<char> read(uint64_t startPos, uint64_t size) const;
     std::vector<char> readAll() const;
     std::vector<char> serializeMetadata() const;
+    static ContentFormat getContentFormat(const std::vector<char>& metadata);
 
     /// Sorts according to the path hash
     bool operator <(const SourceFile& other) const;
 
 private:
+    void deserializeMetadata(const std::vector<char>& metadata);
     void applyAttrs();
 
 private:
@@ -7,173 +7,806 @@
 #include "util/vt100.h"
 #include "compression.h"
 #include "server.h"
+#include "util/eventfd.h"
+#include "archivestream.h"
+#include "settings.h"
+#include "source.h"
+#include "archivefile.h"
+#include "net/flowwindow.h"
+#include "util/ratelimiter.h"
+#include "transferjournal.h"
 #include <iostream>
 #include <queue>
+#include <deque>
+#include <algorithm>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <poll.h>
+#include <cerrno>
 #include <boost/lockfree/spsc_queue.hpp>
 
 using namespace std;
 using namespace vt100;
 using namespace boost::lockfree;
 
+/// A packet prepared by the zip thread
+struct ZipItem
+{
+    vector<const SourceFile*> files; ///< Several files for an UploadArchiveBatch, otherwise one
+    NetPacket::Type type;
+    vector<char> data;
+    bool first, last; ///< The server only replies to the last packet of a file
+    uint64_t chunks; ///< Chunks of a chunked file sent once this is sent, for the journal
+};
+
+/// State shared between the network thread and the zip thread
+struct ZipPipeline
+{
+    spsc_queue<ZipItem*, capacity<ThreadedWorker::maxZipQueueSize>> queue;
+    atomic_int dataSize{0}; ///< Total size of the buffers in the queue
+    atomic_bool stopNow{false};
+    mutex lock;
+    condition_variable spaceCond; ///< Signaled when the network thread takes from the queue
+    EventFd ready; ///< Readable when the zip thread has pushed to the queue
+};
+
+mutex ThreadedWorker::outputMutex;
+
 ThreadedWorker::ThreadedWorker(NetSock &sock, Server &server, const Node &remote)
-    : sock{sock}, server{server}, node{remote}
+    : sock{sock}, server{server}, node{remote}, prefixed{false},
+      globalLimiter{nullptr}, nodeLimiter{nullptr}, journal{nullptr}
+{
+}
+
+/// A piece of a downloaded file, for the unzip thread
+struct UnzipItem
+{
+    const FileTime* file;
+    uint64_t mtime; ///< Only set on the first piece of a file
+    uint64_t startChunk; ///< Only set on the first piece, chunks of the file we already restored
+    vector<char> data;
+    bool last; ///< Last piece of this file
+    bool failed; ///< The download failed, this is then the last piece
+};
+
+/// State shared between the network thread and the unzip thread
+struct UnzipPipeline
+{
+    deque<UnzipItem> queue;
+    size_t dataSize = 0; ///< Total size of the buffers in the queue
+    bool stopNow = false;
+    mutex lock;
+    condition_variable dataCond; ///< Signaled when the network thread pushes to the queue
+    condition_variable spaceCond; ///< Signaled when the unzip thread takes from the queue
+};
+
+ThreadedWorker::Event ThreadedWorker::waitForEvent(const EventFd* zipReady) const
+{
+    // Replies that arrived together are already in the socket's buffer
+    if (sock.hasBufferedPacket() && !server.abortall)
+        return Event::Reply;
+
+    pollfd fds[] = {{sock.getFd(), POLLIN | POLLRDHUP, 0},
+                    {server.abortEvent.getFd(), POLLIN, 0},
+                    {zipReady ? zipReady->getFd() : -1, POLLIN, 0}};
+    while (poll(fds, 3, -1) < 0)
+        if (errno != EINTR)
+            return Event::Abort;
+
+    if (server.abortall || (fds[0].revents & (POLLRDHUP | POLLHUP | POLLERR)))
+        return Event::Abort;
+    else if (fds[0].revents & POLLIN)
+        return Event::Reply;
+    zipReady->consume();
+    return Event::ZipReady;
+}
+
+void ThreadedWorker::setOutputPrefix(const string &prefix)
 {
+    outputPrefix = prefix;
+    prefixed = true;
 }
 
-void ThreadedWorker::deleteFiles(PathHash folderHash, const vector<FileTime>& deldiff)
+void ThreadedWorker::setRateLimiters(RateLimiter *global, RateLimiter *node)
 {
-    queue<const FileTime*> netQueue;
-    int total = deldiff.size(), cur = 1;
+    globalLimiter = global;
+    nodeLimiter = node;
+}
+
+void ThreadedWorker::setJournal(TransferJournal* newJournal)
+{
+    journal = newJournal;
+}
+
+void ThreadedWorker::throttle(size_t bytes) const
+{
+    if (globalLimiter)
+        globalLimiter->acquire(bytes);
+    if (nodeLimiter)
+        nodeLimiter->acquire(bytes);
+}
+
+std::vector<std::vector<SourceFile>> ThreadedWorker::splitUploads(const vector<SourceFile> &updiff, size_t n)
+{
+    // Every file also costs a round trip, so count some overhead for small files
+    static constexpr uint64_t fileOverhead = 64*1024;
+    vector<vector<SourceFile>> parts(n);
+    vector<uint64_t> partSizes(n, 0);
+    for (const SourceFile& file : updiff)
+    {
+        size_t smallest = min_element(partSizes.begin(), partSizes.end()) - partSizes.begin();
+        parts[smallest].push_back(file);
+        partSizes[smallest] += file.getRawSize() + fileOverhead;
+    }
+    return parts;
+}
+
+void ThreadedWorker::printLine(const string &line, bool error) const
+{
+    lock_guard<mutex> lock(outputMutex);
+    cout << outputPrefix;
+    if (error)
+        cout << STYLE_ERROR() << line << STYLE_RESET() << endl;
+    else
+        cout << line << endl;
+}
+
+unsigned ThreadedWorker::deleteFiles(PathHash folderHash, const vector<FileTime>& deldiff)
+{
+    // Each request deletes a batch of files, the reply is a bitmap of the ones that were deleted
+    std::queue<pair<size_t, size_t>> netQueue; ///< Position and size of the batches in deldiff
+    int total = deldiff.size(), cur = 1, done = 0;
+    unsigned deleted = 0;
     auto progress = [&](){return "["+to_string(cur)+'/'+to_string(total)+"] ";};
-    auto fit = deldiff.cbegin();
+    size_t next = 0;
 
-    cout << MOVEUP(1);
+    if (!prefixed)
+        cout << MOVEUP(1);
 
-    while (fit != deldiff.cend() || !netQueue.empty())
+    for (;;)
     {
-        if (sock.isShutdown() || server.abortall)
+        while (netQueue.size() < maxNetQueueSize && next != deldiff.size())
         {
-            int queueSize = netQueue.size();
-            cout << MOVEUP(queueSize) << STYLE_ERROR();
-            while (queueSize--)
-                cout << CLEARLINE() << "Operation aborted." << MOVEDOWN(1);
-            cout << STYLE_RESET();
-            return;
+            size_t count = min(BATCH_DELETE_COUNT, deldiff.size()-next);
+            vector<PathHash> hashes;
+            hashes.reserve(count);
+            for (size_t i=next; i<next+count; ++i)
+                hashes.push_back(deldiff[i].hash);
+            netQueue.push({next, count});
+            if (!prefixed)
+                cout << STYLE_ACTIVE() << '\n' << progress() << "Deleting "<<count<<" old remote files..."
+                     << STYLE_RESET() << flush;
+            node.deleteFilesAsync(sock, server, folderHash, hashes);
+            next += count;
+            cur += count;
+        }
+        if (netQueue.empty())
+            break;
+
+        if (waitForEvent(nullptr) == Event::Abort)
+        {
+            printAborted(netQueue.size());
+            return deleted;
+        }
+
+        NetPacket reply = sock.recvPacket();
+        size_t first = netQueue.front().first, count = netQueue.front().second;
+        vector<bool> results(count, false);
+        if (reply.type == NetPacket::DeleteArchiveBatch)
+        {
+            Crypto::decryptPacket(reply, server, node.getPk());
+            for (size_t i=0; i<count && i/8<reply.data.size(); ++i)
+                results[i] = (reply.data[i/8] >> (i%8)) & 1;
         }
+        unsigned ok = std::count(results.begin(), results.end(), true);
+        deleted += ok;
 
-        if (sock.isPacketAvailable())
+        if (prefixed)
         {
-            NetPacket reply = sock.recvPacket();
+            for (size_t i=0; i<count; ++i)
+            {
+                string hash = deldiff[first+i].hash.toBase64();
+                string line = results[i] ? "Deleted old remote file (hash "+hash+')'
+                                         : "Failed to delete old remote file with hash "+hash;
+                printLine("["+to_string(++done)+'/'+to_string(total)+"] "+line, !results[i]);
+            }
+        }
+        else
+        {
+            string line = ok == count ? "Deleted "+to_string(ok)+" old remote files"
+                                      : "Failed to delete "+to_string(count-ok)+" of "+to_string(count)+" old remote files";
             int queueSize = netQueue.size();
             cout << MOVEUP(queueSize-1) << CLEARLINE();
-            const FileTime* f = netQueue.front();
-            if (reply.type == NetPacket::DeleteArchive)
-                cout << "Deleted old remote file (hash "<<f->hash.toBase64()<<')';
+            if (ok == count)
+                cout << line;
             else
-                cout << STYLE_ERROR() << "Failed to delete old remote file with hash "
-                     <<f->hash.toBase64() << STYLE_RESET();
+                cout << STYLE_ERROR() << line << STYLE_RESET();
             cout << MOVEDOWN(queueSize-1) << flush;
-            netQueue.pop();
         }
+        netQueue.pop();
+    }
+    if (!prefixed)
+        cout << endl;
+    return deleted;
+}
 
-        if (netQueue.size() < maxNetQueueSize && fit != deldiff.cend())
-        {
-            netQueue.push(&*fit);
-            cout << STYLE_ACTIVE();
-            cout << '\n' << progress() << "Deleting old remote file (hash "<<fit->hash.toBase64() << ")..."
-                 << STYLE_RESET() << flush;
-            node.deleteFileAsync(sock, server, folderHash, fit->hash);
-            fit++;
-            cur++;
-        }
+void ThreadedWorker::printAborted(int queueSize) const
+{
+    if (prefixed)
+    {
+        printLine("Operation aborted.", true);
+        return;
     }
-    cout << endl;
+    cout << MOVEUP(queueSize) << STYLE_ERROR();
+    while (queueSize--)
+        cout << CLEARLINE() << "Operation aborted." << MOVEDOWN(1);
+    cout << STYLE_RESET();
 }
 
 /// Compresses, encrypts, and serializes files in the background
-/// Takes a billion arguments because if it was a member function, we'd have to include
-/// boost lockfree headers in our public header, ruining compile times...
-static void zipFiles(spsc_queue<vector<char>*, capacity<ThreadedWorker::maxZipQueueSize>>& zipQueue,
-                     const std::vector<SourceFile> &updiff, atomic_int& zippedDataSize,
-                     const atomic_bool& stopNow, const PathHash& folderHash,
-                     const Server& s)
+/// Files larger than a chunk are split in an UploadArchiveBegin, UploadArchiveChunks and an UploadArchiveEnd
+/// Small files are grouped in UploadArchiveBatches
+/// A chunked file with startChunks the node already has is sent as an UploadArchiveContinue and the chunks after those
+static void zipFiles(ZipPipeline& zip, const std::vector<SourceFile> &updiff, const std::vector<uint64_t>& startChunks,
+                     const PathHash& folderHash, const Server& s)
 {
-    auto fit = updiff.cbegin();
-    while (fit != updiff.cend() && !stopNow)
+    // Returns false if we must stop now
+    auto push = [&](vector<const SourceFile*>&& files, NetPacket::Type type, vector<char>&& data,
+                    bool first, bool last, uint64_t chunks = 0)
     {
-        if (zippedDataSize > ThreadedWorker::maxZipDataSize
-                || zipQueue.read_available() >= ThreadedWorker::maxZipQueueSize)
         {
-            this_thread::sleep_for(50ms);
-            continue;
+            unique_lock<mutex> lock(zip.lock);
+            zip.spaceCond.wait(lock, [&]{return zip.stopNow || (zip.dataSize <= ThreadedWorker::maxZipDataSize
+                            && zip.queue.read_available() < ThreadedWorker::maxZipQueueSize);});
+            if (zip.stopNow)
+                return false;
         }
 
-        // We build our serialzed data here, the consumer thread will delete it
-        vector<char>& data = *new vector<char>();
-        serializeAppend(data, folderHash);
-        serializeAppend(data, fit->getPathHash());
-        serializeAppend(data, fit->getAttrs().mtime);
+        // The consumer thread will delete it
+        ZipItem* item = new ZipItem{move(files), type, move(data), first, last, chunks};
+        zip.dataSize += item->data.size();
+        zip.queue.push(item);
+        zip.ready.notify();
+        return true;
+    };
+
+    vector<char> batch;
+    vector<const SourceFile*> batchFiles;
+    auto flushBatch = [&]()
+    {
+        if (batchFiles.empty())
+            return true;
+        bool ok = push(move(batchFiles), NetPacket::UploadArchiveBatch, move(batch), true, true);
+        batch.clear();
+        batchFiles.clear();
+        return ok;
+    };
+
+    for (size_t i=0; i<updiff.size(); ++i)
+    {
+        const SourceFile& file = updiff[i];
+        bool chunked = file.getRawSize() > STREAM_CHUNK_SIZE;
+        vector<char> blob;
+        try
         {
             // Encrypt the metadata and contents separately, so we can later download the metadata only
-            vector<char> fileData;
-            vector<char> meta = fit->serializeMetadata();
+            vector<char> meta = file.serializeMetadata();
             Crypto::encrypt(meta, s, s.getPublicKey());
-            vectorAppend(fileData, vuintToData(meta.size()));
-            vectorAppend(fileData, move(meta));
-            vector<char> contents = Compression::deflate(fit->readAll());
-            Crypto::encrypt(contents, s, s.getPublicKey());
-            vectorAppend(fileData, move(contents));
-            vectorAppend(data, move(fileData));
-        }
-        zippedDataSize += data.size();
-        zipQueue.push(&data);
-        ++fit;
+            vectorAppend(blob, vuintToData(meta.size()));
+            vectorAppend(blob, move(meta));
+            if (!chunked)
+            {
+                vector<char> contents = file.readAll();
+                if (!contents.empty())
+                    vectorAppend(blob, ArchiveStreamReader::encodeChunk(contents, s));
+            }
+        }
+        catch (const runtime_error&)
+        {
+            // Cancel right away, so the server still sends one reply for this file
+            vector<char> data;
+            serializeAppend(data, folderHash);
+            serializeAppend(data, file.getPathHash());
+            serializeAppend(data, file.getAttrs().mtime);
+            if (!push({&file}, NetPacket::UploadArchiveBegin, move(data), true, false)
+                    || !push({&file}, NetPacket::UploadArchiveEnd, {1}, false, true))
+                return;
+            continue;
+        }
+
+        if (!chunked && blob.size() <= BATCH_UPLOAD_MAX_FILE_SIZE)
+        {
+            if (batch.size() + blob.size() > BATCH_UPLOAD_SIZE && !flushBatch())
+                return;
+            if (batch.empty())
+                serializeAppend(batch, folderHash);
+            serializeAppend(batch, file.getPathHash());
+            serializeAppend(batch, file.getAttrs().mtime);
+            vectorAppend(batch, vuintToData(blob.size()));
+            vectorAppend(batch, move(blob));
+            batchFiles.push_back(&file);
+            continue;
+        }
+
+        vector<char> data;
+        serializeAppend(data, folderHash);
+        serializeAppend(data, file.getPathHash());
+        serializeAppend(data, file.getAttrs().mtime);
+        vectorAppend(data, move(blob));
+        if (!chunked)
+        {
+            if (!push({&file}, NetPacket::UploadArchive, move(data), true, true))
+                return;
+            continue;
+        }
+
+        uint64_t chunks = startChunks[i];
+        if (chunks)
+        {
+            // The node kept the metadata with the chunks, replace it by the count of chunks we skip
+            data.resize(2*PathHash::hashlen+sizeof(uint64_t));
+            serializeAppend(data, chunks);
+        }
+        if (!push({&file}, chunks ? NetPacket::UploadArchiveContinue : NetPacket::UploadArchiveBegin,
+                  move(data), true, false, chunks))
+            return;
+        vector<char> cancel;
+        for (uint64_t pos = chunks*STREAM_CHUNK_SIZE; pos < file.getRawSize(); pos += STREAM_CHUNK_SIZE)
+        {
+            vector<char> contents;
+            try {
+                contents = file.read(pos, STREAM_CHUNK_SIZE);
+            } catch (const runtime_error&) {
+            }
+            // The file may have been removed or truncated since we listed it
+            if (contents.empty())
+            {
+                cancel.push_back(1);
+                break;
+            }
+            if (!push({&file}, NetPacket::UploadArchiveChunk, ArchiveStreamReader::encodeChunk(contents, s),
+                      false, false, ++chunks))
+                return;
+        }
+        if (!push({&file}, NetPacket::UploadArchiveEnd, move(cancel), false, true))
+            return;
     }
+    flushBatch();
 }
 
-void ThreadedWorker::uploadFiles(PathHash folderHash, const std::vector<SourceFile> &updiff)
+unsigned ThreadedWorker::uploadFiles(PathHash folderHash, const std::vector<SourceFile> &updiff)
 {
-    queue<const SourceFile*> netQueue;
-    int total = updiff.size(), cur = 1;
+    /// Files waiting for the server's reply to one packet
+    struct PendingUpload
+    {
+        vector<const SourceFile*> files;
+        bool batch;
+        uint32_t id; ///< ID of the packet the server replies to, 0 if unnumbered
+        int line; ///< Our progress line, counted from the first
+    };
+    std::deque<PendingUpload> netQueue;
+    int total = updiff.size(), cur = 1, zipped = 0, done = 0, lines = 0;
+    unsigned uploaded = 0;
     auto progress = [&](){return "["+to_string(cur)+'/'+to_string(total)+"] ";};
-    auto fit = updiff.cbegin();
+    bool midFile = false; // We sent the beginning of a chunked file, but not its end
+    FlowWindow flow; // Limits the bytes in flight, a file we started always gets to finish
+    auto canStartRequest = [&]()
+    {
+        return midFile || (flow.canSend() && netQueue.size() < maxUploadQueueSize);
+    };
 
-    spsc_queue<vector<char>*, capacity<maxZipQueueSize>> zipQueue;
-    atomic_int zippedDataSize{0};
-    atomic_bool stopNow{false};
-    thread zipThread(zipFiles, ref(zipQueue), ref(updiff), ref(zippedDataSize),
-                     ref(stopNow), ref(folderHash), ref(server));
+    // Ask the node how much it kept of the uploads we were interrupted in, before we start pipelining
+    vector<uint64_t> startChunks(updiff.size());
+    for (size_t i=0; journal && i<updiff.size(); ++i)
+    {
+        const SourceFile& f = updiff[i];
+        uint64_t chunks = journal->getPartialChunks(f.getPathHash(), f.getAttrs().mtime);
+        if (chunks)
+            startChunks[i] = node.fetchUploadProgress(sock, server, folderHash, f.getPathHash(), chunks);
+        if (startChunks[i])
+            printLine("Resuming upload of "+f.getPath()+" after "
+                      +humanReadableSize(startChunks[i]*STREAM_CHUNK_SIZE), false);
+    }
 
-    cout << MOVEUP(1);
-    while (fit != updiff.cend() || !netQueue.empty())
+    ZipPipeline zip;
+    thread zipThread(zipFiles, ref(zip), ref(updiff), ref(startChunks), ref(folderHash), ref(server));
+    auto stopZipThread = [&]()
     {
-        if (sock.isShutdown() || server.abortall)
         {
-            int queueSize = netQueue.size();
-            cout << MOVEUP(queueSize) << STYLE_ERROR();
-            while (queueSize--)
-                cout << CLEARLINE() << "Operation aborted." << MOVEDOWN(1);
-            cout << STYLE_RESET();
-
-            stopNow = true;
-            zipThread.join();
-            return;
+            lock_guard<mutex> lock(zip.lock);
+            zip.stopNow = true;
         }
+        zip.spaceCond.notify_one();
+        zipThread.join();
+        ZipItem* item;
+        while (zip.queue.pop(item))
+            delete item;
+    };
+    auto filesSize = [](const vector<const SourceFile*>& files)
+    {
+        uint64_t size = 0;
+        for (const SourceFile* f : files)
+            size += f->getRawSize();
+        return humanReadableSize(size);
+    };
 
-        if (sock.isPacketAvailable())
+    if (!prefixed)
+        cout << MOVEUP(1);
+    // The zip thread must be joined whatever happens, or its destructor terminates the whole process
+    try
+    {
+        for (;;)
         {
-            NetPacket reply = sock.recvPacket();
-            int queueSize = netQueue.size();
-            cout << MOVEUP(queueSize-1) << CLEARLINE();
-            const SourceFile* f = netQueue.front();
-            if (reply.type == NetPacket::UploadArchive)
-                cout << "Uploaded "<<f->getPath()<<" ("
-                     <<humanReadableSize(f->getRawSize())<<')';
+            while (canStartRequest() && zip.queue.read_available())
+            {
+                ZipItem* item = nullptr;
+                zip.queue.pop(&item, 1);
+                {
+                    lock_guard<mutex> lock(zip.lock);
+                    zip.dataSize -= item->data.size();
+                }
+                zip.spaceCond.notify_one();
+
+                bool batch = item->type == NetPacket::UploadArchiveBatch;
+                size_t fileCount = item->files.size();
+                if (item->first)
+                {
+                    if (!prefixed)
+                    {
+                        const SourceFile* f = item->files.front();
+                        cout << STYLE_ACTIVE() << '\n' << progress();
+                        if (batch)
+                            cout << "Uploading "<<fileCount<<" small files ("<<filesSize(item->files)<<')';
+                        else
+                            cout << "Uploading "<<f->getPath()<<" ("<<humanReadableSize(f->getRawSize())<<')';
+                        cout << STYLE_RESET() << flush;
+                    }
+                    netQueue.push_back({move(item->files), batch, 0, lines++});
+                    cur += fileCount;
+                }
+                throttle(item->data.size());
+                // Only the last packet of a file gets a reply, and no other file starts before it
+                uint32_t id = item->last ? sock.nextRequestId() : 0;
+                flow.sent(item->data.size(), item->last, id);
+                NetPacket packet{item->type, move(item->data)};
+                if (item->last)
+                    packet.id = netQueue.back().id = id;
+                sock.sendEncrypted(packet, server, node.getPk());
+                // The first packet's files were moved to netQueue, but it has no new chunk
+                if (journal && item->type == NetPacket::UploadArchiveChunk)
+                {
+                    const SourceFile* f = item->files.front();
+                    journal->filePartial(f->getPathHash(), f->getAttrs().mtime, item->chunks);
+                }
+                midFile = !item->last;
+                if (item->last)
+                    zipped += fileCount;
+                delete item;
+            }
+            if (zipped == total && netQueue.empty())
+                break;
+
+            // Only wake up for the zip thread if we have room to send what it zipped
+            bool canSend = canStartRequest() && zipped != total;
+            Event event = waitForEvent(canSend ? &zip.ready : nullptr);
+            if (event == Event::Abort)
+            {
+                printAborted(netQueue.empty() ? 0 : lines-netQueue.front().line);
+                stopZipThread();
+                return uploaded;
+            }
+            else if (event == Event::Reply)
+            {
+                NetPacket reply = sock.recvPacket();
+                flow.acked(reply.id);
+                // The node answers numbered uploads as soon as they're written, the others in the order of the requests
+                auto pit = find_if(netQueue.begin(), netQueue.end(), [&](const PendingUpload& p){return p.id == reply.id;});
+                if (pit == netQueue.end())
+                    throw runtime_error("ThreadedWorker::uploadFiles: Unexpected reply from "+node.getUri());
+                const PendingUpload& pending = *pit;
+                const vector<const SourceFile*>& files = pending.files;
+
+                // A batch's reply has one result byte per file
+                vector<bool> results(files.size(), false);
+                if (pending.batch && reply.type == NetPacket::UploadArchiveBatch)
+                {
+                    Crypto::decryptPacket(reply, server, node.getPk());
+                    for (size_t i=0; i<min(results.size(), reply.data.size()); ++i)
+                        results[i] = reply.data[i];
+                }
+                else if (!pending.batch && reply.type == NetPacket::UploadArchive)
+                {
+                    results[0] = true;
+                }
+                unsigned ok = count(results.begin(), results.end(), true);
+                uploaded += ok;
+                for (size_t i=0; journal && i<files.size(); ++i)
+                    if (results[i])
+                        journal->fileDone(files[i]->getPathHash(), files[i]->getAttrs().mtime);
+
+                if (prefixed)
+                {
+                    for (size_t i=0; i<files.size(); ++i)
+                    {
+                        const SourceFile* f = files[i];
+                        string line = (results[i] ? "Uploaded " : "Failed to upload ")+f->getPath()
+                                        +" ("+humanReadableSize(f->getRawSize())+')';
+                        printLine("["+to_string(++done)+'/'+to_string(total)+"] "+line, !results[i]);
+                    }
+                }
+                else
+                {
+                    string line;
+                    if (!pending.batch)
+                        line = (ok ? "Uploaded " : "Failed to upload ")+files[0]->getPath()
+                                +" ("+humanReadableSize(files[0]->getRawSize())+')';
+                    else if (ok == files.size())
+                        line = "Uploaded "+to_string(ok)+" small files ("+filesSize(files)+')';
+                    else
+                        line = "Failed to upload "+files[find(results.begin(), results.end(), false)-results.begin()]->getPath()
+                                +" and "+to_string(files.size()-ok-1)+" other small files";
+                    int linesBelow = lines-1-pending.line;
+                    cout << MOVEUP(linesBelow) << CLEARLINE();
+                    if (ok == files.size())
+                        cout << line;
+                    else
+                        cout << STYLE_ERROR() << line << STYLE_RESET();
+                    cout << MOVEDOWN(linesBelow) << flush;
+                }
+                netQueue.erase(pit);
+            }
+        }
+    }
+    catch (...)
+    {
+        stopZipThread();
+        throw;
+    }
+    if (!prefixed)
+        cout << endl;
+    stopZipThread();
+    return uploaded;
+}
+
+/// Decrypts, decompresses and writes downloaded files in the background
+/// Returns the number of files restored
+static unsigned unzipFiles(UnzipPipeline& unzip, Source& src, const Server& s, size_t total, TransferJournal* journal,
+                           const std::function<void(const string&, bool)>& printLine)
+{
+    unsigned restored = 0;
+    size_t done = 0;
+
+    // Returns the next piece of the current file, or an empty vector after its last piece
+    bool fileDone = true;
+    auto nextPiece = [&](UnzipItem& item)
+    {
+        unique_lock<mutex> lock(unzip.lock);
+        unzip.dataCond.wait(lock, [&]{return unzip.stopNow || !unzip.queue.empty();});
+        if (unzip.stopNow)
+            return false;
+        item = move(unzip.queue.front());
+        unzip.queue.pop_front();
+        unzip.dataSize -= item.data.size();
+        unzip.spaceCond.notify_one();
+        fileDone = item.last;
+        return true;
+    };
+    auto fetch = [&]() -> vector<char>
+    {
+        UnzipItem item;
+        if (fileDone)
+            return {};
+        if (!nextPiece(item))
+            throw runtime_error("Operation aborted");
+        if (item.failed)
+            throw runtime_error("Download failed");
+        return move(item.data);
+    };
+
+    while (done < total)
+    {
+        UnzipItem first;
+        if (!nextPiece(first))
+            return restored;
+        done++;
+        string progress = "["+to_string(done)+'/'+to_string(total)+"] ";
+        string path = first.file->hash.toBase64();
+        const FileTime& f = *first.file;
+        bool writing = false; // We may have changed the local file
+        uint64_t chunksDone = first.startChunk; // Chunks of the file in the journal
+        try {
+            if (first.failed)
+                throw runtime_error("Download failed");
+
+            // The first piece holds the metadata, the content follows
+            vector<char> firstData = move(first.data);
+            bool firstTaken = false;
+            ArchiveStreamReader reader(s, [&]() -> vector<char>
+            {
+                if (!firstTaken)
+                {
+                    firstTaken = true;
+                    if (!firstData.empty())
+                        return move(firstData);
+                }
+                return fetch();
+            });
+            vector<char> meta = reader.readMetadata();
+            auto mit = meta.cbegin();
+            path = ArchiveFile::deserializePath(mit);
+
+            // Record each whole chunk once it's written, only the last one may be shorter
+            // Only chunked archives can be resumed, the others are decoded in one piece
+            bool resumable = journal && SourceFile::getContentFormat(meta) == SourceFile::ContentFormat::Chunked;
+            vector<char> chunk;
+            writing = true;
+            src.restoreFile(meta, first.mtime, first.startChunk*STREAM_CHUNK_SIZE, [&]()
+            {
+                if (resumable && chunk.size() == STREAM_CHUNK_SIZE)
+                    journal->filePartial(f.hash, f.mtime, ++chunksDone);
+                chunk = reader.readChunk();
+                return chunk;
+            });
+            if (journal)
+                journal->fileDone(f.hash, f.mtime);
+            restored++;
+            if (first.startChunk)
+                printLine(progress+"Restored "+path+", resumed after "
+                          +humanReadableSize(first.startChunk*STREAM_CHUNK_SIZE), false);
             else
-                cout << STYLE_ERROR() << "Failed to upload "<<f->getPath()<<" ("
-                     <<humanReadableSize(f->getRawSize())<<')'<< STYLE_RESET();
-            cout << MOVEDOWN(queueSize-1) << flush;
-            netQueue.pop();
+                printLine(progress+"Restored "+path, false);
+        } catch (const runtime_error& e) {
+            // The file is now newer than the remote's, so the journal must tell the next restore to fetch it again
+            // The chunks we wrote are still good, but if we couldn't add any we start over
+            if (journal && (writing || first.startChunk) && chunksDone == first.startChunk)
+                journal->filePartial(f.hash, f.mtime, 0);
+            printLine(progress+"Failed to restore "+path+": "+e.what(), true);
         }
 
-        if (netQueue.size() < maxNetQueueSize && fit != updiff.cend()
-                && zipQueue.read_available())
+        // Skip what's left of this file if we failed in the middle
+        UnzipItem item;
+        while (!fileDone)
+            if (!nextPiece(item))
+                return restored;
+    }
+    return restored;
+}
+
+unsigned ThreadedWorker::downloadFiles(PathHash folderHash, const vector<FileTime>& downdiff, Source& src)
+{
+    /// A file requested from the node
+    struct PendingDownload
+    {
+        const FileTime* file;
+        uint32_t id; ///< Request ID, 0 if unnumbered
+        uint64_t remaining; ///< Bytes left to receive once we have the header
+        bool started, finished;
+        deque<UnzipItem> held; ///< Pieces received while the unzip thread is still on an earlier file
+    };
+    std::deque<PendingDownload> netQueue;
+    auto fit = downdiff.cbegin();
+    // Chunks of a file that we already restored before we were interrupted
+    auto startChunk = [this](const FileTime& f)
+    {
+        return journal ? journal->getPartialChunks(f.hash, f.mtime) : 0;
+    };
+
+    UnzipPipeline unzip;
+    auto push = [&](UnzipItem&& item)
+    {
+        unique_lock<mutex> lock(unzip.lock);
+        unzip.spaceCond.wait(lock, [&]{return unzip.dataSize <= ThreadedWorker::maxZipDataSize;});
+        unzip.dataSize += item.data.size();
+        unzip.queue.push_back(move(item));
+        unzip.dataCond.notify_one();
+    };
+    unsigned restored = 0;
+    auto print = [this](const string& line, bool error)
+    {
+        if (prefixed)
         {
-            netQueue.push(&*fit);
-            cout << STYLE_ACTIVE();
-            cout << '\n' << progress() << "Uploading "<<fit->getPath()<<" ("
-                 <<humanReadableSize(fit->getRawSize())<<')'<< STYLE_RESET() << flush;
-            vector<char>* serializedData = nullptr;
-            zipQueue.pop(&serializedData, 1);
-            zippedDataSize -= serializedData->size();
-            sock.sendEncrypted({NetPacket::UploadArchive, *serializedData}, server, node.getPk());
-            delete serializedData;
-            fit++;
-            cur++;
+            printLine(line, error);
+            return;
+        }
+        lock_guard<mutex> lock(outputMutex);
+        if (error)
+            cout << STYLE_ERROR() << line << STYLE_RESET() << endl;
+        else
+            cout << line << endl;
+    };
+    thread unzipThread([&]()
+    {
+        restored = unzipFiles(unzip, src, server, downdiff.size(), journal, print);
+    });
+    auto stopUnzipThread = [&]()
+    {
+        {
+            lock_guard<mutex> lock(unzip.lock);
+            unzip.stopNow = true;
+        }
+        unzip.dataCond.notify_one();
+        unzipThread.join();
+    };
+
+    try
+    {
+        for (;;)
+        {
+            while (netQueue.size() < maxNetQueueSize && fit != downdiff.cend())
+            {
+                uint32_t id = sock.nextRequestId();
+                node.downloadFileAsync(sock, server, folderHash, fit->hash, startChunk(*fit), id);
+                netQueue.push_back({&*fit, id, 0, false, false, {}});
+                fit++;
+            }
+            if (netQueue.empty())
+                break;
+
+            if (waitForEvent(nullptr) == Event::Abort)
+            {
+                print("Operation aborted.", true);
+                stopUnzipThread();
+                return restored;
+            }
+
+            // A file is a header followed by its chunks, all with the ID of the request
+            // Unnumbered replies come in the order of the requests, so they're for the first file not finished
+            NetPacket reply = sock.recvEncryptedPacket(server, node.getPk());
+            throttle(reply.data.size());
+            auto pit = find_if(netQueue.begin(), netQueue.end(), [&](const PendingDownload& p)
+            {
+                return p.id == reply.id && !p.finished;
+            });
+            if (pit == netQueue.end())
+                throw runtime_error("ThreadedWorker::downloadFiles: Unexpected reply from "+node.getUri());
+            PendingDownload& pending = *pit;
+            const FileTime* f = pending.file;
+            if (!pending.started && reply.type == NetPacket::DownloadArchiveStream && reply.data.size() == 2*sizeof(uint64_t))
+            {
+                auto it = reply.data.cbegin();
+                uint64_t mtime = ::deserializeConsume<uint64_t>(it);
+                pending.remaining = ::deserializeConsume<uint64_t>(it);
+                pending.started = true;
+                // Even an empty file has metadata, so a size of 0 means the archive is corrupted
+                pending.finished = pending.remaining == 0;
+                pending.held.push_back({f, mtime, startChunk(*f), {}, pending.finished, pending.finished});
+            }
+            else if (pending.started && reply.type == NetPacket::DownloadArchiveChunk && reply.data.size() <= pending.remaining)
+            {
+                pending.remaining -= reply.data.size();
+                pending.finished = pending.remaining == 0;
+                pending.held.push_back({f, 0, 0, move(reply.data), pending.finished, false});
+            }
+            else
+            {
+                // An Abort, we won't receive the rest of this file
+                if (reply.type != NetPacket::Abort)
+                    throw runtime_error("ThreadedWorker::downloadFiles: Unexpected reply from "+node.getUri());
+                pending.finished = true;
+                pending.held.push_back({f, 0, startChunk(*f), {}, true, true});
+            }
+
+            // The unzip thread restores the files in order, a file's pieces wait until the ones before it are done
+            // The node streams one file at a time, so only headers are held for long
+            while (!netQueue.empty())
+            {
+                PendingDownload& front = netQueue.front();
+                for (UnzipItem& item : front.held)
+                    push(move(item));
+                front.held.clear();
+                if (!front.finished)
+                    break;
+                netQueue.pop_front();
+            }
         }
     }
-    cout << endl;
-    zipThread.join();
-}
+    catch (...)
+    {
+        stopUnzipThread();
+        throw;
+    }
 
+    unzipThread.join();
+    return restored;
+}
@@ -5,26 +5,66 @@
 #include "pathhash.h"
 #include "sourcefile.h"
 #include <vector>
+#include <string>
+#include <mutex>
 
 class NetSock;
 class Server;
 class Node;
+class EventFd;
+class Source;
+class RateLimiter;
+class TransferJournal;
 
 class ThreadedWorker
 {
 public:
     ThreadedWorker(NetSock& sock, Server& server, const Node& remote);
-    void deleteFiles(PathHash folderHash, const std::vector<FileTime>& deldiff);
-    void uploadFiles(PathHash folderHash, const std::vector<SourceFile>& updiff);
+    /// Print progress as whole lines starting with prefix instead of updating it in place,
+    /// so that several workers can share the terminal
+    void setOutputPrefix(const std::string& prefix);
+    /// Limits our bulk transfers with these shared limiters, either may be null
+    void setRateLimiters(RateLimiter* global, RateLimiter* node);
+    /// Records our progress in journal, and resumes the large files it lists as partially transferred
+    void setJournal(TransferJournal* journal);
+    unsigned deleteFiles(PathHash folderHash, const std::vector<FileTime>& deldiff); ///< Returns the number of files deleted
+    unsigned uploadFiles(PathHash folderHash, const std::vector<SourceFile>& updiff); ///< Returns the number of files uploaded
+    /// Restores files from the remote archive into src, returns the number of files restored
+    unsigned downloadFiles(PathHash folderHash, const std::vector<FileTime>& downdiff, Source& src);
+    /// Spreads the uploads across n workers, so that each part has about the same size. Keeps the order of the files.
+    static std::vector<std::vector<SourceFile>> splitUploads(const std::vector<SourceFile>& updiff, size_t n);
+
+public:
+    static std::mutex outputMutex; ///< Held while printing a line, shared by all workers
 
 public:
     // Limits
     static constexpr int maxNetQueueSize = 10,
                         maxZipQueueSize = 4096, maxZipDataSize = 50*1024*1024;
+    /// Uploads are limited by the bytes in flight (see FlowWindow), this only bounds the number of requests
+    static constexpr int maxUploadQueueSize = 64;
+private:
+    enum class Event
+    {
+        Abort, ///< Abort requested, or the connection was closed
+        Reply, ///< A reply is ready to be read
+        ZipReady, ///< The zip thread pushed a buffer
+    };
+    /// Blocks until the remote replies, the zip thread has data (if zipReady isn't null), or we must abort
+    Event waitForEvent(const EventFd* zipReady) const;
+    void printLine(const std::string& line, bool error) const; ///< Prints a prefixed line
+    void printAborted(int queueSize) const; ///< Reports that the requests in flight were aborted
+    void throttle(size_t bytes) const; ///< Waits until the rate limiters let us transfer this many bytes
+
 private:
     NetSock& sock;
     Server& server;
     const Node& node;
+    std::string outputPrefix;
+    bool prefixed;
+    RateLimiter* globalLimiter;
+    RateLimiter* nodeLimiter;
+    TransferJournal* journal;
 };
 
 #endif // THREADEDWORKER_H
@@ -0,0 +1,132 @@
+#include "transferjournal.h"
+#include "serialize.h"
+#include "settings.h"
+#include "util/filelocker.h"
+#include "util/pathtools.h"
+
+using namespace std;
+
+TransferJournal::TransferJournal(const std::string& path)
+{
+    createDirectory(journalPath());
+    file.reset(new FileLocker(path));
+
+    // A record may have been cut short if we were killed while writing it, the rest is still good
+    vector<char> data = file->readAll();
+    constexpr size_t recordSize = 1+PathHash::hashlen+sizeof(uint64_t);
+    auto it = data.cbegin();
+    while ((size_t)(data.cend()-it) >= recordSize)
+    {
+        uint8_t type = ::deserializeConsume<uint8_t>(it);
+        PathHash hash = ::deserializeConsume<PathHash>(it);
+        uint64_t mtime = ::deserializeConsume<uint64_t>(it);
+        if (type == Done)
+        {
+            done[hash] = mtime;
+            partial.erase(hash);
+        }
+        else if (type == Partial && (size_t)(data.cend()-it) >= sizeof(uint64_t))
+        {
+            uint64_t chunks = ::deserializeConsume<uint64_t>(it);
+            partial[hash] = {mtime, chunks};
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    // Rewrite what we kept, this drops a torn record and the progress superseded by later records
+    vector<char> compacted;
+    for (const auto& f : done)
+    {
+        serializeAppend(compacted, (uint8_t)Done);
+        serializeAppend(compacted, f.first);
+        serializeAppend(compacted, f.second);
+    }
+    for (const auto& f : partial)
+    {
+        serializeAppend(compacted, (uint8_t)Partial);
+        serializeAppend(compacted, f.first);
+        serializeAppend(compacted, f.second.first);
+        serializeAppend(compacted, f.second.second);
+    }
+    if (compacted.size() != data.size())
+        file->overwrite(compacted);
+}
+
+TransferJournal::~TransferJournal() = default;
+
+size_t TransferJournal::getDoneCount() const
+{
+    lock_guard<std::mutex> lock(mutex);
+    return done.size();
+}
+
+size_t TransferJournal::getPartialCount() const
+{
+    lock_guard<std::mutex> lock(mutex);
+    return partial.size();
+}
+
+bool TransferJournal::isPartial(const PathHash& hash, uint64_t mtime) const
+{
+    lock_guard<std::mutex> lock(mutex);
+    auto it = partial.find(hash);
+    return it != partial.end() && it->second.first == mtime;
+}
+
+uint64_t TransferJournal::getPartialChunks(const PathHash& hash, uint64_t mtime) const
+{
+    lock_guard<std::mutex> lock(mutex);
+    auto it = partial.find(hash);
+    if (it == partial.end() || it->second.first != mtime)
+        return 0;
+    return it->second.second;
+}
+
+void TransferJournal::fileDone(const PathHash& hash, uint64_t mtime)
+{
+    vector<char> record;
+    serializeAppend(record, (uint8_t)Done);
+    serializeAppend(record, hash);
+    serializeAppend(record, mtime);
+
+    lock_guard<std::mutex> lock(mutex);
+    done[hash] = mtime;
+    partial.erase(hash);
+    append(record);
+}
+
+void TransferJournal::filePartial(const PathHash& hash, uint64_t mtime, uint64_t chunks)
+{
+    vector<char> record;
+    serializeAppend(record, (uint8_t)Partial);
+    serializeAppend(record, hash);
+    serializeAppend(record, mtime);
+    serializeAppend(record, chunks);
+
+    lock_guard<std::mutex> lock(mutex);
+    partial[hash] = {mtime, chunks};
+    append(record);
+}
+
+void TransferJournal::clear()
+{
+    lock_guard<std::mutex> lock(mutex);
+    done.clear();
+    partial.clear();
+    file->truncate();
+    file->remove();
+}
+
+std::string TransferJournal::getPath(const PathHash& folder, const std::string& nodePk, bool restore)
+{
+    return journalPath()+folder.toBase64()+'.'+PathHash(nodePk).toBase64()+(restore ? ".restore" : ".push");
+}
+
+void TransferJournal::append(const std::vector<char>& record)
+{
+    // The journal only saves work, a failed write means we may transfer some data again
+    file->write(record);
+}
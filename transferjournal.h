@@ -0,0 +1,57 @@
+#ifndef TRANSFERJOURNAL_H
+#define TRANSFERJOURNAL_H
+
+#include "pathhash.h"
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+
+class FileLocker;
+
+/// Progress of a push or restore between one folder and one node, kept on disk so an interrupted transfer can resume
+/// Records the files that completed, and how many chunks of the large files in progress were transferred
+/// The journal is locked while open, so two transfers of the same folder to the same node can't mix their records
+class TransferJournal
+{
+public:
+    /// Opens the journal at path, reading the records left by an interrupted transfer. Throws if it is locked.
+    explicit TransferJournal(const std::string& path);
+    ~TransferJournal();
+
+    size_t getDoneCount() const; ///< Files completed by the interrupted transfers
+    size_t getPartialCount() const; ///< Files partially transferred
+    /// Returns true if the transfer of this version of the file was interrupted
+    bool isPartial(const PathHash& file, uint64_t mtime) const;
+    /// Returns how many chunks of this version of the file were transferred, 0 if none
+    uint64_t getPartialChunks(const PathHash& file, uint64_t mtime) const;
+
+    void fileDone(const PathHash& file, uint64_t mtime);
+    /// Records that the first chunks of a file were transferred
+    /// With 0 chunks, the file is still partial, but its transfer must start over
+    void filePartial(const PathHash& file, uint64_t mtime, uint64_t chunks);
+    /// The transfer completed, forgets all the records and deletes the journal
+    void clear();
+
+    /// Returns the path of the journal of transfers of a folder to or from a node
+    static std::string getPath(const PathHash& folder, const std::string& nodePk, bool restore);
+
+private:
+    void append(const std::vector<char>& record); ///< Appends a record to the file
+
+private:
+    /// Type of the records in the file, each followed by a path hash and an mtime
+    enum RecordType : uint8_t
+    {
+        Done = 0,
+        Partial = 1, ///< Followed by a uint64 count of chunks
+    };
+
+    mutable std::mutex mutex;
+    std::unique_ptr<FileLocker> file;
+    std::map<PathHash, uint64_t> done; ///< mtimes of the completed files
+    std::map<PathHash, std::pair<uint64_t, uint64_t>> partial; ///< mtimes and chunks of the files in progress
+};
+
+#endif // TRANSFERJOURNAL_H
@@ -0,0 +1,38 @@
+#include "util/eventfd.h"
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cstdint>
+#include <stdexcept>
+
+using namespace std;
+
+EventFd::EventFd()
+{
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0)
+        throw runtime_error("EventFd::EventFd: eventfd failed");
+}
+
+EventFd::~EventFd()
+{
+    close(fd);
+}
+
+int EventFd::getFd() const
+{
+    return fd;
+}
+
+void EventFd::notify() const noexcept
+{
+    uint64_t one = 1;
+    auto r = write(fd, &one, sizeof(one));
+    (void)r;
+}
+
+void EventFd::consume() const noexcept
+{
+    uint64_t count;
+    auto r = read(fd, &count, sizeof(count));
+    (void)r;
+}
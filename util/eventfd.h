@@ -0,0 +1,23 @@
+#ifndef EVENTFD_H
+#define EVENTFD_H
+
+/// Wraps a Linux eventfd, used to wake up a thread blocked in poll or epoll
+class EventFd
+{
+public:
+    EventFd();
+    ~EventFd();
+
+    int getFd() const;
+    void notify() const noexcept; ///< Makes the fd readable. Async-signal-safe.
+    void consume() const noexcept; ///< Makes the fd non-readable again
+
+private:
+    EventFd(const EventFd& other) = delete;
+    EventFd& operator=(const EventFd&) = delete;
+
+private:
+    int fd;
+};
+
+#endif // EVENTFD_H
@@ -2,21 +2,28 @@
 #include <cstdlib>
 #include <sys/file.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <string>
 #include <stdexcept>
 
 using namespace std;
 
-FileLocker::FileLocker(const string &path)
+FileLocker::FileLocker(const string &path, Mode mode)
     : path{path}
 {
-    fd = open(path.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP);
+    if (mode == ReadOnly)
+        fd = open(path.c_str(), O_RDONLY);
+    else
+        fd = open(path.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP);
     if (fd < 0)
         throw runtime_error("FileLocker::FileLocker: Unabled to open "+path);
 
-    if (flock(fd, LOCK_EX | LOCK_NB) < 0)
+    if (flock(fd, (mode == ReadOnly ? LOCK_SH : LOCK_EX) | LOCK_NB) < 0)
+    {
+        close(fd);
         throw runtime_error("FileLocker::FileLocker: Unable to lock  "+path);
+    }
 
 }
 
@@ -28,18 +35,24 @@ FileLocker::~FileLocker()
 
 std::vector<char> FileLocker::read(uint64_t startPos, uint64_t size) const noexcept
 {
-    lock_guard<decltype(mutex)> lock(mutex);
-    size_t fsize = lseek(fd, 0, SEEK_END);
-    if (fsize < startPos)
+    // pread doesn't move the position, so this needs no lock and doesn't get in the way of writes
+    struct stat buf;
+    if (fstat(fd, &buf) < 0 || (uint64_t)buf.st_size < startPos)
         return {};
-    if (fsize < startPos + size)
-        size = startPos - fsize;
-    lseek(fd, startPos, SEEK_SET);
+    if ((uint64_t)buf.st_size < startPos + size)
+        size = buf.st_size - startPos;
 
     vector<char> data(size);
-    auto r = ::read(fd, data.data(), size);
-    if (r<0)
-        data.clear();
+    char* dest = data.data();
+    while (size)
+    {
+        auto result = ::pread(fd, dest, size, startPos);
+        if (result <= 0)
+            return {};
+        dest += result;
+        startPos += result;
+        size -= result;
+    }
     return data;
 }
 
@@ -50,37 +63,62 @@ std::vector<char> FileLocker::readAll() const noexcept
     lseek(fd, 0, SEEK_SET);
 
     vector<char> data(size);
-    auto r = ::read(fd, data.data(), size);
-    if (r<0)
+    if (!readFull(data.data(), size))
         data.clear();
     return data;
 }
 
+uint64_t FileLocker::size() const noexcept
+{
+    lock_guard<decltype(mutex)> lock(mutex);
+    struct stat buf;
+    if (fstat(fd, &buf) < 0)
+        return 0;
+    return buf.st_size;
+}
+
 bool FileLocker::remove() const noexcept
 {
     lock_guard<decltype(mutex)> lock(mutex);
     return std::remove(path.c_str()) == 0;
 }
 
+bool FileLocker::sync() const noexcept
+{
+    // Our fd never changes, so writes don't have to wait for the sync
+    return fdatasync(fd) == 0;
+}
+
 bool FileLocker::truncate() const noexcept
+{
+    return truncate(0);
+}
+
+bool FileLocker::truncate(uint64_t size) const noexcept
 {
     lock_guard<decltype(mutex)> lock(mutex);
-    lseek(fd, 0, SEEK_SET);
-    return ftruncate(fd, 0) == 0;
+    lseek(fd, size, SEEK_SET);
+    return ftruncate(fd, size) == 0;
 }
 
 bool FileLocker::write(const char* data, size_t size) const noexcept
 {
     lock_guard<decltype(mutex)> lock(mutex);
-    auto result = ::write(fd, data, size);
-    return (result>0 && (size_t)result == size);
+    // A single write(2) can't transfer more than ~2GiB, so loop
+    while (size)
+    {
+        auto result = ::write(fd, data, size);
+        if (result <= 0)
+            return false;
+        data += result;
+        size -= result;
+    }
+    return true;
 }
 
 bool FileLocker::write(const std::vector<char>& data) const noexcept
 {
-    lock_guard<decltype(mutex)> lock(mutex);
-    auto result = ::write(fd, data.data(), data.size());
-    return (result>0 && (size_t)result == data.size());
+    return write(data.data(), data.size());
 }
 
 bool FileLocker::overwrite(const char* data, size_t size) const noexcept
@@ -98,3 +136,16 @@ bool FileLocker::overwrite(const std::vector<char>& data) const noexcept
         return false;
     return write(data);
 }
+
+bool FileLocker::readFull(char* dest, size_t size) const noexcept
+{
+    while (size)
+    {
+        auto result = ::read(fd, dest, size);
+        if (result <= 0)
+            return false;
+        dest += result;
+        size -= result;
+    }
+    return true;
+}
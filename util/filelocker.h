@@ -5,23 +5,37 @@
 #include <vector>
 #include <mutex>
 
-///< Acquires a shared lock on a file and release it on destruction
+///< Acquires a lock on a file and release it on destruction
 ///< Throws if the lock can't be acquired
 class FileLocker
 {
 public:
-    explicit FileLocker(const std::string& path);
+    enum Mode
+    {
+        ReadWrite, ///< Creates the file if needed and locks it exclusively
+        ReadOnly, ///< Opens an existing file with a shared lock, so readers don't block each other
+    };
+
+public:
+    explicit FileLocker(const std::string& path, Mode mode = ReadWrite);
     ~FileLocker();
 
+    /// Reads up to size bytes from startPos, less if the file ends first. Doesn't move the write position.
     std::vector<char> read(uint64_t startPos, uint64_t size) const noexcept;
     std::vector<char> readAll() const noexcept;
+    uint64_t size() const noexcept;
 
     bool remove() const noexcept;
     bool truncate() const noexcept;
+    bool truncate(uint64_t size) const noexcept; ///< Cuts the file to size, writes then continue from there
     bool write(const char* data, size_t size) const noexcept;
     bool write(const std::vector<char>& data) const noexcept;
     bool overwrite(const char* data, size_t size) const noexcept; ///< Truncate then write
     bool overwrite(const std::vector<char>& data) const noexcept; ///< Truncate then write
+    bool sync() const noexcept; ///< Waits until the data we wrote is on disk
+
+private:
+    bool readFull(char* dest, size_t size) const noexcept; ///< Reads exactly size bytes at the current position
 
 private:
     int fd;
@@ -1,5 +1,7 @@
 #include "util/humanreadable.h"
 #include <cstdlib>
+#include <cctype>
+#include <cstring>
 
 std::string humanReadableSize(double size)
 {
@@ -13,3 +15,27 @@ std::string humanReadableSize(double size)
     sprintf(buf, "%.*f %s", i, size, units[i]);
     return std::string(buf);
 }
+
+bool parseHumanReadableSize(const std::string& str, uint64_t& size)
+{
+    const char units[] = "kmgtpe";
+    char* end;
+    double value = strtod(str.c_str(), &end);
+    if (end == str.c_str() || value < 0)
+        return false;
+    if (*end)
+    {
+        const char* unit = strchr(units, tolower(*end));
+        if (!unit)
+            return false;
+        for (int i = unit-units+1; i; --i)
+            value *= 1024;
+        ++end;
+        if (tolower(*end) == 'b')
+            ++end;
+        if (*end)
+            return false;
+    }
+    size = value;
+    return true;
+}
@@ -2,7 +2,10 @@
 #define HUMANREADABLE_H
 
 #include <string>
+#include <cstdint>
 
 std::string humanReadableSize(double size);
+/// Parses a size like "512", "64k" or "1.5M" (powers of 1024), returns false if it's invalid
+bool parseHumanReadableSize(const std::string& str, uint64_t& size);
 
 #endif // HUMANREADABLE_H
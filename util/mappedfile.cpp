@@ -0,0 +1,57 @@
+#include "util/mappedfile.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <stdexcept>
+
+using namespace std;
+
+MappedFile::MappedFile(const std::string& path)
+    : map{nullptr}, length{0}
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        if (errno == ENOENT)
+            return;
+        throw runtime_error("MappedFile::MappedFile: Unable to open "+path);
+    }
+
+    struct stat buf;
+    if (fstat(fd, &buf) < 0)
+    {
+        close(fd);
+        throw runtime_error("MappedFile::MappedFile: Unable to stat "+path);
+    }
+    // mmap refuses empty mappings, and there's nothing to read anyway
+    if (buf.st_size)
+    {
+        void* addr = mmap(nullptr, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED)
+        {
+            close(fd);
+            throw runtime_error("MappedFile::MappedFile: Unable to map "+path);
+        }
+        map = (const char*)addr;
+        length = buf.st_size;
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if (map)
+        munmap((void*)map, length);
+}
+
+const char* MappedFile::data() const
+{
+    return map;
+}
+
+size_t MappedFile::size() const
+{
+    return length;
+}
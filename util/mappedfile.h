@@ -0,0 +1,27 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <string>
+#include <cstddef>
+
+/// Maps a whole file read-only in memory
+/// The mapping keeps the data we opened even if the file is then replaced or deleted
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& path); ///< Maps nothing if the file doesn't exist. Throws on errors.
+    ~MappedFile();
+
+    const char* data() const;
+    size_t size() const;
+
+private:
+    MappedFile(const MappedFile& other) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+private:
+    const char* map;
+    size_t length;
+};
+
+#endif // MAPPEDFILE_H
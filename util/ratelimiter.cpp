@@ -0,0 +1,50 @@
+#include "util/ratelimiter.h"
+#include <thread>
+
+using namespace std;
+
+RateLimiter::RateLimiter(uint64_t rate, uint64_t burst)
+    : rate{rate}, burst{burst ? burst : rate}, tokens(this->burst),
+      lastRefill{Clock::now()}, start{lastRefill}, total{0}
+{
+}
+
+void RateLimiter::acquire(size_t bytes)
+{
+    chrono::duration<double> wait{0};
+    {
+        lock_guard<std::mutex> lock(mutex);
+        Clock::time_point now = Clock::now();
+        if (!total)
+            start = now;
+        total += bytes;
+        if (!rate)
+            return;
+
+        tokens += chrono::duration<double>(now - lastRefill).count() * rate;
+        if (tokens > burst)
+            tokens = burst;
+        lastRefill = now;
+
+        // Go into debt instead of waiting for enough tokens, so transfers larger than the bucket still work
+        tokens -= bytes;
+        if (tokens < 0)
+            wait = chrono::duration<double>(-tokens / rate);
+    }
+    this_thread::sleep_for(wait);
+}
+
+uint64_t RateLimiter::getTotalBytes() const
+{
+    lock_guard<std::mutex> lock(mutex);
+    return total;
+}
+
+double RateLimiter::getAverageRate() const
+{
+    lock_guard<std::mutex> lock(mutex);
+    double elapsed = chrono::duration<double>(Clock::now() - start).count();
+    if (!total || elapsed <= 0)
+        return 0;
+    return total / elapsed;
+}
@@ -0,0 +1,31 @@
+#ifndef RATELIMITER_H
+#define RATELIMITER_H
+
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+/// Token bucket limiting the rate of a transfer, shared by all the threads doing this transfer
+/// Also measures the rate achieved, even when there is no limit
+class RateLimiter
+{
+public:
+    /// Rate in bytes per second, 0 for no limit. The bucket holds burst bytes, or one second of rate if burst is 0.
+    explicit RateLimiter(uint64_t rate = 0, uint64_t burst = 0);
+
+    void acquire(size_t bytes); ///< Blocks until we may transfer this many bytes
+    uint64_t getTotalBytes() const;
+    double getAverageRate() const; ///< In bytes per second, since the first transfer
+
+private:
+    using Clock = std::chrono::steady_clock;
+    uint64_t rate, burst;
+    double tokens; ///< Bytes we may transfer right now, negative if we're in debt
+    Clock::time_point lastRefill;
+    Clock::time_point start;
+    uint64_t total;
+    mutable std::mutex mutex;
+};
+
+#endif // RATELIMITER_H
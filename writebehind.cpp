@@ -0,0 +1,195 @@
+#include "writebehind.h"
+#include "archive.h"
+#include "net/netsock.h"
+#include <iostream>
+
+using namespace std;
+
+ClientWrites::ClientWrites(NetSock &sock, const std::function<void()>& notify)
+    : sock{sock}, notify{notify}, writesInFlight{0}
+{
+}
+
+ClientWrites::~ClientWrites()
+{
+    // The I/O threads still point to us and our socket
+    wait();
+}
+
+void ClientWrites::wait()
+{
+    unique_lock<std::mutex> lock(mutex);
+    for (;;)
+    {
+        vector<shared_ptr<Reply>> ready = takeReady();
+        if (!ready.empty())
+        {
+            lock.unlock();
+            send(ready);
+            lock.lock();
+            continue;
+        }
+        if (!writesInFlight && replies.empty())
+            return;
+        doneCond.wait(lock);
+    }
+}
+
+void ClientWrites::sendInOrder(NetPacket&& packet)
+{
+    {
+        lock_guard<std::mutex> lock(mutex);
+        uint32_t id = packet.id;
+        auto data = make_shared<NetPacket>(move(packet));
+        replies.push_back(make_shared<Reply>(Reply{{}, 0, id, [data](const vector<bool>&){return move(*data);}}));
+    }
+    sendReplies();
+}
+
+void ClientWrites::sendReplies()
+{
+    vector<shared_ptr<Reply>> ready;
+    {
+        lock_guard<std::mutex> lock(mutex);
+        ready = takeReady();
+    }
+    send(ready);
+}
+
+void ClientWrites::complete(const shared_ptr<Reply>& reply, size_t index, bool ok)
+{
+    // We notify with the lock held, so the client can't destroy us before we're done
+    lock_guard<std::mutex> lock(mutex);
+    writesInFlight--;
+    if (reply)
+    {
+        reply->results[index] = ok;
+        if (!--reply->remaining)
+            notify();
+    }
+    doneCond.notify_all();
+}
+
+std::vector<std::shared_ptr<ClientWrites::Reply>> ClientWrites::takeReady()
+{
+    // The client matches numbered replies by ID, only the unnumbered ones must wait for the unnumbered before them
+    vector<shared_ptr<Reply>> ready;
+    bool ordered = false; // An unnumbered reply is still waiting
+    for (auto it = replies.begin(); it != replies.end();)
+    {
+        if ((*it)->remaining || (ordered && !(*it)->id))
+        {
+            ordered |= !(*it)->id;
+            ++it;
+            continue;
+        }
+        ready.push_back(move(*it));
+        it = replies.erase(it);
+    }
+    return ready;
+}
+
+void ClientWrites::send(const std::vector<std::shared_ptr<Reply>>& ready)
+{
+    // Only the client's own thread sends, so replies taken in order go out in order
+    for (const shared_ptr<Reply>& reply : ready)
+    {
+        try {
+            NetPacket packet = reply->makeReply(reply->results);
+            packet.id = reply->id;
+            sock.send(packet);
+        } catch (const exception& e) {
+            cout << "ClientWrites: Couldn't send reply ("<<e.what()<<')'<<endl;
+        }
+    }
+}
+
+WriteBehind::WriteBehind(unsigned threadCount, size_t maxQueuedBytes, Durability durability)
+    : durability{durability}, maxQueuedBytes{maxQueuedBytes}, queuedBytes{0}, stopping{false},
+      queues(max(threadCount, 1u))
+{
+    for (unsigned i=0; i<queues.size(); ++i)
+        threads.emplace_back(&WriteBehind::ioThread, this, i);
+}
+
+WriteBehind::~WriteBehind()
+{
+    {
+        lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    workCond.notify_all();
+    for (thread& t : threads)
+        t.join();
+}
+
+void WriteBehind::submit(ClientWrites &client, Archive &archive, vector<FileWrite>&& files,
+                         uint32_t id, const ReplyMaker &makeReply)
+{
+    auto sendNow = [&](const vector<bool>& results)
+    {
+        NetPacket packet = makeReply(results);
+        packet.id = id;
+        client.sendInOrder(move(packet));
+    };
+    if (files.empty())
+    {
+        sendNow({});
+        return;
+    }
+
+    shared_ptr<ClientWrites::Reply> reply;
+    {
+        lock_guard<std::mutex> lock(client.mutex);
+        client.writesInFlight += files.size();
+        if (durability != Durability::Queued)
+        {
+            reply = make_shared<ClientWrites::Reply>(ClientWrites::Reply{vector<bool>(files.size()), files.size(),
+                                                                         id, makeReply});
+            client.replies.push_back(reply);
+        }
+    }
+
+    for (size_t i=0; i<files.size(); ++i)
+    {
+        unique_lock<std::mutex> lock(mutex);
+        // A write larger than the whole queue still goes through once the queue is empty
+        spaceCond.wait(lock, [&]{return !queuedBytes || queuedBytes + files[i].data.size() <= maxQueuedBytes;});
+        queuedBytes += files[i].data.size();
+        unsigned thread = files[i].hash.prefix(16) % queues.size();
+        queues[thread].push_back({&client, reply, i, &archive, move(files[i])});
+        workCond.notify_all();
+    }
+
+    if (durability == Durability::Queued)
+        sendNow(vector<bool>(files.size(), true));
+}
+
+void WriteBehind::ioThread(unsigned index)
+{
+    deque<Job>& queue = queues[index];
+    unique_lock<std::mutex> lock(mutex);
+    for (;;)
+    {
+        workCond.wait(lock, [&]{return stopping || !queue.empty();});
+        if (queue.empty())
+            return;
+        Job job = move(queue.front());
+        queue.pop_front();
+        lock.unlock();
+
+        bool ok = true;
+        try {
+            job.archive->writeArchiveFile(job.file.hash, job.file.mtime, job.file.data, durability == Durability::Durable);
+        } catch (const exception& e) {
+            cout << "WriteBehind: Failed to write "<<job.file.hash.toBase64()<<" ("<<e.what()<<')'<<endl;
+            ok = false;
+        }
+        size_t size = job.file.data.size();
+        job.client->complete(job.reply, job.index, ok);
+
+        lock.lock();
+        queuedBytes -= size;
+        spaceCond.notify_all();
+    }
+}
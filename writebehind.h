@@ -0,0 +1,117 @@
+#ifndef WRITEBEHIND_H
+#define WRITEBEHIND_H
+
+#include "pathhash.h"
+#include "net/netpacket.h"
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+class Archive;
+class NetSock;
+
+/// When the server acknowledges an uploaded file
+enum class Durability
+{
+    Queued, ///< As soon as the write is queued, failed writes are only logged
+    Written, ///< Once the file was written
+    Durable, ///< Once the file was written and synced to disk
+};
+
+/// Replies owed to one client for its queued writes
+/// Replies to unnumbered requests are sent in the order of the requests, numbered ones as soon as they're ready
+/// The I/O threads never send, a client that stops reading must not stall them. They call notify when replies
+/// are ready, and the thread that handles the client sends them with sendReplies.
+/// Must outlive the client's writes, the destructor waits for them
+class ClientWrites
+{
+public:
+    /// notify is called by the I/O threads, it must not block
+    ClientWrites(NetSock& sock, const std::function<void()>& notify);
+    ~ClientWrites();
+
+    /// Blocks until all our writes are done and their replies sent, sending them as they're ready
+    /// Handle a request that isn't a write only after this, so its reply comes in order and sees our writes
+    void wait();
+    /// Sends a reply after the replies we still owe, or right away if there are none or if it's numbered
+    void sendInOrder(NetPacket&& packet);
+    void sendReplies(); ///< Sends the replies that are ready, call it after notify
+
+private:
+    friend class WriteBehind;
+    using ReplyMaker = std::function<NetPacket(const std::vector<bool>& results)>;
+    /// A reply waiting on the writes of one request
+    struct Reply
+    {
+        std::vector<bool> results; ///< Whether each file of the request was written
+        size_t remaining; ///< Writes left before we can reply
+        uint32_t id; ///< Request ID, see NetPacket::id
+        ReplyMaker makeReply;
+    };
+
+    /// Records the result of one write, and notifies if its reply is now complete
+    void complete(const std::shared_ptr<Reply>& reply, size_t index, bool ok);
+    /// Removes the complete replies that don't have to wait, in the order to send them
+    std::vector<std::shared_ptr<Reply>> takeReady();
+    void send(const std::vector<std::shared_ptr<Reply>>& ready); ///< Sends without holding our lock
+
+private:
+    NetSock& sock;
+    const std::function<void()> notify;
+    std::mutex mutex;
+    std::condition_variable doneCond;
+    std::deque<std::shared_ptr<Reply>> replies;
+    size_t writesInFlight;
+};
+
+/// Writes uploaded archive files in the background, so the server can keep receiving while the disk works
+/// Each file always goes to the same I/O thread, so writes to one file stay in order
+class WriteBehind
+{
+public:
+    /// An archive file to write
+    struct FileWrite
+    {
+        PathHash hash;
+        uint64_t mtime;
+        std::vector<char> data;
+    };
+    using ReplyMaker = ClientWrites::ReplyMaker;
+
+public:
+    WriteBehind(unsigned threads, size_t maxQueuedBytes, Durability durability);
+    ~WriteBehind(); ///< Finishes the queued writes
+
+    /// Queues the files of one request, blocks while the queue is full
+    /// The reply made from the results of the writes is sent to the client once they're done (or queued),
+    /// with the ID of the request
+    void submit(ClientWrites& client, Archive& archive, std::vector<FileWrite>&& files,
+                uint32_t id, const ReplyMaker& makeReply);
+
+private:
+    struct Job
+    {
+        ClientWrites* client;
+        std::shared_ptr<ClientWrites::Reply> reply; ///< Null if the reply was already sent
+        size_t index; ///< Position of this file in its request
+        Archive* archive;
+        FileWrite file;
+    };
+    void ioThread(unsigned index);
+
+private:
+    Durability durability;
+    size_t maxQueuedBytes;
+    size_t queuedBytes;
+    bool stopping;
+    std::vector<std::deque<Job>> queues; ///< One per I/O thread
+    std::mutex mutex;
+    std::condition_variable workCond, spaceCond;
+    std::vector<std::thread> threads;
+};
+
+#endif // WRITEBEHIND_H